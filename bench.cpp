@@ -1,15 +1,27 @@
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <list>
+#include <malloc.h>
+#include <memory>
+#include <new>
 #include <random>
+#include <set>
+#include <string>
 #include <variant>
 
 #include <benchmark/benchmark.h>
 #include <boost/intrusive/avl_set.hpp>
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
 
 #include "qct.h"
 
-template <typename T>
-class comparable_node : public qct::node<> {
+template <typename T, typename Base = qct::node<>>
+class comparable_node : public Base {
 public:
     using value_type = T;
 
@@ -19,10 +31,101 @@ public:
         comparable_node const& lhs,
         comparable_node const& rhs) = default;
 
+    T const& key() const { return x_; }
+
+private:
+    T x_;
+};
+
+struct node_key {
+    template <typename Node>
+    decltype(auto) operator()(Node const& x) const
+    {
+        return x.key();
+    }
+};
+
+template <typename Node>
+using keyed_tree = qct::tree<Node, std::less<>, qct::key_of<node_key>>;
+
+template <typename Node>
+using stats_tree = qct::tree<Node, std::less<>, qct::stats<>>;
+
+template <typename T>
+class compact_comparable_node : public qct::compact_node<> {
+public:
+    using value_type = T;
+
+    compact_comparable_node() = default;
+    explicit compact_comparable_node(T x) : x_(x) {}
+
+    friend auto operator<=>(
+        compact_comparable_node const& lhs,
+        compact_comparable_node const& rhs) = default;
+
+private:
+    T x_{};
+};
+
+struct sum_augment {
+    using value_type = int64_t;
+
+    static value_type identity() { return 0; }
+    static value_type combine(value_type lhs, value_type rhs) { return lhs + rhs; }
+    static value_type lift(auto const& x) { return x.value(); }
+};
+
+template <typename T>
+class augmented_comparable_node : public qct::augmented_node<sum_augment> {
+public:
+    using value_type = T;
+
+    explicit augmented_comparable_node(T x) : x_(x) {}
+
+    friend auto operator<=>(
+        augmented_comparable_node const& lhs,
+        augmented_comparable_node const& rhs)
+    {
+        return lhs.x_ <=> rhs.x_;
+    }
+
+    T value() const { return x_; }
+
+private:
+    T x_;
+};
+
+template <typename T>
+class weighted_comparable_node : public qct::weighted_node<> {
+public:
+    using value_type = T;
+
+    explicit weighted_comparable_node(T x) : x_(x)
+    {
+        set_weight(static_cast<std::uint64_t>(x) % 16);
+    }
+
+    friend auto operator<=>(
+        weighted_comparable_node const& lhs,
+        weighted_comparable_node const& rhs)
+    {
+        return lhs.x_ <=> rhs.x_;
+    }
+
 private:
     T x_;
 };
 
+class prefix_string_node : public qct::prefix_node<> {
+public:
+    explicit prefix_string_node(std::string key) : key_{std::move(key)} {}
+
+    std::string const& key() const { return key_; }
+
+private:
+    std::string key_;
+};
+
 template <typename T>
 class boost_avl_node : public boost::intrusive::avl_set_base_hook<> {
 public:
@@ -39,10 +142,20 @@ private:
     T x_;
 };
 
+template <typename Node>
+using qct_lazy_tree = qct::tree<Node, std::less<>, qct::lazy_size>;
+
 constexpr auto a = sizeof(comparable_node<int64_t>);
 constexpr auto b = sizeof(boost_avl_node<int64_t>);
 constexpr auto init_size = 100000;
 
+// compact nodes must be allocated close to their tree
+template <typename Node>
+struct compact_arena {
+    qct::tree<Node> tree;
+    std::array<Node, init_size> nodes;
+};
+
 static std::size_t seed()
 {
     static auto seed = std::random_device{}();
@@ -79,6 +192,18 @@ static auto init_tree()
     return std::tuple{std::move(tree), std::move(nodes)};
 }
 
+template <typename Node>
+static auto init_compact_tree()
+{
+    auto distrib = init_rng<typename Node::value_type>();
+    auto arena = std::make_unique<compact_arena<Node>>();
+    for (auto& node : arena->nodes) {
+        node = Node{distrib()};
+        arena->tree.insert(node);
+    }
+    return arena;
+}
+
 class iteration_timer {
 public:
     explicit iteration_timer(benchmark::State& state)
@@ -141,6 +266,268 @@ static void BM_erase(benchmark::State& state)
     }
 }
 
+template <typename Set>
+static void BM_set_emplace_erase(benchmark::State& state)
+{
+    auto distrib = init_rng<int64_t>();
+    Set set;
+    for (std::size_t i = 0; i < init_size; ++i) {
+        set.emplace(distrib());
+    }
+
+    for (auto _ : state) {
+        auto it = set.emplace(distrib());
+        benchmark::DoNotOptimize(it);
+        set.erase(it);
+    }
+}
+
+// string keys whose first bytes are random, like hashes or user names
+template <typename Node>
+static void BM_string_find(benchmark::State& state)
+{
+    auto distrib = init_rng<uint64_t>();
+    auto const make_key = [&] {
+        char key[33];
+        std::snprintf(
+            key,
+            sizeof key,
+            "%016llx%016llx",
+            static_cast<unsigned long long>(distrib()),
+            static_cast<unsigned long long>(distrib()));
+        return std::string{key};
+    };
+    std::vector<Node> nodes;
+    nodes.reserve(init_size);
+    keyed_tree<Node> tree;
+    for (std::size_t i = 0; i < init_size; ++i) {
+        tree.insert(nodes.emplace_back(make_key()));
+    }
+    std::vector<std::string> queries;
+    for (std::size_t i = 0; i < 1 << 16; ++i) {
+        queries.push_back(nodes[distrib() % init_size].key());
+    }
+
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tree.find(queries[i++ % queries.size()]));
+    }
+}
+
+// inserts of random keys into a tree growing to state.range(0) nodes
+template <typename Tree>
+static void BM_ingest(benchmark::State& state)
+{
+    using Node = comparable_node<int64_t>;
+    auto distrib = init_rng<int64_t>();
+    std::vector<Node> nodes;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        nodes.emplace_back(distrib());
+    }
+
+    for (auto _ : state) {
+        Tree tree;
+        for (auto& x : nodes) {
+            tree.insert(x);
+        }
+        if constexpr (requires { tree.flush(); }) {
+            tree.flush();
+        }
+        benchmark::DoNotOptimize(tree);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template <typename F>
+static void BM_btree(benchmark::State& state, F lookup)
+{
+    auto distrib = init_rng<int64_t>();
+    qct::btree_multiset<int64_t> set;
+    for (std::size_t i = 0; i < init_size; ++i) {
+        set.insert(distrib());
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(lookup(set, distrib()));
+    }
+}
+
+// union of a tree of init_size nodes with one of state.range(0) nodes, whose
+// keys are interleaved or, like range sharded indexes, all greater
+template <bool Parallel, bool Join, bool Interleaved = true>
+static void BM_set_union(benchmark::State& state)
+{
+    using Node = comparable_node<int64_t>;
+    auto distrib = init_rng<int64_t>();
+    auto const make_nodes = [&](std::size_t n) {
+        std::vector<Node> nodes;
+        nodes.reserve(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            nodes.emplace_back(distrib());
+        }
+        std::sort(nodes.begin(), nodes.end(), std::less<>{});
+        return nodes;
+    };
+    auto lhs_nodes = make_nodes(init_size);
+    auto rhs_nodes = make_nodes(static_cast<std::size_t>(state.range(0)));
+    if constexpr (!Interleaved) {
+        auto const max = std::numeric_limits<int64_t>::max();
+        auto const n = static_cast<int64_t>(rhs_nodes.size());
+        for (int64_t i = 0; i < n; ++i) {
+            rhs_nodes[i] = Node{max - n + i};
+        }
+        std::erase_if(lhs_nodes, [&](Node const& x) { return !(x < rhs_nodes[0]); });
+    }
+    qct::thread_executor ex;
+
+    for (auto _ : state) {
+        qct::tree<Node> lhs, rhs;
+        lhs.assign_sorted(lhs_nodes.begin(), lhs_nodes.end());
+        rhs.assign_sorted(rhs_nodes.begin(), rhs_nodes.end());
+
+        iteration_timer timer(state);
+        if constexpr (!Join) {
+            rhs.clear();
+            for (auto& x : rhs_nodes) {
+                lhs.insert(x);
+            }
+        }
+        else if constexpr (Parallel) {
+            lhs.set_union(std::move(rhs), [](Node&) {}, ex);
+        }
+        else {
+            lhs.set_union(std::move(rhs), [](Node&) {});
+        }
+        benchmark::DoNotOptimize(lhs);
+    }
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_assign_sorted(benchmark::State& state)
+{
+    auto distrib = init_rng<typename Node::value_type>();
+
+    std::vector<Node> nodes;
+    nodes.reserve(init_size);
+    for (std::size_t i = 0; i < init_size; ++i) {
+        nodes.emplace_back(distrib());
+    }
+    std::sort(nodes.begin(), nodes.end(), std::less<>{});
+
+    for (auto _ : state) {
+        TreeT<Node> tree;
+        tree.assign_sorted(nodes.begin(), nodes.end());
+        benchmark::DoNotOptimize(tree);
+    }
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_assign_sorted_parallel(benchmark::State& state)
+{
+    auto distrib = init_rng<typename Node::value_type>();
+
+    std::vector<Node> nodes;
+    nodes.reserve(init_size);
+    for (std::size_t i = 0; i < init_size; ++i) {
+        nodes.emplace_back(distrib());
+    }
+    std::sort(nodes.begin(), nodes.end(), std::less<>{});
+    qct::thread_executor ex;
+
+    for (auto _ : state) {
+        TreeT<Node> tree;
+        tree.assign_sorted(nodes.begin(), nodes.end(), ex);
+        benchmark::DoNotOptimize(tree);
+    }
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_parallel_for_each(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+    qct::thread_executor ex;
+
+    for (auto _ : state) {
+        std::atomic<std::size_t> count{0};
+        tree.parallel_for_each(
+            tree.begin(),
+            tree.end(),
+            [&](auto& node) {
+                benchmark::DoNotOptimize(node);
+                count.fetch_add(1, std::memory_order_relaxed);
+            },
+            ex);
+        benchmark::DoNotOptimize(count.load());
+    }
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_insert_sorted(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+    auto distrib = init_rng<typename Node::value_type>();
+
+    std::vector<Node> batch;
+    batch.reserve(1000);
+    for (std::size_t i = 0; i < batch.capacity(); ++i) {
+        batch.emplace_back(distrib());
+    }
+    std::sort(batch.begin(), batch.end(), std::less<>{});
+
+    for (auto _ : state) {
+        {
+            iteration_timer _(state);
+            tree.insert_sorted(batch.begin(), batch.end());
+        }
+
+        for (auto& node : batch) {
+            tree.erase(tree.find(node));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * batch.size());
+}
+
+template <template <typename...> typename TreeT, typename Node, bool Hinted>
+static void BM_insert_append(benchmark::State& state)
+{
+    auto distrib = init_rng<typename Node::value_type>();
+
+    std::vector<Node> nodes;
+    nodes.reserve(init_size);
+    for (std::size_t i = 0; i < init_size; ++i) {
+        nodes.emplace_back(distrib());
+    }
+    std::sort(nodes.begin(), nodes.end(), std::less<>{});
+
+    for (auto _ : state) {
+        TreeT<Node> tree;
+        for (auto& node : nodes) {
+            if constexpr (Hinted) {
+                tree.insert(tree.end(), node);
+            }
+            else {
+                tree.insert(node);
+            }
+        }
+        benchmark::DoNotOptimize(tree);
+        tree.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * nodes.size());
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_split_join(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+    auto distrib = init_rng<typename Node::value_type>();
+
+    for (auto _ : state) {
+        auto right = tree.split(Node{distrib()});
+        tree.join(std::move(right));
+        benchmark::DoNotOptimize(tree);
+    }
+}
+
 template <template <typename...> typename TreeT, typename Node>
 static void BM_find(benchmark::State& state)
 {
@@ -165,6 +552,93 @@ static void BM_lower_bound(benchmark::State& state)
     }
 }
 
+template <template <typename...> typename TreeT, typename Node, bool Batch, bool Sorted>
+static void BM_lower_bound_keys(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+    auto distrib = init_rng<typename Node::value_type>();
+
+    std::vector<Node> keys;
+    for (int i = 0; i < 256; ++i) {
+        keys.emplace_back(distrib());
+    }
+    if constexpr (Sorted) {
+        std::sort(keys.begin(), keys.end(), std::less<>{});
+    }
+    std::vector<typename TreeT<Node>::iterator> out(keys.size());
+
+    for (auto _ : state) {
+        if constexpr (!Batch) {
+            std::transform(keys.begin(), keys.end(), out.begin(), [&](auto const& key) {
+                return tree.lower_bound(key);
+            });
+        }
+        else if constexpr (Sorted) {
+            tree.lower_bound_batch_sorted(keys, out.begin());
+        }
+        else {
+            tree.lower_bound_batch(keys, out.begin());
+        }
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// lookups spread over range(0) trees of 1024 nodes, one after the other or
+// interleaved
+template <bool Interleaved, bool Rank>
+static void BM_lower_bound_trees(benchmark::State& state)
+{
+    using Node = comparable_node<int64_t>;
+    using Tree = qct::tree<Node>;
+    auto distrib = init_rng<int64_t>();
+
+    auto const tree_count = static_cast<std::size_t>(state.range(0));
+    std::vector<std::vector<Node>> nodes(tree_count);
+    std::vector<Tree> trees(tree_count);
+    for (std::size_t i = 0; i < tree_count; ++i) {
+        nodes[i].reserve(1024);
+        for (int j = 0; j < 1024; ++j) {
+            trees[i].insert(nodes[i].emplace_back(distrib()));
+        }
+    }
+
+    std::mt19937 gen(seed());
+    std::uniform_int_distribution<std::size_t> owner(0, tree_count - 1);
+    std::vector<std::pair<Tree*, Node>> lookups;
+    for (int i = 0; i < 1 << 16; ++i) {
+        lookups.emplace_back(&trees[owner(gen)], Node{distrib()});
+    }
+    std::vector<Tree::iterator> out(lookups.size());
+
+    using search = std::conditional_t<Rank, Tree::rank_search, Tree::key_search<Node>>;
+    std::vector<search> searches(lookups.size());
+    for (auto _ : state) {
+        for (std::size_t i = 0; i < lookups.size(); ++i) {
+            auto& [tree, key] = lookups[i];
+            auto const rank = static_cast<std::size_t>(key.key()) % 1024;
+            if constexpr (Interleaved && Rank) {
+                searches[i] = tree->nth_search(rank);
+            }
+            else if constexpr (Interleaved) {
+                searches[i] = tree->lower_bound_search(key);
+            }
+            else if constexpr (Rank) {
+                out[i] = tree->nth(rank);
+            }
+            else {
+                out[i] = tree->lower_bound(key);
+            }
+        }
+        if constexpr (Interleaved) {
+            qct::interleave(searches);
+            std::ranges::transform(searches, out.begin(), &search::result);
+        }
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * lookups.size());
+}
+
 template <template <typename...> typename TreeT, typename Node>
 static void BM_equal_range(benchmark::State& state)
 {
@@ -177,6 +651,76 @@ static void BM_equal_range(benchmark::State& state)
     }
 }
 
+// lookups among keys repeated about 400 times each
+template <typename F>
+static void BM_duplicates(benchmark::State& state, F lookup)
+{
+    using Node = comparable_node<int64_t>;
+    constexpr int64_t distinct = 256;
+    auto distrib = init_rng<int64_t>();
+
+    std::vector<Node> nodes;
+    nodes.reserve(init_size);
+    qct::tree<Node> tree;
+    for (std::size_t i = 0; i < init_size; ++i) {
+        nodes.emplace_back(distrib() % distinct);
+        tree.insert(nodes.back());
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(lookup(tree, Node{distrib() % distinct}));
+    }
+}
+
+// items remaining after a page starting at a random key
+template <bool Ranked>
+static void BM_remaining(benchmark::State& state)
+{
+    using Node = comparable_node<int64_t>;
+    auto [tree, nodes] = init_tree<qct::tree, Node>();
+    auto distrib = init_rng<int64_t>();
+
+    for (auto _ : state) {
+        Node const x{distrib()};
+        if constexpr (Ranked) {
+            auto it = tree.lower_bound_with_rank(x);
+            benchmark::DoNotOptimize(tree.ranked_end() - it);
+        }
+        else {
+            auto it = tree.lower_bound(x);
+            benchmark::DoNotOptimize(tree.end() - it);
+        }
+    }
+}
+
+// lower_bound over state.range(0) nodes, inserted in random order
+template <bool Frozen>
+static void BM_lower_bound_large(benchmark::State& state)
+{
+    using Node = comparable_node<int64_t>;
+    auto distrib = init_rng<int64_t>();
+
+    std::vector<Node> nodes;
+    nodes.reserve(state.range(0));
+    qct::tree<Node> tree;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        nodes.emplace_back(distrib());
+        tree.insert(nodes.back());
+    }
+
+    if constexpr (Frozen) {
+        auto const frozen = tree.freeze(&Node::key);
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(frozen.lower_bound(distrib()));
+        }
+    }
+    else {
+        for (auto _ : state) {
+            benchmark::DoNotOptimize(tree.lower_bound(Node{distrib()}));
+        }
+    }
+}
+
 template <template <typename...> typename TreeT, typename Node>
 static void BM_distance(benchmark::State& state)
 {
@@ -201,38 +745,224 @@ static void BM_distance(benchmark::State& state)
 }
 
 template <template <typename...> typename TreeT, typename Node>
-static void BM_iter(benchmark::State& state)
+static void BM_fold(benchmark::State& state)
 {
     auto [tree, nodes] = init_tree<TreeT, Node>();
+    auto distrib = init_rng<std::size_t>();
 
     for (auto _ : state) {
-        for (auto it = tree.begin(); it != tree.end(); ++it) {
-            benchmark::DoNotOptimize(it);
+        auto lo = distrib() % init_size;
+        auto hi = distrib() % init_size;
+        if (lo > hi) {
+            std::swap(lo, hi);
         }
+        benchmark::DoNotOptimize(tree.fold(tree.nth(lo), tree.nth(hi)));
     }
 }
 
-template <template <typename...> typename TreeT, typename Node>
-static void BM_reverse_iter(benchmark::State& state)
+// every thread looks up random keys while the first one also keeps inserting
+// and erasing a node
+template <typename Node>
+static void BM_concurrent_find(benchmark::State& state)
 {
-    auto [tree, nodes] = init_tree<TreeT, Node>();
+    static qct::concurrent_tree<Node> tree;
+    static std::vector<std::unique_ptr<Node>> nodes;
+    if (state.thread_index() == 0) {
+        auto distrib = init_rng<typename Node::value_type>();
+        for (std::size_t i = 0; i < init_size; ++i) {
+            nodes.push_back(std::make_unique<Node>(distrib()));
+            tree.insert(*nodes.back());
+        }
+    }
+    auto distrib = init_rng<typename Node::value_type>();
+    Node extra{0};
 
     for (auto _ : state) {
-        for (auto it = tree.end(); it != tree.begin(); --it) {
-            benchmark::DoNotOptimize(it);
+        if (state.thread_index() == 0) {
+            tree.insert(extra);
+            tree.erase(extra);
         }
+        benchmark::DoNotOptimize(tree.lower_bound(Node{distrib()}));
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0) {
+        tree.write([](auto& tree) { tree.clear(); });
+        nodes.clear();
     }
 }
 
-static void BM_qct_insert(benchmark::State& state)
+static auto init_persistent_tree()
 {
-    BM_insert<qct::tree, comparable_node<int64_t>>(state);
+    auto distrib = init_rng<int64_t>();
+    qct::persistent_tree<int64_t> tree;
+    for (std::size_t i = 0; i < init_size; ++i) {
+        tree.insert(distrib());
+    }
+    return tree;
 }
-BENCHMARK(BM_qct_insert);
 
-static void BM_boost_avl_insert(benchmark::State& state)
+// each insertion is made on a fresh snapshot, which is then released
+static void BM_persistent_insert(benchmark::State& state)
 {
-    BM_insert<boost::intrusive::avl_multiset, boost_avl_node<int64_t>>(state);
+    auto const tree = init_persistent_tree();
+    auto distrib = init_rng<int64_t>();
+
+    for (auto _ : state) {
+        auto snapshot = tree.snapshot();
+        snapshot.insert(distrib());
+        benchmark::DoNotOptimize(snapshot);
+    }
+}
+BENCHMARK(BM_persistent_insert);
+
+static void BM_persistent_nth(benchmark::State& state)
+{
+    auto const tree = init_persistent_tree();
+    auto distrib = init_rng<std::size_t>();
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tree.nth(distrib() % init_size));
+    }
+}
+BENCHMARK(BM_persistent_nth);
+
+static void BM_persistent_iter(benchmark::State& state)
+{
+    auto const tree = init_persistent_tree();
+    auto it = tree.begin();
+
+    for (auto _ : state) {
+        if (it == tree.end()) {
+            it = tree.begin();
+        }
+        benchmark::DoNotOptimize(*it);
+        ++it;
+    }
+}
+BENCHMARK(BM_persistent_iter);
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_select_by_weight(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+    auto distrib = init_rng<std::uint64_t>();
+    auto const total = tree.weighted_distance(tree.begin(), tree.end());
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tree.select_by_weight(distrib() % total));
+    }
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_weighted_rank_of(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+    auto distrib = init_rng<typename Node::value_type>();
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tree.weighted_rank_of(Node{distrib()}));
+    }
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_count_less(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+    auto distrib = init_rng<typename Node::value_type>();
+
+    for (auto _ : state) {
+        auto x = distrib();
+        benchmark::DoNotOptimize(tree.count_less(Node{x}));
+    }
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_nth(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+    auto distrib = init_rng<std::size_t>();
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tree.nth(distrib() % tree.size()));
+    }
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_iter(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+
+    for (auto _ : state) {
+        for (auto it = tree.begin(); it != tree.end(); ++it) {
+            benchmark::DoNotOptimize(it);
+        }
+    }
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_reverse_iter(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+
+    for (auto _ : state) {
+        for (auto it = tree.end(); it != tree.begin(); --it) {
+            benchmark::DoNotOptimize(it);
+        }
+    }
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_scan(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+
+    for (auto _ : state) {
+        for (auto& node : tree.scan()) {
+            benchmark::DoNotOptimize(node);
+        }
+    }
+}
+
+template <template <typename...> typename TreeT, typename Node>
+static void BM_reverse_scan(benchmark::State& state)
+{
+    auto [tree, nodes] = init_tree<TreeT, Node>();
+
+    for (auto _ : state) {
+        for (auto& node : tree.reverse_scan()) {
+            benchmark::DoNotOptimize(node);
+        }
+    }
+}
+
+static void BM_qct_insert(benchmark::State& state)
+{
+    BM_insert<qct::tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_insert);
+
+static void BM_qct_stats_insert(benchmark::State& state)
+{
+    BM_insert<stats_tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_stats_insert);
+
+static void BM_qct_ingest(benchmark::State& state)
+{
+    BM_ingest<qct::tree<comparable_node<int64_t>>>(state);
+}
+BENCHMARK(BM_qct_ingest)->Arg(init_size)->Arg(1 << 20);
+
+static void BM_qct_buffered_ingest(benchmark::State& state)
+{
+    BM_ingest<qct::buffered_tree<comparable_node<int64_t>>>(state);
+}
+BENCHMARK(BM_qct_buffered_ingest)->Arg(init_size)->Arg(1 << 20);
+
+static void BM_boost_avl_insert(benchmark::State& state)
+{
+    BM_insert<boost::intrusive::avl_multiset, boost_avl_node<int64_t>>(state);
 }
 BENCHMARK(BM_boost_avl_insert);
 
@@ -248,30 +978,259 @@ static void BM_boost_avl_erase(benchmark::State& state)
 }
 BENCHMARK(BM_boost_avl_erase);
 
+static void BM_qct_lazy_insert(benchmark::State& state)
+{
+    BM_insert<qct_lazy_tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_lazy_insert);
+
+static void BM_qct_lazy_erase(benchmark::State& state)
+{
+    BM_erase<qct_lazy_tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_lazy_erase);
+
+static void BM_qct_multiset_emplace_erase(benchmark::State& state)
+{
+    BM_set_emplace_erase<qct::ordered_multiset<int64_t>>(state);
+}
+BENCHMARK(BM_qct_multiset_emplace_erase);
+
+static void BM_std_multiset_emplace_erase(benchmark::State& state)
+{
+    BM_set_emplace_erase<std::multiset<int64_t>>(state);
+}
+BENCHMARK(BM_std_multiset_emplace_erase);
+
+static void BM_btree_multiset_emplace_erase(benchmark::State& state)
+{
+    BM_set_emplace_erase<qct::btree_multiset<int64_t>>(state);
+}
+BENCHMARK(BM_btree_multiset_emplace_erase);
+
+static void BM_btree_lower_bound(benchmark::State& state)
+{
+    BM_btree(state, [](auto const& set, int64_t x) { return set.lower_bound(x); });
+}
+BENCHMARK(BM_btree_lower_bound);
+
+static void BM_btree_count_less(benchmark::State& state)
+{
+    BM_btree(state, [](auto const& set, int64_t x) { return set.count_less(x); });
+}
+BENCHMARK(BM_btree_count_less);
+
+static void BM_btree_nth(benchmark::State& state)
+{
+    BM_btree(state, [](auto const& set, int64_t x) {
+        return set.nth(static_cast<std::size_t>(x) % set.size());
+    });
+}
+BENCHMARK(BM_btree_nth);
+
+static void BM_qct_assign_sorted(benchmark::State& state)
+{
+    BM_assign_sorted<qct::tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_assign_sorted);
+
+static void BM_qct_assign_sorted_parallel(benchmark::State& state)
+{
+    BM_assign_sorted_parallel<qct::tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_assign_sorted_parallel)->UseRealTime();
+
+static void BM_qct_parallel_for_each(benchmark::State& state)
+{
+    BM_parallel_for_each<qct::tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_parallel_for_each)->UseRealTime();
+
+static void BM_qct_union_insert(benchmark::State& state)
+{
+    BM_set_union<false, false>(state);
+}
+BENCHMARK(BM_qct_union_insert)->Arg(init_size / 100)->Arg(init_size)->UseManualTime();
+
+static void BM_qct_set_union(benchmark::State& state)
+{
+    BM_set_union<false, true>(state);
+}
+BENCHMARK(BM_qct_set_union)->Arg(init_size / 100)->Arg(init_size)->UseManualTime();
+
+static void BM_qct_union_insert_disjoint(benchmark::State& state)
+{
+    BM_set_union<false, false, false>(state);
+}
+BENCHMARK(BM_qct_union_insert_disjoint)->Arg(init_size)->UseManualTime();
+
+static void BM_qct_set_union_disjoint(benchmark::State& state)
+{
+    BM_set_union<false, true, false>(state);
+}
+BENCHMARK(BM_qct_set_union_disjoint)->Arg(init_size)->UseManualTime();
+
+static void BM_qct_set_union_parallel(benchmark::State& state)
+{
+    BM_set_union<true, true>(state);
+}
+BENCHMARK(BM_qct_set_union_parallel)
+    ->Arg(init_size / 100)
+    ->Arg(init_size)
+    ->UseManualTime();
+
+static void BM_qct_insert_sorted(benchmark::State& state)
+{
+    BM_insert_sorted<qct::tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_insert_sorted);
+
+static void BM_qct_insert_append(benchmark::State& state)
+{
+    BM_insert_append<qct::tree, comparable_node<int64_t>, false>(state);
+}
+BENCHMARK(BM_qct_insert_append);
+
+static void BM_qct_insert_append_hint(benchmark::State& state)
+{
+    BM_insert_append<qct::tree, comparable_node<int64_t>, true>(state);
+}
+BENCHMARK(BM_qct_insert_append_hint);
+
+static void BM_boost_avl_insert_append_hint(benchmark::State& state)
+{
+    BM_insert_append<boost::intrusive::avl_multiset, boost_avl_node<int64_t>, true>(
+        state);
+}
+BENCHMARK(BM_boost_avl_insert_append_hint);
+
+static void BM_qct_split_join(benchmark::State& state)
+{
+    BM_split_join<qct::tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_split_join);
+
 static void BM_qct_find(benchmark::State& state)
 {
     BM_find<qct::tree, comparable_node<int64_t>>(state);
 }
 BENCHMARK(BM_qct_find);
 
+static void BM_qct_key_of_find(benchmark::State& state)
+{
+    BM_find<keyed_tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_key_of_find);
+
+static void BM_qct_stats_find(benchmark::State& state)
+{
+    BM_find<stats_tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_stats_find);
+
+static void BM_qct_string_find(benchmark::State& state)
+{
+    BM_string_find<comparable_node<std::string>>(state);
+}
+BENCHMARK(BM_qct_string_find);
+
+static void BM_qct_prefix_string_find(benchmark::State& state)
+{
+    BM_string_find<prefix_string_node>(state);
+}
+BENCHMARK(BM_qct_prefix_string_find);
+
 static void BM_boost_avl_find(benchmark::State& state)
 {
     BM_find<boost::intrusive::avl_multiset, boost_avl_node<int64_t>>(state);
 }
 BENCHMARK(BM_boost_avl_find);
 
+static void BM_qct_compact_find(benchmark::State& state)
+{
+    using Node = compact_comparable_node<int64_t>;
+    auto arena = init_compact_tree<Node>();
+    auto distrib = init_rng<std::size_t>();
+
+    for (auto _ : state) {
+        auto const& x = arena->nodes[distrib() % arena->nodes.size()];
+        benchmark::DoNotOptimize(arena->tree.find(x));
+    }
+}
+BENCHMARK(BM_qct_compact_find);
+
 static void BM_qct_lower_bound(benchmark::State& state)
 {
     BM_lower_bound<qct::tree, comparable_node<int64_t>>(state);
 }
 BENCHMARK(BM_qct_lower_bound);
 
+static void BM_qct_key_of_lower_bound(benchmark::State& state)
+{
+    BM_lower_bound<keyed_tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_key_of_lower_bound);
+
 static void BM_boost_avl_lower_bound(benchmark::State& state)
 {
     BM_lower_bound<boost::intrusive::avl_multiset, boost_avl_node<int64_t>>(state);
 }
 BENCHMARK(BM_boost_avl_lower_bound);
 
+static void BM_qct_compact_lower_bound(benchmark::State& state)
+{
+    using Node = compact_comparable_node<int64_t>;
+    auto arena = init_compact_tree<Node>();
+    auto distrib = init_rng<int64_t>();
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(arena->tree.lower_bound(Node{distrib()}));
+    }
+}
+BENCHMARK(BM_qct_compact_lower_bound);
+
+static void BM_qct_lower_bound_loop(benchmark::State& state)
+{
+    BM_lower_bound_keys<qct::tree, comparable_node<int64_t>, false, false>(state);
+}
+BENCHMARK(BM_qct_lower_bound_loop);
+
+static void BM_qct_lower_bound_batch(benchmark::State& state)
+{
+    BM_lower_bound_keys<qct::tree, comparable_node<int64_t>, true, false>(state);
+}
+BENCHMARK(BM_qct_lower_bound_batch);
+
+static void BM_qct_lower_bound_batch_sorted(benchmark::State& state)
+{
+    BM_lower_bound_keys<qct::tree, comparable_node<int64_t>, true, true>(state);
+}
+BENCHMARK(BM_qct_lower_bound_batch_sorted);
+
+static void BM_qct_lower_bound_trees(benchmark::State& state)
+{
+    BM_lower_bound_trees<false, false>(state);
+}
+BENCHMARK(BM_qct_lower_bound_trees)->Arg(16)->Arg(4096);
+
+static void BM_qct_lower_bound_trees_interleaved(benchmark::State& state)
+{
+    BM_lower_bound_trees<true, false>(state);
+}
+BENCHMARK(BM_qct_lower_bound_trees_interleaved)->Arg(16)->Arg(4096);
+
+static void BM_qct_nth_trees(benchmark::State& state)
+{
+    BM_lower_bound_trees<false, true>(state);
+}
+BENCHMARK(BM_qct_nth_trees)->Arg(16)->Arg(4096);
+
+static void BM_qct_nth_trees_interleaved(benchmark::State& state)
+{
+    BM_lower_bound_trees<true, true>(state);
+}
+BENCHMARK(BM_qct_nth_trees_interleaved)->Arg(16)->Arg(4096);
+
 static void BM_qct_equal_range(benchmark::State& state)
 {
     BM_equal_range<qct::tree, comparable_node<int64_t>>(state);
@@ -284,6 +1243,55 @@ static void BM_boost_avl_equal_range(benchmark::State& state)
 }
 BENCHMARK(BM_boost_avl_equal_range);
 
+static void BM_qct_lower_bound_large(benchmark::State& state)
+{
+    BM_lower_bound_large<false>(state);
+}
+BENCHMARK(BM_qct_lower_bound_large)->Arg(1 << 16)->Arg(1 << 20)->Arg(1 << 24);
+
+static void BM_frozen_lower_bound_large(benchmark::State& state)
+{
+    BM_lower_bound_large<true>(state);
+}
+BENCHMARK(BM_frozen_lower_bound_large)->Arg(1 << 16)->Arg(1 << 20)->Arg(1 << 24);
+
+static void BM_qct_lower_bound_duplicates(benchmark::State& state)
+{
+    BM_duplicates(state, [](auto& tree, auto const& x) { return tree.lower_bound(x); });
+}
+BENCHMARK(BM_qct_lower_bound_duplicates);
+
+static void BM_qct_equal_range_duplicates(benchmark::State& state)
+{
+    BM_duplicates(state, [](auto& tree, auto const& x) { return tree.equal_range(x); });
+}
+BENCHMARK(BM_qct_equal_range_duplicates);
+
+static void BM_qct_equal_range_count_duplicates(benchmark::State& state)
+{
+    BM_duplicates(
+        state, [](auto& tree, auto const& x) { return tree.equal_range_count(x); });
+}
+BENCHMARK(BM_qct_equal_range_count_duplicates);
+
+static void BM_qct_count_duplicates(benchmark::State& state)
+{
+    BM_duplicates(state, [](auto& tree, auto const& x) { return tree.count(x); });
+}
+BENCHMARK(BM_qct_count_duplicates);
+
+static void BM_qct_remaining(benchmark::State& state)
+{
+    BM_remaining<false>(state);
+}
+BENCHMARK(BM_qct_remaining);
+
+static void BM_qct_ranked_remaining(benchmark::State& state)
+{
+    BM_remaining<true>(state);
+}
+BENCHMARK(BM_qct_ranked_remaining);
+
 static void BM_qct_distance(benchmark::State& state)
 {
     BM_distance<qct::tree, comparable_node<int64_t>>(state);
@@ -296,6 +1304,48 @@ static void BM_boost_avl_distance(benchmark::State& state)
 }
 BENCHMARK(BM_boost_avl_distance);
 
+static void BM_qct_fold(benchmark::State& state)
+{
+    BM_fold<qct::tree, augmented_comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_fold);
+
+static void BM_qct_augmented_insert(benchmark::State& state)
+{
+    BM_insert<qct::tree, augmented_comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_augmented_insert);
+
+static void BM_qct_concurrent_find(benchmark::State& state)
+{
+    BM_concurrent_find<comparable_node<int64_t, qct::atomic_node>>(state);
+}
+BENCHMARK(BM_qct_concurrent_find)->ThreadRange(1, 32)->UseRealTime();
+
+static void BM_qct_select_by_weight(benchmark::State& state)
+{
+    BM_select_by_weight<qct::tree, weighted_comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_select_by_weight);
+
+static void BM_qct_weighted_rank_of(benchmark::State& state)
+{
+    BM_weighted_rank_of<qct::tree, weighted_comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_weighted_rank_of);
+
+static void BM_qct_count_less(benchmark::State& state)
+{
+    BM_count_less<qct::tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_count_less);
+
+static void BM_qct_nth(benchmark::State& state)
+{
+    BM_nth<qct::tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_nth);
+
 static void BM_qct_iter(benchmark::State& state)
 {
     BM_iter<qct::tree, comparable_node<int64_t>>(state);
@@ -321,4 +1371,680 @@ static void BM_boost_avl_reverse_iter(benchmark::State& state)
 }
 BENCHMARK(BM_boost_avl_reverse_iter);
 
+static void BM_qct_scan(benchmark::State& state)
+{
+    BM_scan<qct::tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_scan);
+
+static void BM_qct_reverse_scan(benchmark::State& state)
+{
+    BM_reverse_scan<qct::tree, comparable_node<int64_t>>(state);
+}
+BENCHMARK(BM_qct_reverse_scan);
+
+// scaling suite: the same workloads over containers of 1k keys and up, with
+// several key distributions and key types
+
+// the scaling benchmarks stop at 10M keys, 100M can take tens of GB
+#ifndef QCT_BENCH_MAX_SIZE
+#define QCT_BENCH_MAX_SIZE 10000000
+#endif
+
+constexpr int64_t scaling_max_size = QCT_BENCH_MAX_SIZE;
+constexpr std::size_t query_count = 1 << 16;
+
+enum class key_distribution {
+    uniform,
+    // keys inserted in increasing order
+    sequential,
+    // uniform keys, zipf distributed lookups
+    zipf,
+    // n / 64 distinct keys
+    duplicates,
+};
+
+static char const* name(key_distribution dist)
+{
+    constexpr char const* names[] = {"uniform", "sequential", "zipf", "duplicates"};
+    return names[static_cast<int>(dist)];
+}
+
+// sizes from 1k keys, each with the distributions
+static void scaling_args(
+    benchmark::internal::Benchmark* b,
+    int64_t max_size,
+    std::vector<key_distribution> const& dists)
+{
+    std::vector<int64_t> dist_args;
+    for (auto dist : dists) {
+        dist_args.push_back(static_cast<int64_t>(dist));
+    }
+    b->ArgsProduct({benchmark::CreateRange(1000, max_size, 10), dist_args})
+        ->ArgNames({"n", "dist"});
+}
+
+static void all_distributions(benchmark::internal::Benchmark* b)
+{
+    scaling_args(
+        b,
+        scaling_max_size,
+        {key_distribution::uniform,
+         key_distribution::sequential,
+         key_distribution::zipf,
+         key_distribution::duplicates});
+}
+
+static void rank_distributions(benchmark::internal::Benchmark* b)
+{
+    scaling_args(
+        b, scaling_max_size, {key_distribution::uniform, key_distribution::duplicates});
+}
+
+static void uniform_distribution(benchmark::internal::Benchmark* b)
+{
+    scaling_args(b, scaling_max_size, {key_distribution::uniform});
+}
+
+// for the keys ten times larger than an int64_t
+static void large_key_distribution(benchmark::internal::Benchmark* b)
+{
+    scaling_args(b, scaling_max_size / 10, {key_distribution::uniform});
+}
+
+// the second argument is the percentage of writes
+static void mixed_args(benchmark::internal::Benchmark* b)
+{
+    b->ArgsProduct(
+         {benchmark::CreateRange(1000, scaling_max_size, 100), {0, 10, 50, 100}})
+        ->ArgNames({"n", "writes"});
+}
+
+// a key dragging a cache line and a half of payload along
+struct payload_key {
+    int64_t key;
+    std::array<char, 120> payload{};
+
+    friend bool operator==(payload_key const& lhs, payload_key const& rhs)
+    {
+        return lhs.key == rhs.key;
+    }
+    friend auto operator<=>(payload_key const& lhs, payload_key const& rhs)
+    {
+        return lhs.key <=> rhs.key;
+    }
+};
+
+template <typename Key>
+static Key make_key(int64_t x)
+{
+    if constexpr (std::same_as<Key, std::string>) {
+        // long keys sharing a prefix, like the paths of an object store
+        char digits[17];
+        std::snprintf(
+            digits, sizeof digits, "%016llx", static_cast<unsigned long long>(x));
+        return std::string{"tenant/0042/objects/"} + digits;
+    }
+    else if constexpr (std::same_as<Key, payload_key>) {
+        return payload_key{x};
+    }
+    else {
+        return x;
+    }
+}
+
+// zipf distributed ranks in [0, n), generated as in YCSB
+class zipf_distribution {
+public:
+    explicit zipf_distribution(std::size_t n, double theta = 0.99)
+        : n_{n}, theta_{theta}, alpha_{1 / (1 - theta)}, zeta_n_{zeta(n, theta)}
+    {
+        eta_ = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / zeta_n_);
+    }
+
+    template <typename Gen>
+    std::size_t operator()(Gen& gen) const
+    {
+        auto const u = std::uniform_real_distribution<double>{}(gen);
+        auto const uz = u * zeta_n_;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, theta_)) {
+            return 1;
+        }
+        auto const rank = n_ * std::pow(eta_ * u - eta_ + 1, alpha_);
+        return std::min(n_ - 1, static_cast<std::size_t>(rank));
+    }
+
+private:
+    static double zeta(std::size_t n, double theta)
+    {
+        double sum = 0;
+        for (std::size_t i = 1; i <= n; ++i) {
+            sum += 1 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+    std::size_t n_;
+    double theta_;
+    double alpha_;
+    double zeta_n_;
+    double eta_;
+};
+
+static std::vector<int64_t> make_keys(key_distribution dist, std::size_t n)
+{
+    std::mt19937_64 gen(seed());
+    std::uniform_int_distribution<int64_t> distrib(
+        std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max());
+    std::vector<int64_t> keys(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        switch (dist) {
+        case key_distribution::sequential:
+            keys[i] = static_cast<int64_t>(i);
+            break;
+        case key_distribution::duplicates:
+            keys[i] = distrib(gen) % static_cast<int64_t>(n / 64 + 1);
+            break;
+        default:
+            keys[i] = distrib(gen);
+        }
+    }
+    return keys;
+}
+
+// indices of the keys to look up
+static std::vector<std::size_t> make_lookups(key_distribution dist, std::size_t n)
+{
+    std::mt19937_64 gen(seed());
+    std::vector<std::size_t> lookups(query_count);
+    if (dist == key_distribution::zipf) {
+        zipf_distribution const zipf{n};
+        std::ranges::generate(lookups, [&] { return zipf(gen); });
+    }
+    else {
+        std::uniform_int_distribution<std::size_t> distrib(0, n - 1);
+        std::ranges::generate(lookups, [&] { return distrib(gen); });
+    }
+    return lookups;
+}
+
+// bytes allocated and not freed yet on this thread, to measure the footprint
+// of the containers. Both sides count the usable size of the block, so every
+// overload of delete, sized or not, aligned or not, takes back what new added.
+thread_local std::size_t live_bytes = 0;
+
+static void* tracked_alloc(std::size_t size, std::size_t alignment)
+{
+    size = std::max<std::size_t>(size, 1);
+    // aligned_alloc takes a multiple of the alignment
+    void* p = alignment <= alignof(std::max_align_t)
+                  ? std::malloc(size)
+                  : std::aligned_alloc(
+                        alignment, (size + alignment - 1) / alignment * alignment);
+    if (!p) {
+        throw std::bad_alloc{};
+    }
+    live_bytes += malloc_usable_size(p);
+    return p;
+}
+
+// not inlined into the delete expressions, which would otherwise see free()
+// called on memory from new
+[[gnu::noinline]] static void tracked_free(void* p) noexcept
+{
+    if (p) {
+        live_bytes -= malloc_usable_size(p);
+        std::free(p);
+    }
+}
+
+void* operator new(std::size_t size) { return tracked_alloc(size, 0); }
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return tracked_alloc(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept { tracked_free(p); }
+void operator delete(void* p, std::size_t) noexcept { tracked_free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { tracked_free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { tracked_free(p); }
+
+// all the containers are multisets built from the keys, which replace() can
+// change one at a time
+template <typename Key>
+class qct_container {
+public:
+    using key_type = Key;
+    using query_type = Key;
+
+    explicit qct_container(std::vector<int64_t> const& keys)
+    {
+        nodes_.reserve(keys.size());
+        for (auto x : keys) {
+            tree_.insert(nodes_.emplace_back(make_key<Key>(x)));
+        }
+    }
+
+    static Key const& make_query(Key const& key) { return key; }
+    bool contains(Key const& key) const { return tree_.find(key) != tree_.end(); }
+    std::size_t rank(Key const& key) const { return tree_.count_less(key); }
+    Key const& select(std::size_t k) const { return tree_.nth(k)->key(); }
+    auto begin() const { return tree_.begin(); }
+    auto end() const { return tree_.end(); }
+
+    template <typename It>
+    static std::ptrdiff_t distance(It first, It last)
+    {
+        return last - first;
+    }
+
+    void replace(std::size_t slot, int64_t, int64_t key)
+    {
+        auto& node = nodes_[slot];
+        tree_.erase(typename tree_type::iterator{&node});
+        node = node_type{make_key<Key>(key)};
+        tree_.insert(node);
+    }
+
+private:
+    using node_type = comparable_node<Key>;
+    using tree_type = keyed_tree<node_type>;
+
+    std::vector<node_type> nodes_;
+    tree_type tree_;
+};
+
+template <typename Key>
+class frozen_container {
+public:
+    using key_type = Key;
+    using query_type = Key;
+
+    explicit frozen_container(std::vector<int64_t> const& keys)
+    {
+        std::vector<Key> sorted;
+        sorted.reserve(keys.size());
+        for (auto x : keys) {
+            sorted.push_back(make_key<Key>(x));
+        }
+        std::ranges::sort(sorted);
+        tree_ = qct::frozen_tree<Key>{std::move(sorted)};
+    }
+
+    static Key const& make_query(Key const& key) { return key; }
+    bool contains(Key const& key) const
+    {
+        auto const it = tree_.lower_bound(key);
+        return it != tree_.end() && *it == key;
+    }
+    std::size_t rank(Key const& key) const { return tree_.lower_bound(key) - tree_.begin(); }
+    Key const& select(std::size_t k) const { return *tree_.nth(k); }
+
+private:
+    qct::frozen_tree<Key> tree_;
+};
+
+template <typename Key>
+class btree_container {
+public:
+    using key_type = Key;
+    using query_type = Key;
+
+    explicit btree_container(std::vector<int64_t> const& keys)
+    {
+        for (auto x : keys) {
+            set_.insert(make_key<Key>(x));
+        }
+    }
+
+    static Key const& make_query(Key const& key) { return key; }
+    bool contains(Key const& key) const { return set_.find(key) != set_.end(); }
+    std::size_t rank(Key const& key) const { return set_.count_less(key); }
+    Key const& select(std::size_t k) const { return *set_.nth(k); }
+    auto begin() const { return set_.begin(); }
+    auto end() const { return set_.end(); }
+
+    template <typename It>
+    static std::ptrdiff_t distance(It first, It last)
+    {
+        return last - first;
+    }
+
+    void replace(std::size_t, int64_t old, int64_t key)
+    {
+        set_.erase(set_.find(make_key<Key>(old)));
+        set_.insert(make_key<Key>(key));
+    }
+
+private:
+    qct::btree_multiset<Key> set_;
+};
+
+template <typename Key>
+class multiset_container {
+public:
+    using key_type = Key;
+    using query_type = Key;
+
+    explicit multiset_container(std::vector<int64_t> const& keys)
+    {
+        for (auto x : keys) {
+            set_.insert(make_key<Key>(x));
+        }
+    }
+
+    static Key const& make_query(Key const& key) { return key; }
+    bool contains(Key const& key) const { return set_.contains(key); }
+    auto begin() const { return set_.begin(); }
+    auto end() const { return set_.end(); }
+
+    template <typename It>
+    static std::ptrdiff_t distance(It first, It last)
+    {
+        return std::distance(first, last);
+    }
+
+    void replace(std::size_t, int64_t old, int64_t key)
+    {
+        set_.erase(set_.find(make_key<Key>(old)));
+        set_.insert(make_key<Key>(key));
+    }
+
+private:
+    std::multiset<Key, std::less<>> set_;
+};
+
+// order statistic tree of (key, slot), the slots keep equal keys apart
+template <typename Key>
+class pbds_container {
+public:
+    using key_type = Key;
+    using query_type = std::pair<Key, std::size_t>;
+
+    explicit pbds_container(std::vector<int64_t> const& keys)
+    {
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            set_.insert({make_key<Key>(keys[i]), i});
+        }
+    }
+
+    static query_type make_query(Key const& key) { return {key, 0}; }
+    bool contains(query_type const& key) const
+    {
+        auto const it = set_.lower_bound(key);
+        return it != set_.end() && it->first == key.first;
+    }
+    std::size_t rank(query_type const& key) const { return set_.order_of_key(key); }
+    Key const& select(std::size_t k) const { return set_.find_by_order(k)->first; }
+    auto begin() const { return set_.begin(); }
+    auto end() const { return set_.end(); }
+
+    template <typename It>
+    std::ptrdiff_t distance(It first, It last) const
+    {
+        return static_cast<std::ptrdiff_t>(set_.order_of_key(*last))
+               - static_cast<std::ptrdiff_t>(set_.order_of_key(*first));
+    }
+
+    void replace(std::size_t slot, int64_t old, int64_t key)
+    {
+        set_.erase({make_key<Key>(old), slot});
+        set_.insert({make_key<Key>(key), slot});
+    }
+
+private:
+    __gnu_pbds::tree<
+        query_type,
+        __gnu_pbds::null_type,
+        std::less<>,
+        __gnu_pbds::rb_tree_tag,
+        __gnu_pbds::tree_order_statistics_node_update>
+        set_;
+};
+
+template <typename Key>
+class sorted_vector_container {
+public:
+    using key_type = Key;
+    using query_type = Key;
+
+    explicit sorted_vector_container(std::vector<int64_t> const& keys)
+    {
+        keys_.reserve(keys.size());
+        for (auto x : keys) {
+            keys_.push_back(make_key<Key>(x));
+        }
+        std::ranges::sort(keys_);
+    }
+
+    static Key const& make_query(Key const& key) { return key; }
+    bool contains(Key const& key) const { return std::ranges::binary_search(keys_, key); }
+    std::size_t rank(Key const& key) const
+    {
+        return std::ranges::lower_bound(keys_, key) - keys_.begin();
+    }
+    Key const& select(std::size_t k) const { return keys_[k]; }
+
+    void replace(std::size_t, int64_t old, int64_t key)
+    {
+        keys_.erase(std::ranges::lower_bound(keys_, make_key<Key>(old)));
+        auto value = make_key<Key>(key);
+        keys_.insert(std::ranges::upper_bound(keys_, value), std::move(value));
+    }
+
+private:
+    std::vector<Key> keys_;
+};
+
+// the container of the keys, with the bytes it allocated per key as a counter
+template <typename Container>
+static auto make_container(benchmark::State& state, std::vector<int64_t> const& keys)
+{
+    auto const before = live_bytes;
+    auto container = std::make_unique<Container>(keys);
+    state.counters["bytes_per_key"] = static_cast<double>(live_bytes - before)
+                                      / static_cast<double>(keys.size());
+    return container;
+}
+
+template <typename Container>
+static auto make_queries(
+    std::vector<int64_t> const& keys,
+    std::vector<std::size_t> const& lookups)
+{
+    using Key = typename Container::key_type;
+    std::vector<typename Container::query_type> queries;
+    queries.reserve(lookups.size());
+    for (auto i : lookups) {
+        queries.push_back(Container::make_query(make_key<Key>(keys[i])));
+    }
+    return queries;
+}
+
+template <typename Container>
+static void BM_scaling_find(benchmark::State& state)
+{
+    auto const n = static_cast<std::size_t>(state.range(0));
+    auto const dist = static_cast<key_distribution>(state.range(1));
+    state.SetLabel(name(dist));
+    auto const keys = make_keys(dist, n);
+    auto const queries = make_queries<Container>(keys, make_lookups(dist, n));
+    auto const container = make_container<Container>(state, keys);
+
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(container->contains(queries[i++ % query_count]));
+    }
+}
+
+template <typename Container>
+static void BM_scaling_rank(benchmark::State& state)
+{
+    auto const n = static_cast<std::size_t>(state.range(0));
+    auto const dist = static_cast<key_distribution>(state.range(1));
+    state.SetLabel(name(dist));
+    auto const keys = make_keys(dist, n);
+    auto const queries = make_queries<Container>(keys, make_lookups(dist, n));
+    auto const container = make_container<Container>(state, keys);
+
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(container->rank(queries[i++ % query_count]));
+    }
+}
+
+template <typename Container>
+static void BM_scaling_select(benchmark::State& state)
+{
+    auto const n = static_cast<std::size_t>(state.range(0));
+    auto const keys = make_keys(key_distribution::uniform, n);
+    auto const ranks = make_lookups(key_distribution::uniform, n);
+    auto const container = make_container<Container>(state, keys);
+
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(container->select(ranks[i++ % query_count]));
+    }
+}
+
+// state.range(1) percent of the operations replace a key, the others look one
+// up
+template <typename Container>
+static void BM_scaling_mixed(benchmark::State& state)
+{
+    using Key = typename Container::key_type;
+    auto const n = static_cast<std::size_t>(state.range(0));
+    auto keys = make_keys(key_distribution::uniform, n);
+    auto const slots = make_lookups(key_distribution::uniform, n);
+    auto const new_keys = make_keys(key_distribution::uniform, query_count);
+    auto const container = make_container<Container>(state, keys);
+
+    std::mt19937 gen(seed());
+    auto const write_percent = static_cast<std::mt19937::result_type>(state.range(1));
+    std::vector<bool> writes(query_count);
+    for (std::size_t i = 0; i < query_count; ++i) {
+        writes[i] = gen() % 100 < write_percent;
+    }
+
+    std::size_t i = 0;
+    for (auto _ : state) {
+        auto const op = i++ % query_count;
+        auto const slot = slots[op];
+        if (writes[op]) {
+            container->replace(slot, keys[slot], new_keys[op]);
+            keys[slot] = new_keys[op];
+        }
+        else {
+            auto const query = Container::make_query(make_key<Key>(keys[slot]));
+            benchmark::DoNotOptimize(container->contains(query));
+        }
+    }
+}
+
+// distance between iterators 16 positions apart or anywhere in the container
+template <typename Container, bool Far>
+static void BM_scaling_distance(benchmark::State& state)
+{
+    auto const n = static_cast<std::size_t>(state.range(0));
+    auto const container = make_container<Container>(
+        state, make_keys(key_distribution::uniform, n));
+    std::vector<decltype(container->begin())> positions;
+    positions.reserve(n);
+    for (auto it = container->begin(); it != container->end(); ++it) {
+        positions.push_back(it);
+    }
+
+    auto const firsts = make_lookups(key_distribution::uniform, n);
+    auto lasts = firsts;
+    std::ranges::shuffle(lasts, std::mt19937_64{seed() + 1});
+    std::vector<std::pair<std::size_t, std::size_t>> pairs;
+    for (std::size_t i = 0; i < query_count; ++i) {
+        if constexpr (Far) {
+            pairs.push_back(std::minmax(firsts[i], lasts[i]));
+        }
+        else {
+            pairs.emplace_back(firsts[i], std::min(firsts[i] + 16, n - 1));
+        }
+    }
+
+    std::size_t i = 0;
+    for (auto _ : state) {
+        auto const [first, last] = pairs[i++ % query_count];
+        benchmark::DoNotOptimize(container->distance(positions[first], positions[last]));
+    }
+}
+
+BENCHMARK_TEMPLATE(BM_scaling_find, qct_container<int64_t>)->Apply(all_distributions);
+BENCHMARK_TEMPLATE(BM_scaling_find, qct_container<std::string>)
+    ->Apply(large_key_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_find, qct_container<payload_key>)
+    ->Apply(large_key_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_find, frozen_container<int64_t>)->Apply(all_distributions);
+BENCHMARK_TEMPLATE(BM_scaling_find, frozen_container<std::string>)
+    ->Apply(large_key_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_find, frozen_container<payload_key>)
+    ->Apply(large_key_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_find, btree_container<int64_t>)->Apply(all_distributions);
+BENCHMARK_TEMPLATE(BM_scaling_find, btree_container<std::string>)
+    ->Apply(large_key_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_find, btree_container<payload_key>)
+    ->Apply(large_key_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_find, multiset_container<int64_t>)->Apply(all_distributions);
+BENCHMARK_TEMPLATE(BM_scaling_find, multiset_container<std::string>)
+    ->Apply(large_key_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_find, multiset_container<payload_key>)
+    ->Apply(large_key_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_find, pbds_container<int64_t>)->Apply(all_distributions);
+BENCHMARK_TEMPLATE(BM_scaling_find, pbds_container<std::string>)
+    ->Apply(large_key_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_find, pbds_container<payload_key>)
+    ->Apply(large_key_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_find, sorted_vector_container<int64_t>)
+    ->Apply(all_distributions);
+BENCHMARK_TEMPLATE(BM_scaling_find, sorted_vector_container<std::string>)
+    ->Apply(large_key_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_find, sorted_vector_container<payload_key>)
+    ->Apply(large_key_distribution);
+
+BENCHMARK_TEMPLATE(BM_scaling_rank, qct_container<int64_t>)->Apply(rank_distributions);
+BENCHMARK_TEMPLATE(BM_scaling_rank, frozen_container<int64_t>)->Apply(rank_distributions);
+BENCHMARK_TEMPLATE(BM_scaling_rank, btree_container<int64_t>)->Apply(rank_distributions);
+BENCHMARK_TEMPLATE(BM_scaling_rank, pbds_container<int64_t>)->Apply(rank_distributions);
+BENCHMARK_TEMPLATE(BM_scaling_rank, sorted_vector_container<int64_t>)
+    ->Apply(rank_distributions);
+
+BENCHMARK_TEMPLATE(BM_scaling_select, qct_container<int64_t>)->Apply(uniform_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_select, frozen_container<int64_t>)
+    ->Apply(uniform_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_select, btree_container<int64_t>)
+    ->Apply(uniform_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_select, pbds_container<int64_t>)->Apply(uniform_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_select, sorted_vector_container<int64_t>)
+    ->Apply(uniform_distribution);
+
+BENCHMARK_TEMPLATE(BM_scaling_mixed, qct_container<int64_t>)->Apply(mixed_args);
+BENCHMARK_TEMPLATE(BM_scaling_mixed, btree_container<int64_t>)->Apply(mixed_args);
+BENCHMARK_TEMPLATE(BM_scaling_mixed, multiset_container<int64_t>)->Apply(mixed_args);
+BENCHMARK_TEMPLATE(BM_scaling_mixed, pbds_container<int64_t>)->Apply(mixed_args);
+BENCHMARK_TEMPLATE(BM_scaling_mixed, sorted_vector_container<int64_t>)->Apply(mixed_args);
+
+BENCHMARK_TEMPLATE(BM_scaling_distance, qct_container<int64_t>, false)
+    ->Apply(uniform_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_distance, qct_container<int64_t>, true)
+    ->Apply(uniform_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_distance, btree_container<int64_t>, false)
+    ->Apply(uniform_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_distance, btree_container<int64_t>, true)
+    ->Apply(uniform_distribution);
+// linear in the distance, far pairs would take milliseconds each
+BENCHMARK_TEMPLATE(BM_scaling_distance, multiset_container<int64_t>, false)
+    ->Apply(uniform_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_distance, pbds_container<int64_t>, false)
+    ->Apply(uniform_distribution);
+BENCHMARK_TEMPLATE(BM_scaling_distance, pbds_container<int64_t>, true)
+    ->Apply(uniform_distribution);
+
 BENCHMARK_MAIN();
@@ -1,30 +1,308 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <functional>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <utility>
+#include <vector>
 
 namespace qct {
-namespace algorithms {
 
-constexpr bool bst_is_header(auto const* x)
+// tree option: defer subtree size updates until a rank query needs them. Ranks
+// then come from tree::rank, the hooks don't see the deferred updates.
+struct lazy_size {};
+
+// tree option: compare the keys KeyOf{}(node) instead of the nodes, the lookups
+// then take keys. With arithmetic keys the descents select the next child
+// without branching.
+template <typename KeyOf>
+struct key_of {};
+
+// counters of the work done by a tree, the default Stats of the stats option
+struct tree_stats {
+    std::uint64_t comparisons{0};
+    std::uint64_t descents{0};
+    std::uint64_t descent_steps{0};
+    std::uint64_t max_depth{0};
+    std::uint64_t single_rotations{0};
+    std::uint64_t double_rotations{0};
+    std::uint64_t rebalance_steps{0};
+    std::uint64_t size_updates{0};
+    std::uint64_t iterator_steps{0};
+
+    constexpr void on_comparison() { ++comparisons; }
+    // a descent from the root visited depth nodes
+    constexpr void on_descent(std::size_t depth)
+    {
+        ++descents;
+        descent_steps += depth;
+        max_depth = std::max<std::uint64_t>(max_depth, depth);
+    }
+    constexpr void on_rotation(bool double_rotation)
+    {
+        ++(double_rotation ? double_rotations : single_rotations);
+    }
+    // an insert or erase rebalanced steps ancestors
+    constexpr void on_rebalance(std::size_t steps) { rebalance_steps += steps; }
+    constexpr void on_size_update(std::size_t n) { size_updates += n; }
+    constexpr void on_iterator_step() { ++iterator_steps; }
+};
+
+// tree option: report the work done by the tree to a Stats, which provides the
+// on_* members of tree_stats, for example to fill histograms. It's exposed by
+// tree::stats(), and const lookups update it too. It isn't thread-safe, so the
+// parallel algorithms of trees with stats only take an inline_executor.
+template <typename Stats = tree_stats>
+struct stats {};
+
+namespace detail {
+
+template <typename Option, typename... Options>
+constexpr bool has_option = (std::same_as<Option, Options> || ...);
+
+template <typename... Options>
+struct key_of_option {
+    using type = void;
+};
+
+template <typename KeyOf, typename... Options>
+struct key_of_option<key_of<KeyOf>, Options...> {
+    using type = KeyOf;
+};
+
+template <typename Option, typename... Options>
+struct key_of_option<Option, Options...> : key_of_option<Options...> {};
+
+// stats hooks compiled out when the stats option is absent
+struct no_stats {
+    constexpr void on_comparison() {}
+    constexpr void on_descent(std::size_t) {}
+    constexpr void on_rotation(bool) {}
+    constexpr void on_rebalance(std::size_t) {}
+    constexpr void on_size_update(std::size_t) {}
+    constexpr void on_iterator_step() {}
+};
+
+template <typename... Options>
+struct stats_option {
+    using type = no_stats;
+};
+
+template <typename Stats, typename... Options>
+struct stats_option<stats<Stats>, Options...> {
+    using type = Stats;
+};
+
+template <typename Option, typename... Options>
+struct stats_option<Option, Options...> : stats_option<Options...> {};
+
+inline void prefetch(void const* p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(p);
+#else
+    (void)p;
+#endif
+}
+
+template <typename T>
+struct pointee {
+    using type = typename T::element_type;
+};
+
+template <typename T>
+struct pointee<T*> {
+    using type = T;
+};
+
+// weight type of weighted hooks, unused otherwise
+template <typename Node>
+struct weight_of {
+    using type = std::size_t;
+};
+
+template <typename Node>
+    requires requires { typename Node::weight_type; }
+struct weight_of<Node> {
+    using type = typename Node::weight_type;
+};
+
+// the first 8 bytes of s, zero padded, as an integer ordered like s: a lower
+// prefix means a lower string, equal prefixes can't tell
+constexpr std::uint64_t string_prefix(std::string_view s)
 {
-    if (!x->parent()) {
-        // header of empty tree
-        return true;
+    std::uint64_t prefix = 0;
+    if (s.size() >= 8) {
+        for (std::size_t i = 0; i < 8; ++i) {
+            prefix = prefix << 8 | static_cast<unsigned char>(s[i]);
+        }
+        return prefix;
     }
-    if (!x->right() || !x->left()) {
-        // header always has both right and left
-        return false;
+    for (std::size_t i = 0; i < s.size(); ++i) {
+        prefix = prefix << 8 | static_cast<unsigned char>(s[i]);
+    }
+    return s.empty() ? 0 : prefix << (8 * (8 - s.size()));
+}
+
+// 1 for the comparators ordering strings like their prefixes, -1 for those
+// ordering them the other way
+template <typename Comp>
+constexpr int prefix_order = 0;
+
+template <typename T>
+constexpr int prefix_order<std::less<T>> = 1;
+
+template <typename T>
+constexpr int prefix_order<std::greater<T>> = -1;
+
+template <typename Key>
+concept string_key =
+    std::same_as<Key, std::string> || std::same_as<Key, std::string_view>;
+
+// 32 bits pointer relative to its own address, so a structure using them can
+// be relocated as a whole as long as it spans less than 8GiB. Pointing further
+// throws std::out_of_range.
+template <typename T>
+class offset_ptr {
+public:
+    using element_type = T;
+
+    offset_ptr() = default;
+    offset_ptr(T* p) { *this = p; }
+    offset_ptr(offset_ptr const& other) : offset_ptr{other.get()} {}
+
+    offset_ptr& operator=(offset_ptr const& other) { return *this = other.get(); }
+    offset_ptr& operator=(T* p)
+    {
+        if (!p) {
+            offset_ = 0;
+            return *this;
+        }
+        auto const offset = (reinterpret_cast<std::intptr_t>(p) - address()) / scale;
+        if (offset < std::numeric_limits<std::int32_t>::min()
+            || offset > std::numeric_limits<std::int32_t>::max()) {
+            throw std::out_of_range{"offset_ptr target out of reach"};
+        }
+        offset_ = static_cast<std::int32_t>(offset);
+        return *this;
+    }
+
+    T* get() const
+    {
+        return offset_ ? reinterpret_cast<T*>(address() + offset_ * scale)
+                       : nullptr;
+    }
+    operator T*() const { return get(); }
+    T* operator->() const { return get(); }
+
+private:
+    // a link can't point to itself, so 0 is free to represent nullptr
+    static constexpr std::intptr_t scale = alignof(std::int32_t);
+
+    std::intptr_t address() const
+    {
+        return reinterpret_cast<std::intptr_t>(this);
+    }
+
+    std::int32_t offset_{0};
+};
+
+// field of a node shared with concurrent readers: stores release it and loads
+// acquire it, so a reader following a link sees the node as it was linked
+template <typename T>
+class shared_field {
+public:
+    using element_type = std::remove_pointer_t<T>;
+
+    shared_field() = default;
+    shared_field(T x) : value_{x} {}
+    shared_field(shared_field const& other) : value_{other.get()} {}
+
+    shared_field& operator=(shared_field const& other) { return *this = other.get(); }
+    shared_field& operator=(T x)
+    {
+        value_.store(x, std::memory_order_release);
+        return *this;
+    }
+
+    T get() const { return value_.load(std::memory_order_acquire); }
+    operator T() const { return get(); }
+    T operator->() const
+        requires std::is_pointer_v<T>
+    {
+        return get();
+    }
+
+    // a single writer at a time, so the updates don't need to be atomic
+    shared_field& operator+=(T n)
+        requires std::integral<T>
+    {
+        return *this = get() + n;
+    }
+    shared_field& operator-=(T n)
+        requires std::integral<T>
+    {
+        return *this = get() - n;
+    }
+    shared_field& operator++()
+        requires std::integral<T>
+    {
+        return *this += 1;
+    }
+    shared_field& operator--()
+        requires std::integral<T>
+    {
+        return *this -= 1;
     }
-    if (x->right() == x->left()) {
-        // header of single node tree
-        return true;
+    T operator++(int)
+        requires std::integral<T>
+    {
+        auto const retval = get();
+        *this = retval + 1;
+        return retval;
     }
-    if (x->right()->parent() != x || x->left()->parent() != x) {
-        // size > 1, header can't be the parent of both rightmost and leftmost
-        return true;
+    T operator--(int)
+        requires std::integral<T>
+    {
+        auto const retval = get();
+        *this = retval - 1;
+        return retval;
     }
-    return false;
+
+private:
+    std::atomic<T> value_{};
+};
+
+}
+
+namespace algorithms {
+
+// the header is marked by a balance no linked node can have
+constexpr int bst_header_balance = -2;
+
+constexpr bool bst_is_header(auto const* x)
+{
+    return x->balance() == bst_header_balance;
 }
 
 constexpr bool bst_is_root(auto const* x)
@@ -32,6 +310,29 @@ constexpr bool bst_is_root(auto const* x)
     return x->parent()->parent() == x;
 }
 
+constexpr std::size_t bst_distance_from_begin(auto const* x)
+{
+    if (bst_is_header(x)) {
+        if (!x->parent()) {
+            return 0;
+        }
+        return x->parent()->subtree_size();
+    }
+
+    std::size_t distance = 0;
+
+    if (x->left()) {
+        distance += x->left()->subtree_size();
+    }
+
+    for (; !bst_is_root(x); x = x->parent()) {
+        if (x == x->parent()->right()) {
+            distance += x->parent()->subtree_size() - x->subtree_size();
+        }
+    }
+    return distance;
+}
+
 }
 
 template <int SizeBits = 32, int BalanceBits = std::min(8, 64 - SizeBits)>
@@ -40,34 +341,18 @@ public:
     static constexpr auto size_bits = SizeBits;
     static constexpr auto balance_bits = BalanceBits;
 
-    template <typename T, typename Comp>
+    template <typename T, typename Comp, typename... Options>
     friend class tree;
+    template <typename T, typename Comp, typename... Options>
+    friend class concurrent_tree;
 
     constexpr auto operator<=>(node const&) const { return true <=> true; }
 
+    // with lazy_size, the subtree sizes may be stale and the result wrong, use
+    // tree::rank instead
     constexpr std::size_t distance_from_begin() const
     {
-        node const* x = this;
-
-        if (algorithms::bst_is_header(x)) {
-            if (!x->parent_) {
-                return 0;
-            }
-            return x->right_->distance_from_begin() + 1;
-        }
-
-        std::size_t distance = 0;
-
-        if (x->left_) {
-            distance += x->left_->subtree_size_;
-        }
-
-        for (; !algorithms::bst_is_root(x); x = x->parent_) {
-            if (x == x->parent_->right_) {
-                distance += x->parent_->subtree_size_ - x->subtree_size_;
-            }
-        }
-        return distance;
+        return algorithms::bst_distance_from_begin(this);
     }
 
     constexpr auto balance() const { return balance_; }
@@ -84,10 +369,269 @@ private:
     int8_t balance_ : BalanceBits{0};
 };
 
-template <typename Node, typename Comp = std::less<>>
+// hook of concurrent_tree: the links and subtree size, which its readers load
+// while a writer updates them, are atomic
+class atomic_node {
+public:
+    static constexpr auto size_bits = std::numeric_limits<std::size_t>::digits;
+    static constexpr auto balance_bits = 8;
+
+    template <typename T, typename Comp, typename... Options>
+    friend class tree;
+    template <typename T, typename Comp, typename... Options>
+    friend class concurrent_tree;
+
+    auto operator<=>(atomic_node const&) const { return true <=> true; }
+
+    // stale with lazy_size, like node::distance_from_begin
+    std::size_t distance_from_begin() const
+    {
+        return algorithms::bst_distance_from_begin(this);
+    }
+
+    auto balance() const { return balance_; }
+    std::size_t subtree_size() const { return subtree_size_; }
+    atomic_node const* left() const { return left_; }
+    atomic_node const* right() const { return right_; }
+    atomic_node const* parent() const { return parent_; }
+
+private:
+    detail::shared_field<atomic_node*> parent_;
+    detail::shared_field<atomic_node*> left_;
+    detail::shared_field<atomic_node*> right_;
+    detail::shared_field<std::size_t> subtree_size_;
+    // only read by the writer
+    std::int8_t balance_{0};
+};
+
+// 16 bytes hook linking nodes with 32 bits offsets instead of pointers. All the
+// nodes and the tree itself must be allocated within 8GiB of each other, for
+// example in a single arena, which can then be relocated as a whole. Linking
+// nodes further away, like heap nodes to a tree on the stack, throws
+// std::out_of_range, and leaves the tree unusable.
+template <int SizeBits = 30, int BalanceBits = 32 - SizeBits>
+class compact_node {
+public:
+    static constexpr auto size_bits = SizeBits;
+    static constexpr auto balance_bits = BalanceBits;
+
+    static_assert(SizeBits + BalanceBits <= 32);
+
+    template <typename T, typename Comp, typename... Options>
+    friend class tree;
+
+    constexpr auto operator<=>(compact_node const&) const
+    {
+        return true <=> true;
+    }
+
+    // stale with lazy_size, like node::distance_from_begin
+    std::size_t distance_from_begin() const
+    {
+        return algorithms::bst_distance_from_begin(this);
+    }
+
+    constexpr auto balance() const { return balance_; }
+    constexpr auto subtree_size() const { return subtree_size_; }
+    compact_node const* left() const { return left_; }
+    compact_node const* right() const { return right_; }
+    compact_node const* parent() const { return parent_; }
+
+private:
+    detail::offset_ptr<compact_node> parent_;
+    detail::offset_ptr<compact_node> left_;
+    detail::offset_ptr<compact_node> right_;
+    std::uint32_t subtree_size_ : SizeBits{0};
+    std::int32_t balance_ : BalanceBits{0};
+};
+
+// hook maintaining, in addition to the subtree size, an aggregate of the nodes
+// of its subtree. Augment provides the monoid:
+//     using value_type = ...;
+//     static value_type identity();
+//     static value_type combine(value_type const& lhs, value_type const& rhs);
+//     static value_type lift(Node const& x);
+// where combine is associative, and lift is the value of a single node.
+template <typename Augment, typename Base = node<>>
+class augmented_node : public Base {
+public:
+    using augment_type = Augment;
+
+    template <typename T, typename Comp, typename... Options>
+    friend class tree;
+
+    constexpr auto const& aggregate() const { return aggregate_; }
+
+private:
+    typename Augment::value_type aggregate_{};
+};
+
+// Augment summing the weights of the nodes
+template <typename W>
+struct weight_sum {
+    using value_type = W;
+
+    static constexpr W identity() { return 0; }
+    static constexpr W combine(W lhs, W rhs) { return lhs + rhs; }
+    static constexpr W lift(auto const& x) { return x.weight(); }
+};
+
+// hook carrying an integer weight, enabling rank queries in cumulated weight
+// instead of node count. Changing the weight of a linked node must be followed
+// by tree::update.
+template <std::unsigned_integral W = std::uint64_t, typename Base = node<>>
+class weighted_node : public augmented_node<weight_sum<W>, Base> {
+public:
+    using weight_type = W;
+
+    constexpr W weight() const { return weight_; }
+    constexpr void set_weight(W weight) { weight_ = weight; }
+    constexpr W subtree_weight() const { return this->aggregate(); }
+
+private:
+    W weight_{1};
+};
+
+// hook caching the first 8 bytes of the key, for keyed trees of std::string
+// keys ordered by std::less or std::greater. Comparisons between keys whose
+// first 8 bytes differ don't read the keys.
+template <typename Base = node<>>
+class prefix_node : public Base {
+public:
+    using prefix_type = std::uint64_t;
+
+    template <typename T, typename Comp, typename... Options>
+    friend class tree;
+
+    constexpr prefix_type key_prefix() const { return prefix_; }
+
+private:
+    prefix_type prefix_{};
+};
+
+// runs f(i) for each i in [0, n), returning once all calls completed
+template <typename E>
+concept executor = requires(E& ex, void (*f)(std::size_t)) {
+    { ex.concurrency() } -> std::convertible_to<std::size_t>;
+    ex.bulk(std::size_t{}, f);
+};
+
+class inline_executor {
+public:
+    constexpr std::size_t concurrency() const { return 1; }
+
+    template <typename F>
+    constexpr void bulk(std::size_t n, F&& f)
+    {
+        for (std::size_t i = 0; i < n; ++i) {
+            f(i);
+        }
+    }
+};
+
+// spawns its threads on each bulk call, the calling thread takes part
+class thread_executor {
+public:
+    explicit thread_executor(
+        std::size_t concurrency = std::max(1u, std::thread::hardware_concurrency()))
+        : concurrency_{concurrency}
+    {
+    }
+
+    std::size_t concurrency() const { return concurrency_; }
+
+    // the first exception thrown by f is rethrown once all threads are done
+    template <typename F>
+    void bulk(std::size_t n, F&& f)
+    {
+        std::atomic<std::size_t> next{0};
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto const work = [&] {
+            for (auto i = next++; i < n; i = next++) {
+                try {
+                    f(i);
+                }
+                catch (...) {
+                    std::lock_guard lock{error_mutex};
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+            }
+        };
+        {
+            std::vector<std::jthread> threads;
+            auto const helpers = std::min(concurrency_, n) - (n > 0);
+            threads.reserve(helpers);
+            for (std::size_t i = 0; i < helpers; ++i) {
+                threads.emplace_back(work);
+            }
+            work();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    std::size_t concurrency_;
+};
+
+static_assert(executor<inline_executor>);
+static_assert(executor<thread_executor>);
+
+template <typename T, typename Comp>
+class frozen_tree;
+
+template <typename Node, typename Comp = std::less<>, typename... Options>
 class tree {
 private:
-    using node = std::remove_pointer_t<decltype(Node::parent_)>;
+    using node = typename detail::pointee<decltype(Node::parent_)>::type;
+
+    using key_extractor = typename detail::key_of_option<Options...>::type;
+    static constexpr bool keyed = !std::is_void_v<key_extractor>;
+
+    using stats_type = typename detail::stats_option<Options...>::type;
+    static constexpr bool has_stats = !std::same_as<stats_type, detail::no_stats>;
+
+    static constexpr bool branchless = [] {
+        if constexpr (keyed) {
+            using key_type = std::invoke_result_t<key_extractor, Node const&>;
+            return std::is_arithmetic_v<std::remove_cvref_t<key_type>>;
+        }
+        else {
+            return false;
+        }
+    }();
+
+    static constexpr bool augmented = requires { typename Node::augment_type; };
+    static constexpr bool weighted = requires { typename Node::weight_type; };
+    static constexpr bool prefixed = requires { typename Node::prefix_type; };
+
+    static_assert(
+        !prefixed || [] {
+            if constexpr (keyed) {
+                using key_type = std::invoke_result_t<key_extractor, Node const&>;
+                return detail::string_key<std::remove_cvref_t<key_type>>
+                       && detail::prefix_order<Comp> != 0;
+            }
+            else {
+                return false;
+            }
+        }(),
+        "prefix_node needs string keys ordered by std::less or std::greater");
+
+    using weight_type = typename detail::weight_of<Node>::type;
+
+    // with lazy sizes, a subtree size of 0 marks a node whose size is stale,
+    // all ancestors of a stale node are stale too
+    static constexpr bool lazy_sizes = detail::has_option<lazy_size, Options...>;
+
+    static_assert(!(augmented && lazy_sizes), "lazy_size can't maintain aggregates");
+
+    // iterators of trees with stats count their steps
+    using stats_pointer = std::conditional_t<has_stats, stats_type*, detail::no_stats>;
 
     template <bool Const>
     class iterator_impl {
@@ -101,11 +645,12 @@ private:
         constexpr operator iterator_impl<true>() const
             requires(!Const)
         {
-            return iterator_impl<true>{node_};
+            return iterator_impl<true>{node_, stats_};
         }
 
         constexpr iterator_impl& operator++()
         {
+            count_step();
             node_ = bst_successor(node_);
             return *this;
         }
@@ -117,15 +662,42 @@ private:
         }
         constexpr iterator_impl& operator--()
         {
+            count_step();
             node_ = bst_predecessor(node_);
             return *this;
         }
         constexpr iterator_impl operator--(int)
         {
             iterator_impl retval = *this;
-            ++(*this);
+            --(*this);
             return retval;
         }
+        constexpr iterator_impl& operator+=(difference_type n)
+        {
+            bst_resolve_from(node_);
+            node_ = bst_advance(node_, n);
+            return *this;
+        }
+        constexpr iterator_impl& operator-=(difference_type n)
+        {
+            return *this += -n;
+        }
+        constexpr friend iterator_impl operator+(iterator_impl it, difference_type n)
+        {
+            return it += n;
+        }
+        constexpr friend iterator_impl operator+(difference_type n, iterator_impl it)
+        {
+            return it += n;
+        }
+        constexpr friend iterator_impl operator-(iterator_impl it, difference_type n)
+        {
+            return it -= n;
+        }
+        constexpr friend difference_type operator-(iterator_impl lhs, iterator_impl rhs)
+        {
+            return distance(rhs, lhs);
+        }
         constexpr bool operator==(iterator_impl other) const
         {
             return node_ == other.node_;
@@ -139,32 +711,341 @@ private:
 
         constexpr friend difference_type distance(iterator_impl lhs, iterator_impl rhs)
         {
-            return (rhs.node_ ? rhs.node_->distance_from_begin() : 0)
-                   - (lhs.node_ ? lhs.node_->distance_from_begin() : 0);
+            return lhs.distance_to(rhs);
         }
 
     private:
         friend class tree;
 
+        constexpr difference_type distance_to(iterator_impl other) const
+        {
+            if (!node_ || !other.node_) {
+                if (node_ || other.node_) {
+                    bst_resolve_from(node_ ? node_ : other.node_);
+                }
+                return (other.node_ ? other.node_->distance_from_begin() : 0)
+                       - (node_ ? node_->distance_from_begin() : 0);
+            }
+            bst_resolve_from(node_);
+            return bst_distance(node_, other.node_);
+        }
+
+        constexpr iterator_impl(node* node, stats_pointer stats)
+            : node_{node}, stats_{stats}
+        {
+        }
+
+        constexpr void count_step() const
+        {
+            if constexpr (has_stats) {
+                if (stats_) {
+                    stats_->on_iterator_step();
+                }
+            }
+        }
+
         iterator_impl<false> as_mutable() const
             requires(Const)
         {
-            return iterator_impl<false>{const_cast<value_type*>(node_)};
+            return iterator_impl<false>{node_, stats_};
         }
 
         node* node_{nullptr};
+        [[no_unique_address]] stats_pointer stats_{};
     };
 
-public:
-    using value_type = Node;
-    using value_compare = Comp;
-    using iterator = iterator_impl<false>;
-    using const_iterator = iterator_impl<true>;
+    // in order traversal keeping the ancestors still to visit on a stack, so
+    // a step never climbs parent links nor checks for the header
+    template <bool Const, bool Reverse>
+    class scan_iterator {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = std::conditional_t<Const, Node const, Node>;
 
-    static_assert(std::bidirectional_iterator<iterator>);
+        constexpr scan_iterator() = default;
+
+        constexpr scan_iterator& operator++()
+        {
+            node* x = stack_[--size_];
+            push_spine(Reverse ? x->left_ : x->right_);
+            return *this;
+        }
+        constexpr void operator++(int) { ++(*this); }
+
+        constexpr value_type& operator*() const { return *upcast(stack_[size_ - 1]); }
+        constexpr value_type* operator->() const { return upcast(stack_[size_ - 1]); }
+
+        constexpr friend bool
+        operator==(scan_iterator const& it, std::default_sentinel_t)
+        {
+            return it.size_ == 0;
+        }
+
+    private:
+        friend class tree;
+
+        // an AVL tree of less than 2^SizeBits nodes is lower than 1.45 SizeBits
+        static constexpr std::size_t max_height = Node::size_bits * 3 / 2 + 2;
+
+        // start at x, below the ancestors it is in the left subtree of, or in
+        // the right subtree of when scanning in reverse
+        constexpr explicit scan_iterator(node* x)
+        {
+            for (node* y = x; !algorithms::bst_is_root(y); y = y->parent_) {
+                if (y == (Reverse ? y->parent_->right_ : y->parent_->left_)) {
+                    stack_[size_++] = y->parent_;
+                }
+            }
+            std::reverse(stack_.begin(), stack_.begin() + size_);
+            stack_[size_++] = x;
+        }
+
+        constexpr void push_spine(node* x)
+        {
+            for (; x; x = Reverse ? x->right_ : x->left_) {
+                stack_[size_++] = x;
+            }
+        }
+
+        std::array<node*, max_height> stack_{};
+        std::size_t size_{0};
+    };
+
+    // an iterator carrying its distance from begin(), so that ranks and
+    // distances between ranked iterators cost O(1). Inserting or erasing a
+    // node before it leaves the rank stale.
+    template <bool Const>
+    class ranked_iterator_impl {
+    public:
+        using difference_type = std::make_signed_t<std::size_t>;
+        using value_type = std::conditional_t<Const, Node const, Node>;
+
+        constexpr ranked_iterator_impl() = default;
+
+        constexpr operator ranked_iterator_impl<true>() const
+            requires(!Const)
+        {
+            return ranked_iterator_impl<true>{it_, rank_};
+        }
+
+        constexpr iterator_impl<Const> base() const { return it_; }
+        constexpr std::size_t rank() const { return rank_; }
+
+        constexpr ranked_iterator_impl& operator++()
+        {
+            ++it_;
+            ++rank_;
+            return *this;
+        }
+        constexpr ranked_iterator_impl operator++(int)
+        {
+            ranked_iterator_impl retval = *this;
+            ++(*this);
+            return retval;
+        }
+        constexpr ranked_iterator_impl& operator--()
+        {
+            --it_;
+            --rank_;
+            return *this;
+        }
+        constexpr ranked_iterator_impl operator--(int)
+        {
+            ranked_iterator_impl retval = *this;
+            --(*this);
+            return retval;
+        }
+        constexpr ranked_iterator_impl& operator+=(difference_type n)
+        {
+            it_ += n;
+            rank_ += n;
+            return *this;
+        }
+        constexpr ranked_iterator_impl& operator-=(difference_type n)
+        {
+            return *this += -n;
+        }
+        constexpr friend ranked_iterator_impl
+        operator+(ranked_iterator_impl it, difference_type n)
+        {
+            return it += n;
+        }
+        constexpr friend ranked_iterator_impl
+        operator-(ranked_iterator_impl it, difference_type n)
+        {
+            return it -= n;
+        }
+        constexpr friend difference_type
+        operator-(ranked_iterator_impl lhs, ranked_iterator_impl rhs)
+        {
+            return distance(rhs, lhs);
+        }
+        constexpr bool operator==(ranked_iterator_impl other) const
+        {
+            return it_ == other.it_;
+        }
+        constexpr value_type& operator*() const { return *it_; }
+        constexpr value_type* operator->() const { return it_.operator->(); }
+
+        constexpr friend difference_type
+        distance(ranked_iterator_impl lhs, ranked_iterator_impl rhs)
+        {
+            return static_cast<difference_type>(rhs.rank_)
+                   - static_cast<difference_type>(lhs.rank_);
+        }
+
+    private:
+        friend class tree;
+
+        constexpr ranked_iterator_impl(iterator_impl<Const> it, std::size_t rank)
+            : it_{it}, rank_{rank}
+        {
+        }
+
+        iterator_impl<Const> it_;
+        std::size_t rank_{0};
+    };
+
+    // a lower_bound or find advancing one node per call to step, which
+    // prefetches the next node before returning. Stepping many searches in
+    // turn, with qct::interleave, overlaps their cache misses even when they
+    // run on different trees. The key must outlive the search, and the tree
+    // must not change while it runs.
+    template <bool Const, typename T>
+    class key_search_impl {
+        using tree_type = std::conditional_t<Const, tree const, tree>;
+
+    public:
+        constexpr key_search_impl() = default;
+
+        // false once the search is done
+        constexpr bool step()
+        {
+            if (!current_) {
+                return false;
+            }
+            if (!started_) {
+                started_ = true;
+                detail::prefetch(current_);
+                return true;
+            }
+            bool const right = tree_->less(*upcast(current_), *key_);
+            if (!right) {
+                res_ = current_;
+            }
+            current_ = bst_child(current_, right);
+            ++depth_;
+            if (current_) {
+                detail::prefetch(current_);
+                return true;
+            }
+            tree_->stats_.on_descent(depth_);
+            return false;
+        }
+
+        // valid once step returned false
+        constexpr iterator_impl<Const> result() const
+        {
+            iterator_impl<Const> const it{res_, tree_->stats_address()};
+            if (find_ && it != tree_->end() && tree_->less(*key_, *it)) {
+                return tree_->end();
+            }
+            return it;
+        }
+
+    private:
+        friend class tree;
+
+        constexpr key_search_impl(tree_type* t, T const& key, bool find)
+            : tree_{t}, key_{&key}, current_{t->root()}, res_{t->end().node_},
+              find_{find}
+        {
+        }
+
+        tree_type* tree_{nullptr};
+        T const* key_{nullptr};
+        node* current_{nullptr};
+        node* res_{nullptr};
+        std::size_t depth_{0};
+        bool find_{false};
+        bool started_{false};
+    };
+
+    // same as key_search_impl for nth
+    template <bool Const>
+    class rank_search_impl {
+        using tree_type = std::conditional_t<Const, tree const, tree>;
+
+    public:
+        constexpr rank_search_impl() = default;
+
+        constexpr bool step()
+        {
+            if (!current_) {
+                return false;
+            }
+            if (!started_) {
+                started_ = true;
+                detail::prefetch(current_);
+                return true;
+            }
+            auto const left_size = bst_size(current_->left_);
+            if (k_ < left_size) {
+                current_ = current_->left_;
+            }
+            else if (k_ > left_size) {
+                k_ -= left_size + 1;
+                current_ = current_->right_;
+            }
+            else {
+                res_ = current_;
+                return false;
+            }
+            detail::prefetch(current_);
+            return true;
+        }
+
+        constexpr iterator_impl<Const> result() const
+        {
+            return iterator_impl<Const>{res_, tree_->stats_address()};
+        }
+
+    private:
+        friend class tree;
+
+        constexpr rank_search_impl(tree_type* t, std::size_t k)
+            : tree_{t}, current_{k < t->size() ? t->root() : nullptr},
+              res_{t->end().node_}, k_{k}
+        {
+        }
+
+        tree_type* tree_{nullptr};
+        node* current_{nullptr};
+        node* res_{nullptr};
+        std::size_t k_{0};
+        bool started_{false};
+    };
+
+public:
+    using value_type = Node;
+    using value_compare = Comp;
+    using iterator = iterator_impl<false>;
+    using const_iterator = iterator_impl<true>;
+    using ranked_iterator = ranked_iterator_impl<false>;
+    using const_ranked_iterator = ranked_iterator_impl<true>;
+    template <typename T>
+    using key_search = key_search_impl<false, T>;
+    template <typename T>
+    using const_key_search = key_search_impl<true, T>;
+    using rank_search = rank_search_impl<false>;
+    using const_rank_search = rank_search_impl<true>;
+
+    static_assert(std::bidirectional_iterator<iterator>);
     static_assert(std::bidirectional_iterator<const_iterator>);
+    static_assert(std::bidirectional_iterator<ranked_iterator>);
 
     tree() = default;
+    explicit tree(Comp comp) : comp_{std::move(comp)} {}
 
     tree(tree const&) = delete;
     tree& operator=(tree const&) = delete;
@@ -173,565 +1054,4606 @@ public:
     tree& operator=(tree&& other) noexcept
     {
         header_ = other.header_;
-        root()->parent_ = &header_;
+        comp_ = other.comp_;
+        // the counters follow the nodes
+        stats_ = std::exchange(other.stats_, stats_type{});
+        if (root()) {
+            root()->parent_ = &header_;
+        }
+        other.header_ = make_header();
         return *this;
     }
 
-    constexpr iterator begin() { return iterator{leftmost()}; }
-    constexpr iterator end() { return iterator{&header_}; }
+    constexpr iterator begin()
+    {
+        if (!root()) {
+            return end();
+        }
+        return iterator{leftmost(), stats_address()};
+    }
+    constexpr iterator end() { return iterator{&header_, stats_address()}; }
     constexpr const_iterator begin() const { return as_mutable().begin(); }
     constexpr const_iterator end() const { return as_mutable().end(); }
+
+    // single pass over [first, end()), cheaper than iterating
+    constexpr auto scan() { return scan_from<false>(begin().node_); }
+    constexpr auto scan() const { return scan_from<true>(begin().node_); }
+    constexpr auto scan(iterator first) { return scan_from<false>(first.node_); }
+    constexpr auto scan(const_iterator first) const
+    {
+        return scan_from<true>(first.node_);
+    }
+
+    // single pass over [begin(), last) in reverse order
+    constexpr auto reverse_scan() { return reverse_scan_to<false>(end().node_); }
+    constexpr auto reverse_scan() const { return reverse_scan_to<true>(end().node_); }
+    constexpr auto reverse_scan(iterator last)
+    {
+        return reverse_scan_to<false>(last.node_);
+    }
+    constexpr auto reverse_scan(const_iterator last) const
+    {
+        return reverse_scan_to<true>(last.node_);
+    }
+
+    // read-only copy of proj(x) for each node x, in a contiguous layout
+    // faster to search. Comp must also order the projected values.
+    template <typename Proj>
+    auto freeze(Proj proj) const
+    {
+        using T = std::remove_cvref_t<std::invoke_result_t<Proj&, Node const&>>;
+        return frozen_tree<T, Comp>{std::views::transform(*this, proj), comp_};
+    }
+
+    // read-only copy of the keys of the nodes
+    auto freeze() const
+        requires keyed
+    {
+        return freeze(key_extractor{});
+    }
+
+    constexpr Comp value_comp() const { return comp_; }
+
+    constexpr stats_type& stats()
+        requires has_stats
+    {
+        return stats_;
+    }
+    constexpr stats_type const& stats() const
+        requires has_stats
+    {
+        return stats_;
+    }
+
     constexpr std::size_t size() const
     {
-        return root() ? root()->subtree_size_ : 0;
+        if constexpr (lazy_sizes) {
+            return header_.subtree_size_;
+        }
+        else {
+            return bst_size(root());
+        }
     }
 
-    constexpr iterator erase(iterator it)
+    constexpr iterator nth(std::size_t k)
     {
-        auto next = bst_successor(it.node_);
-        auto info = bst_erase(it.node_);
-        if (info.y) {
-            info.y->balance_ = it.node_->balance_;
-            info.y->subtree_size_ = it.node_->subtree_size_;
+        if (k >= size()) {
+            return end();
         }
-        qct_erase_rebalance(info);
-        return iterator{next};
+        bst_resolve(root());
+        return iterator{bst_select(root(), k), stats_address()};
     }
 
-    constexpr iterator insert(value_type& node)
+    constexpr const_iterator nth(std::size_t k) const
     {
-        qct_insert(node);
-        qct_insert_rebalance(&node);
-        return iterator{&node};
+        return as_mutable().nth(k);
     }
 
-    template <typename T>
-    constexpr iterator lower_bound(T const& val)
+    constexpr ranked_iterator ranked_begin() { return {begin(), 0}; }
+    constexpr ranked_iterator ranked_end() { return {end(), size()}; }
+    constexpr const_ranked_iterator ranked_begin() const { return {begin(), 0}; }
+    constexpr const_ranked_iterator ranked_end() const { return {end(), size()}; }
+
+    constexpr ranked_iterator ranked(iterator it)
     {
-        return lower_bound(root(), end().node_, val);
+        bst_resolve_from(it.node_);
+        return {it, it.node_->distance_from_begin()};
     }
 
-    template <typename T>
-    constexpr const_iterator lower_bound(T const& val) const
+    constexpr const_ranked_iterator ranked(const_iterator it) const
     {
-        return as_mutable().lower_bound(val);
+        return as_mutable().ranked(it.as_mutable());
     }
 
-    template <typename T>
-    constexpr iterator upper_bound(T const& val)
+    // the number of nodes before it. Unlike the distance_from_begin of the
+    // hooks, it resolves lazy sizes first.
+    constexpr std::size_t rank(const_iterator it) const { return ranked(it).rank(); }
+
+    constexpr ranked_iterator ranked_nth(std::size_t k)
     {
-        return upper_bound(root(), end().node_, val);
+        return {nth(k), std::min(k, size())};
     }
 
-    template <typename T>
-    constexpr const_iterator upper_bound(T const& val) const
+    constexpr const_ranked_iterator ranked_nth(std::size_t k) const
     {
-        return as_mutable().upper_bound(val);
+        return as_mutable().ranked_nth(k);
     }
 
+    // lower_bound and count_less from a single descent
     template <typename T>
-    constexpr std::pair<iterator, iterator> equal_range(T const& val)
+    constexpr ranked_iterator lower_bound_with_rank(T const& val)
     {
-        auto* root = this->root();
-        auto* end = this->end().node_;
-        while (root) {
-            if (Comp{}(*upcast(root), val)) {
-                root = root->right_;
-            }
-            else if (Comp{}(val, *upcast(root))) {
-                end = root;
-                root = root->left_;
+        bst_resolve(root());
+        node* res = end().node_;
+        std::size_t rank = 0;
+        node* current = root();
+        std::size_t depth = 0;
+        while (current) {
+            bool const right = less(*upcast(current), val);
+            if (right) {
+                rank += bst_size(current->left_) + 1;
             }
             else {
-                return {lower_bound(root, end, val), upper_bound(root, end, val)};
+                res = current;
             }
+            current = bst_child(current, right);
+            ++depth;
         }
-        return {end, end};
+        stats_.on_descent(depth);
+        return {iterator{res, stats_address()}, rank};
     }
 
     template <typename T>
-    constexpr std::pair<const_iterator, const_iterator> equal_range(T const& val) const
+    constexpr const_ranked_iterator lower_bound_with_rank(T const& val) const
     {
-        return as_mutable().equal_range(val);
+        return as_mutable().lower_bound_with_rank(val);
     }
 
-    template <typename T>
-    constexpr iterator find(T const& val)
+    constexpr iterator erase(iterator it)
     {
-        auto lb = lower_bound(val);
-        return lb == end() || Comp{}(val, *lb) ? end() : lb;
+        auto next = bst_successor(it.node_);
+        auto info = bst_erase(it.node_);
+        if (info.y) {
+            info.y->balance_ = it.node_->balance_;
+            info.y->subtree_size_ = it.node_->subtree_size_;
+        }
+        qct_erase_rebalance(info);
+        if constexpr (lazy_sizes) {
+            header_.subtree_size_--;
+        }
+        return iterator{next, stats_address()};
     }
 
-    template <typename T>
-    constexpr const_iterator find(T const& val) const
+    // O(log N), the erased nodes are dropped without visiting them
+    constexpr iterator erase(iterator first, iterator last)
     {
-        return as_mutable().find(val);
+        unlink_range(first, last);
+        return last;
     }
 
-private:
-    struct erase_rebalance_info {
-        node* x{};
-        node* y{};
-        bool n_is_left{};
-    };
-
-    static constexpr value_type* upcast(node* p)
+    // dispose is called on each erased node once it's unlinked
+    template <typename Dispose>
+    constexpr iterator erase(iterator first, iterator last, Dispose dispose)
     {
-        return static_cast<value_type*>(p);
+        bst_dispose(unlink_range(first, last), dispose);
+        return last;
     }
 
-    static constexpr node* bst_minimum(node* x)
+    constexpr void clear() { header_ = make_header(); }
+
+    // dispose is called on each node once it's unlinked, children first
+    template <typename Dispose>
+    constexpr void clear(Dispose dispose)
     {
-        while (x->left_) {
-            x = x->left_;
-        }
-        return x;
+        node* x = root();
+        header_ = make_header();
+        bst_dispose(x, dispose);
     }
 
-    static constexpr node* bst_maximum(node* x)
+    constexpr iterator insert(value_type& node)
     {
-        while (x->right_) {
-            x = x->right_;
+        cache_prefix(node);
+        qct_insert(node);
+        qct_insert_rebalance(&node);
+        if constexpr (lazy_sizes) {
+            header_.subtree_size_++;
         }
-        return x;
+        return iterator{&node, stats_address()};
     }
 
-    static constexpr node* bst_successor(node* x)
+    // insert x just before hint if it fits between hint and its predecessor,
+    // without descending from the root, otherwise fall back to insert
+    constexpr iterator insert(const_iterator hint, value_type& x)
     {
-        if (x->right_) {
-            return bst_minimum(x->right_);
+        cache_prefix(x);
+        node* next = hint.node_;
+        node* prev = nullptr;
+        if (next == &header_) {
+            prev = rightmost();
         }
-        node* y = x->parent_;
-        while (x == y->right_) {
-            x = y;
-            y = y->parent_;
+        else if (next != leftmost()) {
+            prev = bst_predecessor(next);
         }
-        if (x->right_ == y) {
-            // x is the header
-            return x;
+
+        if (!root() || (next != &header_ && less(*upcast(next), x))
+            || (prev && less(x, *upcast(prev)))) {
+            return insert(x);
         }
-        return y;
-    }
 
-    static constexpr node* bst_predecessor(node* x)
-    {
-        if (algorithms::bst_is_header(x)) {
-            return bst_maximum(x->parent_);
+        if (next != &header_ && !next->left_) {
+            qct_link_sized(next, x, true);
         }
-        if (x->left_) {
-            return bst_maximum(x->left_);
+        else {
+            qct_link_sized(prev, x, false);
         }
-        node* y = x->parent_;
-        while (x == y->left_) {
-            x = y;
-            y = y->parent_;
+        qct_insert_rebalance(&x);
+        if constexpr (lazy_sizes) {
+            header_.subtree_size_++;
         }
-        return y;
+        return iterator{&x, stats_address()};
     }
 
-    constexpr void bst_shift_nodes(node const* u, node* v)
+    // replace the content of the tree with the nodes in [first, last), which
+    // must already be sorted, in linear time
+    template <std::forward_iterator It, std::sentinel_for<It> Sent>
+        requires std::same_as<std::iter_reference_t<It>, value_type&>
+    constexpr void assign_sorted(It first, Sent last)
     {
-        if (u == root()) {
-            root() = v;
+        auto const n = static_cast<std::size_t>(std::ranges::distance(first, last));
+        header_ = make_header();
+        if (n == 0) {
+            return;
         }
-        else if (u == u->parent_->left_) {
-            u->parent_->left_ = v;
-        }
-        else {
-            u->parent_->right_ = v;
+        attach(bst_build(first, n, nullptr));
+    }
+
+    // same as assign_sorted, the top levels are linked first and the subtrees
+    // below them are built in parallel
+    template <std::random_access_iterator It, executor Executor>
+        requires std::same_as<std::iter_reference_t<It>, value_type&>
+    void assign_sorted(It first, It last, Executor& ex)
+    {
+        auto const n = static_cast<std::size_t>(last - first);
+        header_ = make_header();
+        if (n == 0) {
+            return;
         }
-        if (v) {
-            v->parent_ = u->parent_;
+
+        auto const top_depth = fork_depth(ex);
+        std::vector<build_task> tasks;
+        std::vector<node*> top;
+        node* root = bst_build_top(first, 0, n, top_depth, tasks, top);
+        if (tasks.empty()) {
+            attach(root);
+            return;
+        }
+
+        ex.bulk(tasks.size(), [&](std::size_t i) {
+            auto const& task = tasks[i];
+            auto it = first + static_cast<std::iter_difference_t<It>>(task.offset);
+            node* x = bst_build(it, task.n, nullptr);
+            x->parent_ = task.parent;
+            (task.left ? task.parent->left_ : task.parent->right_) = x;
+        });
+        // top is in post order, so children aggregates are ready first
+        for (node* x : top) {
+            bst_pull(x);
         }
+        attach(root);
     }
 
-    constexpr void qct_insert(value_type& x)
+    // insert the nodes in [first, last), which must already be sorted, each
+    // insertion starting from the position of the previous one
+    template <std::input_iterator It, std::sentinel_for<It> Sent>
+        requires std::same_as<std::iter_reference_t<It>, value_type&>
+    constexpr void insert_sorted(It first, Sent last)
     {
-        node* parent = &header_;
-        node* current = root();
-        while (current) {
-            parent = current;
-            parent->subtree_size_++;
-            if (Comp{}(*upcast(current), x)) {
-                current = current->right_;
-            }
-            else {
-                current = current->left_;
+        if constexpr (std::forward_iterator<It>) {
+            if (!root()) {
+                assign_sorted(first, last);
+                return;
             }
         }
-        if (parent == &header_) {
-            root() = &x;
-            leftmost() = &x;
-            rightmost() = &x;
+        if (first == last) {
+            return;
         }
-        else if (!Comp{}(*upcast(parent), x)) {
-            parent->left_ = &x;
-            if (parent == leftmost()) {
-                leftmost() = &x;
+
+        value_type* finger = &*first;
+        insert(*finger);
+        for (++first; first != last; ++first) {
+            value_type& x = *first;
+            cache_prefix(x);
+            qct_insert_after(finger, x);
+            qct_insert_rebalance(&x);
+            if constexpr (lazy_sizes) {
+                header_.subtree_size_++;
             }
+            finger = &x;
         }
-        else {
-            parent->right_ = &x;
-            if (parent == rightmost()) {
-                rightmost() = &x;
-            }
+    }
+
+    // move the nodes not lower than val to the returned tree
+    template <typename T>
+    constexpr tree split(T const& val)
+    {
+        tree right{comp_};
+        split(val, right);
+        return right;
+    }
+
+    // move the nodes not lower than val to right, replacing its content
+    template <typename T>
+    constexpr void split(T const& val, tree& right)
+    {
+        split_if([&](node* x) { return !less(*upcast(x), val); }, right);
+    }
+
+    // move the nodes starting from rank k to the returned tree
+    constexpr tree split_at(std::size_t k)
+    {
+        tree right{comp_};
+        split_at(k, right);
+        return right;
+    }
+
+    // move the nodes starting from rank k to right, replacing its content
+    constexpr void split_at(std::size_t k, tree& right)
+    {
+        split_if(bst_rank_predicate(k), right);
+    }
+
+    // append the nodes of other, which must not compare less than any node of
+    // this tree
+    constexpr void join(tree&& other)
+    {
+        bst_resolve(root());
+        bst_resolve(other.root());
+        attach(qct_concat(detach(), other.detach()).root);
+    }
+
+    // The set operations expect trees without equivalent nodes, and take
+    // O(m log(n / m + 1)) for trees of m and n >= m nodes. Given an executor,
+    // the two halves of the top levels of the recursion run as parallel
+    // tasks, and dispose may then be called concurrently.
+
+    // move the nodes of other to this tree, except the ones equivalent to a
+    // node of this tree which are passed to dispose
+    template <typename Dispose>
+    constexpr void set_union(tree&& other, Dispose dispose)
+    {
+        inline_executor ex;
+        set_union(std::move(other), dispose, ex);
+    }
+
+    template <typename Dispose, executor Executor>
+    constexpr void set_union(tree&& other, Dispose dispose, Executor& ex)
+    {
+        bst_resolve(root());
+        bst_resolve(other.root());
+        auto const t = qct_union(detach(), other.detach(), dispose, ex, fork_depth(ex));
+        attach(t.root);
+    }
+
+    // unlink the nodes not equivalent to a node of other, and pass them to
+    // dispose
+    template <typename Dispose>
+    constexpr void set_intersection(tree const& other, Dispose dispose)
+    {
+        inline_executor ex;
+        set_intersection(other, dispose, ex);
+    }
+
+    template <typename Dispose, executor Executor>
+    constexpr void set_intersection(tree const& other, Dispose dispose, Executor& ex)
+    {
+        bst_resolve(root());
+        subtree const rhs{other.root(), bst_height(other.root())};
+        attach(qct_intersection(detach(), rhs, dispose, ex, fork_depth(ex)).root);
+    }
+
+    // unlink the nodes equivalent to a node of other, and pass them to dispose
+    template <typename Dispose>
+    constexpr void set_difference(tree const& other, Dispose dispose)
+    {
+        inline_executor ex;
+        set_difference(other, dispose, ex);
+    }
+
+    template <typename Dispose, executor Executor>
+    constexpr void set_difference(tree const& other, Dispose dispose, Executor& ex)
+    {
+        bst_resolve(root());
+        subtree const rhs{other.root(), bst_height(other.root())};
+        attach(qct_difference(detach(), rhs, dispose, ex, fork_depth(ex)).root);
+    }
+
+    template <typename T>
+    constexpr iterator lower_bound(T const& val)
+    {
+        return lower_bound(root(), end().node_, val);
+    }
+
+    template <typename T>
+    constexpr const_iterator lower_bound(T const& val) const
+    {
+        return as_mutable().lower_bound(val);
+    }
+
+    template <typename T>
+    constexpr iterator upper_bound(T const& val)
+    {
+        return upper_bound(root(), end().node_, val);
+    }
+
+    template <typename T>
+    constexpr const_iterator upper_bound(T const& val) const
+    {
+        return as_mutable().upper_bound(val);
+    }
+
+    template <typename T>
+    constexpr std::pair<iterator, iterator> equal_range(T const& val)
+    {
+        auto [split, end] = equal_range_split(val);
+        if (!split) {
+            iterator const last{end, stats_address()};
+            return {last, last};
         }
+        return {
+            lower_bound(split->left_, split, val),
+            upper_bound(split->right_, end, val)};
+    }
 
-        x.parent_ = parent;
-        x.left_ = nullptr;
-        x.right_ = nullptr;
-        x.balance_ = 0;
-        x.subtree_size_ = 1;
+    template <typename T>
+    constexpr std::pair<const_iterator, const_iterator> equal_range(T const& val) const
+    {
+        return as_mutable().equal_range(val);
     }
 
-    constexpr erase_rebalance_info bst_erase(node const* z)
+    // equal_range and count from a single descent
+    template <typename T>
+    constexpr std::tuple<iterator, iterator, std::size_t> equal_range_count(T const& val)
     {
-        erase_rebalance_info info{};
-        info.x = z->parent_;
-        info.n_is_left = z->parent_ && z == z->parent_->left_;
-        if (!z->left_) {
-            bst_shift_nodes(z, z->right_);
-            if (z == leftmost()) {
-                // z->right could be null
-                leftmost() = bst_minimum(z->parent_);
-            }
+        bst_resolve(root());
+        auto [split, end] = equal_range_split(val);
+        if (!split) {
+            iterator const last{end, stats_address()};
+            return {last, last, 0};
         }
-        else if (!z->right_) {
-            bst_shift_nodes(z, z->left_);
-            if (z == rightmost()) {
-                // z->left can't be null
-                rightmost() = bst_maximum(z->left_);
+        auto const [first, left] = lower_bound_count(split->left_, split, val);
+        auto const [last, right] = upper_bound_count(split->right_, end, val);
+        return {first, last, left + 1 + right};
+    }
+
+    template <typename T>
+    constexpr std::tuple<const_iterator, const_iterator, std::size_t>
+    equal_range_count(T const& val) const
+    {
+        return as_mutable().equal_range_count(val);
+    }
+
+    // write lower_bound(key) to out for each key, in order. The searches of a
+    // group of keys advance in lockstep and prefetch their next node, so the
+    // memory accesses of the group overlap instead of queuing up.
+    template <std::ranges::forward_range Keys, std::output_iterator<iterator> Out>
+    Out lower_bound_batch(Keys const& keys, Out out)
+    {
+        using key_type = std::ranges::range_value_t<Keys>;
+        constexpr std::size_t group_size = 16;
+
+        struct search {
+            key_type const* key;
+            node* current;
+            node* res;
+        };
+        std::array<search, group_size> group;
+
+        auto it = std::ranges::begin(keys);
+        auto const last = std::ranges::end(keys);
+        while (it != last) {
+            std::size_t n = 0;
+            for (; n < group_size && it != last; ++n, ++it) {
+                group[n] = {&*it, root(), end().node_};
+            }
+
+            for (bool active = true; active;) {
+                active = false;
+                for (std::size_t i = 0; i < n; ++i) {
+                    auto& s = group[i];
+                    if (!s.current) {
+                        continue;
+                    }
+                    bool const right = less(*upcast(s.current), *s.key);
+                    if (!right) {
+                        s.res = s.current;
+                    }
+                    s.current = bst_child(s.current, right);
+                    if (s.current) {
+                        detail::prefetch(s.current);
+                        active = true;
+                    }
+                }
+            }
+
+            for (std::size_t i = 0; i < n; ++i) {
+                *out++ = iterator{group[i].res, stats_address()};
             }
         }
-        else {
-            node* y = bst_minimum(z->right_);
-            if (y->parent_ != z) {
-                info.x = y->parent_;
-                info.n_is_left = true;
-                bst_shift_nodes(y, y->right_);
+        return out;
+    }
 
-                y->right_ = z->right_;
-                y->right_->parent_ = y;
+    // same as lower_bound_batch for keys sorted according to Comp, the keys
+    // sharing a path from the root are partitioned at each node they visit,
+    // so that each node is visited once for all of them
+    template <std::ranges::random_access_range Keys, std::output_iterator<iterator> Out>
+    Out lower_bound_batch_sorted(Keys const& keys, Out out)
+    {
+        return lower_bound_batch_sorted(
+            root(), end().node_, std::ranges::begin(keys), std::ranges::end(keys), out);
+    }
+
+    // lower_bound, find and nth as searches run by qct::interleave
+    template <typename T>
+    constexpr key_search<T> lower_bound_search(T const& val)
+    {
+        return {this, val, false};
+    }
+
+    template <typename T>
+    constexpr const_key_search<T> lower_bound_search(T const& val) const
+    {
+        return {this, val, false};
+    }
+
+    template <typename T>
+    constexpr key_search<T> find_search(T const& val)
+    {
+        return {this, val, true};
+    }
+
+    template <typename T>
+    constexpr const_key_search<T> find_search(T const& val) const
+    {
+        return {this, val, true};
+    }
+
+    constexpr rank_search nth_search(std::size_t k)
+    {
+        bst_resolve(root());
+        return {this, k};
+    }
+
+    constexpr const_rank_search nth_search(std::size_t k) const
+    {
+        as_mutable().bst_resolve(root());
+        return {this, k};
+    }
+
+    template <typename T>
+    constexpr iterator find(T const& val)
+    {
+        auto lb = lower_bound(val);
+        return lb == end() || less(val, *lb) ? end() : lb;
+    }
+
+    template <typename T>
+    constexpr const_iterator find(T const& val) const
+    {
+        return as_mutable().find(val);
+    }
+
+    template <typename T>
+    constexpr std::size_t count_less(T const& val) const
+    {
+        bst_resolve(root());
+        return count_less(root(), val);
+    }
+
+    template <typename T>
+    constexpr std::size_t count_less_equal(T const& val) const
+    {
+        bst_resolve(root());
+        return count_less_equal(root(), val);
+    }
+
+    template <typename T>
+    constexpr std::size_t count(T const& val) const
+    {
+        return std::get<2>(equal_range_count(val));
+    }
+
+    // recompute the aggregates depending on the node at it, which must be
+    // called after modifying a member used by Augment::lift
+    constexpr void update(iterator it)
+        requires augmented
+    {
+        bst_pull_path(it.node_);
+    }
+
+    // combine the nodes in [first, last), in order
+    constexpr auto fold(const_iterator first, const_iterator last) const
+        requires augmented
+    {
+        auto const lo = first.node_->distance_from_begin();
+        auto const hi = last.node_->distance_from_begin();
+        return bst_fold(root(), lo, hi);
+    }
+
+    // total weight of the nodes in [first, last)
+    constexpr auto weighted_distance(const_iterator first, const_iterator last) const
+        requires weighted
+    {
+        return bst_weight_before(last.node_) - bst_weight_before(first.node_);
+    }
+
+    // total weight of the nodes lower than val
+    template <typename T>
+    constexpr auto weighted_rank_of(T const& val) const
+        requires weighted
+    {
+        weight_type weight = 0;
+        value_type* current = upcast(root());
+        while (current) {
+            if (less(*current, val)) {
+                weight += bst_weight(current->left_) + current->weight();
+                current = upcast(current->right_);
             }
             else {
-                info.x = y;
-                info.n_is_left = false;
+                current = upcast(current->left_);
             }
-            bst_shift_nodes(z, y);
-            y->left_ = z->left_;
-            y->left_->parent_ = y;
-            info.y = y;
         }
-        return info;
+        return weight;
     }
 
-    static constexpr node* qct_rotate_left(node* x, node* z)
+    // the node whose weight interval covers w: the nodes before it weigh at
+    // most w in total, and more than w once its own weight is added. end() if
+    // w isn't lower than the total weight.
+    constexpr iterator select_by_weight(weight_type w)
+        requires weighted
     {
-        node* tmp = z->left_;
-        x->right_ = tmp;
-        if (tmp) {
-            tmp->parent_ = x;
+        value_type* current = upcast(root());
+        while (current) {
+            auto const left_weight = bst_weight(current->left_);
+            if (w < left_weight) {
+                current = upcast(current->left_);
+                continue;
+            }
+            w -= left_weight;
+            if (w < current->weight()) {
+                return iterator{current, stats_address()};
+            }
+            w -= current->weight();
+            current = upcast(current->right_);
         }
-        z->left_ = x;
-        x->parent_ = z;
+        return end();
+    }
 
-        auto x_subtree_size = x->subtree_size_;
-        x->subtree_size_ -= z->subtree_size_ - (tmp ? tmp->subtree_size_ : 0);
-        z->subtree_size_ = x_subtree_size;
+    constexpr const_iterator select_by_weight(weight_type w) const
+        requires weighted
+    {
+        return as_mutable().select_by_weight(w);
+    }
 
-        if (z->balance_ == 0) {
-            x->balance_ = 1;
-            z->balance_ = -1;
+    // call f on each node of [first, last), the range is cut by rank into
+    // chunks of equal size that are visited in parallel
+    template <typename F, executor Executor>
+    void parallel_for_each(iterator first, iterator last, F f, Executor& ex)
+    {
+        static_assert(executor_allowed<Executor>, "trees with stats need an inline_executor");
+        bst_resolve(root());
+        auto const lo = first.node_->distance_from_begin();
+        auto const hi = last.node_->distance_from_begin();
+        if (lo >= hi) {
+            return;
         }
-        else {
-            x->balance_ = 0;
-            z->balance_ = 0;
+        auto const concurrency = static_cast<std::size_t>(ex.concurrency());
+        auto const chunks = std::min(hi - lo, concurrency > 1 ? 4 * concurrency : 1);
+
+        std::vector<iterator> bounds;
+        bounds.reserve(chunks + 1);
+        bounds.push_back(first);
+        for (std::size_t i = 1; i < chunks; ++i) {
+            bounds.push_back(nth(lo + (hi - lo) * i / chunks));
         }
-        return z;
+        bounds.push_back(last);
+
+        ex.bulk(chunks, [&](std::size_t i) {
+            for (auto it = bounds[i]; it != bounds[i + 1]; ++it) {
+                f(*it);
+            }
+        });
     }
 
-    static constexpr node* qct_rotate_right(node* x, node* z)
+private:
+    template <typename T, typename C, typename... O>
+    friend class concurrent_tree;
+    template <typename T, typename C, typename... O>
+    friend class buffered_tree;
+    template <typename T, typename C, typename... O>
+    friend class tree_image;
+
+    // links relative to the nodes themselves survive moving the nodes and the
+    // tree together
+    static constexpr bool relocatable =
+        !std::is_pointer_v<decltype(node::parent_)> && !lazy_sizes;
+
+    struct erase_rebalance_info {
+        node* x{};
+        node* y{};
+        bool n_is_left{};
+    };
+
+    struct subtree {
+        node* root{};
+        int height{};
+    };
+
+    // subtree of n nodes starting at offset, to link below parent
+    struct build_task {
+        std::size_t offset{};
+        std::size_t n{};
+        node* parent{};
+        bool left{};
+    };
+
+    static constexpr value_type* upcast(node* p)
+    {
+        return static_cast<value_type*>(p);
+    }
+
+    // with key_of, the nodes are compared through their key
+    template <typename T>
+    static constexpr decltype(auto) key(T const& x)
+    {
+        if constexpr (keyed && std::derived_from<T, Node>) {
+            return key_extractor{}(x);
+        }
+        else {
+            return (x);
+        }
+    }
+
+    template <typename L, typename R>
+    constexpr bool less(L const& lhs, R const& rhs) const
+    {
+        stats_.on_comparison();
+        if constexpr (prefixed && has_prefix<L> && has_prefix<R>) {
+            auto const lhs_prefix = prefix(lhs);
+            auto const rhs_prefix = prefix(rhs);
+            if (lhs_prefix != rhs_prefix) {
+                return detail::prefix_order<Comp> > 0 ? lhs_prefix < rhs_prefix
+                                                      : rhs_prefix < lhs_prefix;
+            }
+        }
+        return comp_(key(lhs), key(rhs));
+    }
+
+    // nodes and the values viewable as strings
+    template <typename T>
+    static constexpr bool has_prefix =
+        std::derived_from<T, Node> || std::convertible_to<T const&, std::string_view>;
+
+    template <typename T>
+    static constexpr std::uint64_t prefix(T const& x)
+    {
+        if constexpr (std::derived_from<T, Node>) {
+            return x.prefix_;
+        }
+        else {
+            return detail::string_prefix(std::string_view{x});
+        }
+    }
+
+    // to be called before x is compared with the nodes of the tree
+    static constexpr void cache_prefix(value_type& x)
+    {
+        if constexpr (prefixed) {
+            x.prefix_ = detail::string_prefix(std::string_view{key(x)});
+        }
+    }
+
+    constexpr stats_pointer stats_address() const
+    {
+        if constexpr (has_stats) {
+            return &stats_;
+        }
+        else {
+            return {};
+        }
+    }
+
+    // loading both children lets the compiler pick one with a conditional move
+    static constexpr node* bst_child(node* x, bool right)
+    {
+        if constexpr (branchless) {
+            node* const children[] = {x->left_, x->right_};
+            return children[right];
+        }
+        else {
+            return right ? x->right_ : x->left_;
+        }
+    }
+
+    template <bool Const>
+    constexpr auto scan_from(node* x) const
+    {
+        using It = scan_iterator<Const, false>;
+        auto first = x == &header_ ? It{} : It{x};
+        return std::ranges::subrange{first, std::default_sentinel};
+    }
+
+    template <bool Const>
+    constexpr auto reverse_scan_to(node* x) const
+    {
+        using It = scan_iterator<Const, true>;
+        auto first = !root() || x == header_.left_ ? It{} : It{bst_predecessor(x)};
+        return std::ranges::subrange{first, std::default_sentinel};
+    }
+
+    static constexpr node* bst_minimum(node* x)
+    {
+        while (x->left_) {
+            x = x->left_;
+        }
+        return x;
+    }
+
+    static constexpr node* bst_maximum(node* x)
+    {
+        while (x->right_) {
+            x = x->right_;
+        }
+        return x;
+    }
+
+    static constexpr node* bst_successor(node* x)
+    {
+        if (x->right_) {
+            return bst_minimum(x->right_);
+        }
+        node* y = x->parent_;
+        while (x == y->right_) {
+            x = y;
+            y = y->parent_;
+        }
+        if (x->right_ == y) {
+            // x is the header
+            return x;
+        }
+        return y;
+    }
+
+    static constexpr node* bst_predecessor(node* x)
+    {
+        if (algorithms::bst_is_header(x)) {
+            return x->right_;
+        }
+        if (x->left_) {
+            return bst_maximum(x->left_);
+        }
+        node* y = x->parent_;
+        while (x == y->left_) {
+            x = y;
+            y = y->parent_;
+        }
+        return y;
+    }
+
+    static constexpr std::size_t bst_size(node const* x)
+    {
+        return x ? std::size_t{x->subtree_size_} : 0;
+    }
+
+    static constexpr auto bst_weight(node const* x)
+    {
+        return x ? static_cast<value_type const*>(x)->aggregate_
+                 : weight_type{0};
+    }
+
+    // total weight of the nodes before x, which can be the header
+    constexpr auto bst_weight_before(node const* x) const
+    {
+        if (x == &header_) {
+            return bst_weight(root());
+        }
+        auto weight = bst_weight(x->left_);
+        for (; x != root(); x = x->parent_) {
+            if (x == x->parent_->right_) {
+                weight += bst_weight(x->parent_->left_)
+                          + static_cast<value_type const*>(x->parent_)->weight();
+            }
+        }
+        return weight;
+    }
+
+    // recompute the aggregate of x from the ones of its children
+    static constexpr void bst_pull(node* x)
+    {
+        if constexpr (augmented) {
+            using augment = typename Node::augment_type;
+            auto aggregate = augment::lift(*upcast(x));
+            if (x->left_) {
+                aggregate = augment::combine(upcast(x->left_)->aggregate_, aggregate);
+            }
+            if (x->right_) {
+                aggregate = augment::combine(aggregate, upcast(x->right_)->aggregate_);
+            }
+            upcast(x)->aggregate_ = std::move(aggregate);
+        }
+    }
+
+    // x can be a node or the header, the path ends at the header or at the
+    // root of a parentless subtree
+    constexpr void bst_pull_path(node* x)
+    {
+        if constexpr (augmented) {
+            for (; x && x != &header_; x = x->parent_) {
+                bst_pull(x);
+            }
+        }
+    }
+
+    // combine the nodes of ranks [lo, hi) in the subtree rooted in x, the
+    // subtrees entirely in the range contribute their aggregate directly
+    static constexpr auto bst_fold(node* x, std::size_t lo, std::size_t hi)
+    {
+        using augment = typename Node::augment_type;
+        auto aggregate = augment::identity();
+        while (x && lo < hi) {
+            if (lo == 0 && hi == x->subtree_size_) {
+                return augment::combine(aggregate, upcast(x)->aggregate_);
+            }
+            auto const left_size = bst_size(x->left_);
+            if (hi <= left_size) {
+                x = x->left_;
+                continue;
+            }
+            if (lo > left_size) {
+                lo -= left_size + 1;
+                hi -= left_size + 1;
+                x = x->right_;
+                continue;
+            }
+            // the range straddles x, the left part is a suffix of the left
+            // subtree and the right part a prefix of the right subtree
+            aggregate = augment::combine(
+                bst_fold_suffix(x->left_, lo), augment::lift(*upcast(x)));
+            return augment::combine(
+                aggregate, bst_fold_prefix(x->right_, hi - left_size - 1));
+        }
+        return aggregate;
+    }
+
+    // combine the nodes of ranks [lo, size) in the subtree rooted in x
+    static constexpr auto bst_fold_suffix(node* x, std::size_t lo)
+    {
+        using augment = typename Node::augment_type;
+        auto aggregate = augment::identity();
+        // the parts are found from right to left
+        while (x && lo < x->subtree_size_) {
+            if (lo == 0) {
+                return augment::combine(upcast(x)->aggregate_, aggregate);
+            }
+            auto const left_size = bst_size(x->left_);
+            if (lo > left_size) {
+                lo -= left_size + 1;
+                x = x->right_;
+                continue;
+            }
+            if (x->right_) {
+                aggregate = augment::combine(upcast(x->right_)->aggregate_, aggregate);
+            }
+            aggregate = augment::combine(augment::lift(*upcast(x)), aggregate);
+            x = x->left_;
+        }
+        return aggregate;
+    }
+
+    // combine the nodes of ranks [0, hi) in the subtree rooted in x
+    static constexpr auto bst_fold_prefix(node* x, std::size_t hi)
+    {
+        using augment = typename Node::augment_type;
+        auto aggregate = augment::identity();
+        while (x && hi > 0) {
+            if (hi == x->subtree_size_) {
+                return augment::combine(aggregate, upcast(x)->aggregate_);
+            }
+            auto const left_size = bst_size(x->left_);
+            if (hi <= left_size) {
+                x = x->left_;
+                continue;
+            }
+            if (x->left_) {
+                aggregate = augment::combine(aggregate, upcast(x->left_)->aggregate_);
+            }
+            aggregate = augment::combine(aggregate, augment::lift(*upcast(x)));
+            hi -= left_size + 1;
+            x = x->right_;
+        }
+        return aggregate;
+    }
+
+    // recompute the stale subtree sizes below x
+    static constexpr std::size_t bst_resolve(node* x)
+    {
+        if constexpr (lazy_sizes) {
+            if (!x) {
+                return 0;
+            }
+            if (!x->subtree_size_) {
+                x->subtree_size_ = bst_resolve(x->left_) + 1 + bst_resolve(x->right_);
+            }
+            return x->subtree_size_;
+        }
+        else {
+            return bst_size(x);
+        }
+    }
+
+    // x can be any node of the tree, or its header
+    static constexpr void bst_resolve_from(node* x)
+    {
+        if constexpr (lazy_sizes) {
+            while (!algorithms::bst_is_header(x)) {
+                x = x->parent_;
+            }
+            bst_resolve(x->parent_);
+        }
+    }
+
+    constexpr void bst_mark_stale(node* x)
+    {
+        for (; x != &header_ && x->subtree_size_; x = x->parent_) {
+            x->subtree_size_ = 0;
+            stats_.on_size_update(1);
+        }
+    }
+
+    // k must be lower than the size of the subtree rooted in x
+    static constexpr node* bst_select(node* x, std::size_t k)
+    {
+        while (true) {
+            auto const left_size = bst_size(x->left_);
+            if (k < left_size) {
+                x = x->left_;
+            }
+            else if (k > left_size) {
+                k -= left_size + 1;
+                x = x->right_;
+            }
+            else {
+                return x;
+            }
+        }
+    }
+
+    // climb until the subtree contains the target, then descend, so the cost
+    // is proportional to the height of the subtree containing both nodes
+    static constexpr node* bst_advance(node* x, std::ptrdiff_t n)
+    {
+        if (n == 0) {
+            return x;
+        }
+        if (algorithms::bst_is_header(x)) {
+            // only moving backward from end() is valid
+            return bst_select(x->parent_, x->parent_->subtree_size_ + n);
+        }
+
+        // n is relative to the position of x
+        while (n < -static_cast<std::ptrdiff_t>(bst_size(x->left_))
+               || n > static_cast<std::ptrdiff_t>(bst_size(x->right_))) {
+            if (algorithms::bst_is_root(x)) {
+                // only moving forward to end() is valid
+                return x->parent_;
+            }
+            if (x == x->parent_->left_) {
+                n -= bst_size(x->right_) + 1;
+            }
+            else {
+                n += bst_size(x->left_) + 1;
+            }
+            x = x->parent_;
+        }
+        return bst_select(x, bst_size(x->left_) + n);
+    }
+
+    static constexpr std::ptrdiff_t bst_distance(node* lhs, node* rhs)
+    {
+        if (lhs == rhs) {
+            return 0;
+        }
+        if (algorithms::bst_is_header(lhs) || algorithms::bst_is_header(rhs)) {
+            // the distance from begin() of the header is the cached tree size
+            return static_cast<std::ptrdiff_t>(rhs->distance_from_begin())
+                   - static_cast<std::ptrdiff_t>(lhs->distance_from_begin());
+        }
+
+        // climb until both nodes reach their lowest common ancestor, tracking
+        // the position of lhs and rhs relative to the current nodes. A node
+        // can't be an ancestor of a node with a larger or equal subtree, so it
+        // is always safe to climb from the smallest subtree.
+        std::ptrdiff_t lhs_offset = 0;
+        std::ptrdiff_t rhs_offset = 0;
+        auto climb = [](node*& x, std::ptrdiff_t& offset) {
+            if (x == x->parent_->left_) {
+                offset -= static_cast<std::ptrdiff_t>(bst_size(x->right_)) + 1;
+            }
+            else {
+                offset += static_cast<std::ptrdiff_t>(bst_size(x->left_)) + 1;
+            }
+            x = x->parent_;
+        };
+        while (lhs != rhs) {
+            auto const lhs_size = lhs->subtree_size_;
+            auto const rhs_size = rhs->subtree_size_;
+            if (lhs_size <= rhs_size) {
+                climb(lhs, lhs_offset);
+            }
+            if (rhs_size <= lhs_size) {
+                climb(rhs, rhs_offset);
+            }
+        }
+        return rhs_offset - lhs_offset;
+    }
+
+    // link the next n nodes in a perfectly balanced subtree
+    template <typename It>
+    static constexpr node* bst_build(It& it, std::size_t n, node* parent)
+    {
+        if (n == 0) {
+            return nullptr;
+        }
+        auto const left_size = (n - 1) / 2;
+        auto const right_size = n - 1 - left_size;
+
+        node* left = bst_build(it, left_size, nullptr);
+        cache_prefix(*it);
+        node* x = &*it;
+        ++it;
+        node* right = bst_build(it, right_size, x);
+
+        x->parent_ = parent;
+        x->left_ = left;
+        x->right_ = right;
+        if (left) {
+            left->parent_ = x;
+        }
+        x->subtree_size_ = n;
+        x->balance_ = std::bit_width(right_size) - std::bit_width(left_size);
+        bst_pull(x);
+        return x;
+    }
+
+    // link the nodes of the top depth levels of the subtree built from the n
+    // nodes starting at offset, shaped like bst_build would, and collect the
+    // subtrees left to build below them
+    template <typename It>
+    static node* bst_build_top(
+        It first,
+        std::size_t offset,
+        std::size_t n,
+        int depth,
+        std::vector<build_task>& tasks,
+        std::vector<node*>& top)
+    {
+        if (n == 0) {
+            return nullptr;
+        }
+        auto const left_size = (n - 1) / 2;
+        auto const right_size = n - 1 - left_size;
+        node* x = &first[static_cast<std::iter_difference_t<It>>(offset + left_size)];
+        if (depth == 0) {
+            auto it = first + static_cast<std::iter_difference_t<It>>(offset);
+            return bst_build(it, n, nullptr);
+        }
+        cache_prefix(*upcast(x));
+
+        auto const child = [&](std::size_t child_offset, std::size_t child_size, bool left) {
+            node* c = nullptr;
+            if (depth == 1 && child_size > 0) {
+                tasks.push_back({child_offset, child_size, x, left});
+            }
+            else {
+                c = bst_build_top(first, child_offset, child_size, depth - 1, tasks, top);
+                if (c) {
+                    c->parent_ = x;
+                }
+            }
+            return c;
+        };
+        x->parent_ = nullptr;
+        x->left_ = child(offset, left_size, true);
+        x->right_ = child(offset + left_size + 1, right_size, false);
+        x->subtree_size_ = n;
+        x->balance_ = std::bit_width(right_size) - std::bit_width(left_size);
+        top.push_back(x);
+        return x;
+    }
+
+    static constexpr int bst_height(node const* x)
+    {
+        int height = 0;
+        for (; x; ++height) {
+            x = x->balance_ < 0 ? x->left_ : x->right_;
+        }
+        return height;
+    }
+
+    static constexpr subtree bst_left(subtree t)
+    {
+        return {t.root->left_, t.height - (t.root->balance_ > 0 ? 2 : 1)};
+    }
+
+    static constexpr subtree bst_right(subtree t)
+    {
+        return {t.root->right_, t.height - (t.root->balance_ < 0 ? 2 : 1)};
+    }
+
+    // unlink the nodes from the header, the returned root has no parent
+    constexpr subtree detach()
+    {
+        subtree t{root(), bst_height(root())};
+        if (t.root) {
+            t.root->parent_ = nullptr;
+        }
+        header_ = make_header();
+        return t;
+    }
+
+    // split [first, last) out of the tree, returning its root
+    constexpr node* unlink_range(iterator first, iterator last)
+    {
+        if (first == last) {
+            return nullptr;
+        }
+        bst_resolve(root());
+        auto const first_rank = first.node_->distance_from_begin();
+        auto const last_rank = last.node_->distance_from_begin();
+        auto [lhs, rest] = qct_split(detach(), bst_rank_predicate(first_rank));
+        auto [mid, rhs] = qct_split(rest, bst_rank_predicate(last_rank - first_rank));
+        attach(qct_concat(lhs, rhs).root);
+        return mid.root;
+    }
+
+    constexpr void attach(node* x)
+    {
+        header_ = make_header();
+        if (!x) {
+            return;
+        }
+        root() = x;
+        x->parent_ = &header_;
+        leftmost() = bst_minimum(x);
+        rightmost() = bst_maximum(x);
+        if constexpr (lazy_sizes) {
+            header_.subtree_size_ = x->subtree_size_;
+        }
+    }
+
+    template <typename GoesRight>
+    constexpr void split_if(GoesRight goes_right, tree& right)
+    {
+        bst_resolve(root());
+        auto [lhs, rhs] = qct_split(detach(), goes_right);
+        attach(lhs.root);
+        right.attach(rhs.root);
+    }
+
+    // goes right once k nodes went left
+    static constexpr auto bst_rank_predicate(std::size_t k)
+    {
+        return [k](node* x) mutable {
+            auto const left_size = bst_size(x->left_);
+            if (k <= left_size) {
+                return true;
+            }
+            k -= left_size + 1;
+            return false;
+        };
+    }
+
+    template <typename Dispose>
+    static constexpr void bst_dispose(node* x, Dispose& dispose)
+    {
+        if (!x) {
+            return;
+        }
+        x->parent_ = nullptr;
+        while (x) {
+            if (x->left_) {
+                x = x->left_;
+            }
+            else if (x->right_) {
+                x = x->right_;
+            }
+            else {
+                node* parent = x->parent_;
+                if (parent) {
+                    if (x == parent->left_) {
+                        parent->left_ = nullptr;
+                    }
+                    else {
+                        parent->right_ = nullptr;
+                    }
+                }
+                dispose(*upcast(x));
+                x = parent;
+            }
+        }
+    }
+
+    constexpr void bst_shift_nodes(node const* u, node* v)
+    {
+        if (u == root()) {
+            root() = v;
+        }
+        else if (u == u->parent_->left_) {
+            u->parent_->left_ = v;
+        }
+        else {
+            u->parent_->right_ = v;
+        }
+        if (v) {
+            v->parent_ = u->parent_;
+        }
+    }
+
+    constexpr void qct_insert(value_type& x)
+    {
+        node* parent = &header_;
+        node* current = root();
+        bool left = true;
+        std::size_t depth = 0;
+        while (current) {
+            parent = current;
+            if constexpr (!lazy_sizes) {
+                parent->subtree_size_++;
+                stats_.on_size_update(1);
+            }
+            left = !less(*upcast(current), x);
+            current = bst_child(current, !left);
+            ++depth;
+        }
+        stats_.on_descent(depth);
+        qct_link(parent, x, left);
+        if constexpr (lazy_sizes) {
+            bst_mark_stale(parent);
+        }
+    }
+
+    // insert x, which must not compare less than the node finger, by
+    // descending from the lowest ancestor of finger whose subtree bounds x
+    constexpr void qct_insert_after(node* finger, value_type& x)
+    {
+        node* y = finger;
+        while (true) {
+            node* z = y;
+            while (!algorithms::bst_is_root(z) && z == z->parent_->right_) {
+                z = z->parent_;
+            }
+            if (algorithms::bst_is_root(z) || !less(*upcast(z->parent_), x)) {
+                break;
+            }
+            y = z->parent_;
+        }
+
+        node* parent = y;
+        node* current = y;
+        bool left = true;
+        std::size_t depth = 0;
+        while (current) {
+            parent = current;
+            left = !less(*upcast(current), x);
+            current = left ? current->left_ : current->right_;
+            ++depth;
+        }
+        stats_.on_descent(depth);
+        qct_link_sized(parent, x, left);
+    }
+
+    // link x below parent and account for it in the sizes of its ancestors
+    constexpr void qct_link_sized(node* parent, value_type& x, bool left)
+    {
+        if constexpr (lazy_sizes) {
+            bst_mark_stale(parent);
+        }
+        else {
+            for (node* a = parent; a != &header_; a = a->parent_) {
+                a->subtree_size_++;
+                stats_.on_size_update(1);
+            }
+        }
+        qct_link(parent, x, left);
+    }
+
+    constexpr void qct_link(node* parent, value_type& x, bool left)
+    {
+        if (parent == &header_) {
+            root() = &x;
+            leftmost() = &x;
+            rightmost() = &x;
+        }
+        else if (left) {
+            parent->left_ = &x;
+            if (parent == leftmost()) {
+                leftmost() = &x;
+            }
+        }
+        else {
+            parent->right_ = &x;
+            if (parent == rightmost()) {
+                rightmost() = &x;
+            }
+        }
+
+        x.parent_ = parent;
+        x.left_ = nullptr;
+        x.right_ = nullptr;
+        x.balance_ = 0;
+        x.subtree_size_ = 1;
+    }
+
+    constexpr erase_rebalance_info bst_erase(node const* z)
+    {
+        erase_rebalance_info info{};
+        info.x = z->parent_;
+        info.n_is_left = z->parent_ && z == z->parent_->left_;
+        if (!z->left_) {
+            bst_shift_nodes(z, z->right_);
+            if (z == leftmost()) {
+                // z->right could be null, z->parent could be the header
+                node* parent = z->parent_;
+                leftmost() = z->right_ ? bst_minimum(z->right_) : parent;
+            }
+            if (z == rightmost()) {
+                // z is a leaf, z->parent could be the header
+                rightmost() = z->parent_;
+            }
+        }
+        else if (!z->right_) {
+            bst_shift_nodes(z, z->left_);
+            if (z == rightmost()) {
+                // z->left can't be null
+                rightmost() = bst_maximum(z->left_);
+            }
+        }
+        else {
+            node* y = bst_minimum(z->right_);
+            if (y->parent_ != z) {
+                info.x = y->parent_;
+                info.n_is_left = true;
+                bst_shift_nodes(y, y->right_);
+
+                y->right_ = z->right_;
+                y->right_->parent_ = y;
+            }
+            else {
+                info.x = y;
+                info.n_is_left = false;
+            }
+            bst_shift_nodes(z, y);
+            y->left_ = z->left_;
+            y->left_->parent_ = y;
+            info.y = y;
+        }
+        return info;
+    }
+
+    // when x is stale, the rotated nodes only need to be marked stale
+    static constexpr bool qct_rotate_stale(node* x, node* z, node* y = nullptr)
+    {
+        if constexpr (lazy_sizes) {
+            if (!x->subtree_size_) {
+                z->subtree_size_ = 0;
+                if (y) {
+                    y->subtree_size_ = 0;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static constexpr node* qct_rotate_left(node* x, node* z)
+    {
+        node* tmp = z->left_;
+        x->right_ = tmp;
+        if (tmp) {
+            tmp->parent_ = x;
+        }
+        z->left_ = x;
+        x->parent_ = z;
+
+        if (!qct_rotate_stale(x, z)) {
+            auto x_subtree_size = x->subtree_size_;
+            x->subtree_size_ -= z->subtree_size_ - bst_size(tmp);
+            z->subtree_size_ = x_subtree_size;
+        }
+        bst_pull(x);
+        bst_pull(z);
+
+        if (z->balance_ == 0) {
+            x->balance_ = 1;
+            z->balance_ = -1;
+        }
+        else {
+            x->balance_ = 0;
+            z->balance_ = 0;
+        }
+        return z;
+    }
+
+    static constexpr node* qct_rotate_right(node* x, node* z)
     {
         node* tmp = z->right_;
         x->left_ = tmp;
         if (tmp) {
             tmp->parent_ = x;
         }
-        z->right_ = x;
-        x->parent_ = z;
+        z->right_ = x;
+        x->parent_ = z;
+
+        if (!qct_rotate_stale(x, z)) {
+            auto x_subtree_size = x->subtree_size_;
+            x->subtree_size_ -= z->subtree_size_ - bst_size(tmp);
+            z->subtree_size_ = x_subtree_size;
+        }
+        bst_pull(x);
+        bst_pull(z);
+
+        if (z->balance_ == 0) {
+            x->balance_ = -1;
+            z->balance_ = 1;
+        }
+        else {
+            x->balance_ = 0;
+            z->balance_ = 0;
+        }
+        return z;
+    }
+
+    static constexpr node* qct_rotate_right_left(node* x, node* z)
+    {
+        node* y = z->left_;
+        node* tmp1 = y->right_;
+        z->left_ = tmp1;
+        if (tmp1) {
+            tmp1->parent_ = z;
+        }
+        y->right_ = z;
+        z->parent_ = y;
+
+        node* tmp2 = y->left_;
+        x->right_ = tmp2;
+        if (tmp2) {
+            tmp2->parent_ = x;
+        }
+        y->left_ = x;
+        x->parent_ = y;
+
+        if (!qct_rotate_stale(x, z, y)) {
+            auto x_subtree_size = x->subtree_size_;
+            x->subtree_size_ -= z->subtree_size_ - bst_size(tmp2);
+            z->subtree_size_ -= y->subtree_size_ - bst_size(tmp1);
+            y->subtree_size_ = x_subtree_size;
+        }
+        bst_pull(x);
+        bst_pull(z);
+        bst_pull(y);
+
+        if (y->balance_ == 0) {
+            x->balance_ = 0;
+            z->balance_ = 0;
+        }
+        else if (y->balance_ > 0) {
+            x->balance_ = -1;
+            z->balance_ = 0;
+        }
+        else {
+            x->balance_ = 0;
+            z->balance_ = 1;
+        }
+        y->balance_ = 0;
+        return y;
+    }
+
+    static constexpr node* qct_rotate_left_right(node* x, node* z)
+    {
+        node* y = z->right_;
+        node* tmp1 = y->left_;
+        z->right_ = tmp1;
+        if (tmp1) {
+            tmp1->parent_ = z;
+        }
+        y->left_ = z;
+        z->parent_ = y;
+
+        node* tmp2 = y->right_;
+        x->left_ = tmp2;
+        if (tmp2) {
+            tmp2->parent_ = x;
+        }
+        y->right_ = x;
+        x->parent_ = y;
+
+        if (!qct_rotate_stale(x, z, y)) {
+            auto x_subtree_size = x->subtree_size_;
+            x->subtree_size_ -= z->subtree_size_ - bst_size(tmp2);
+            z->subtree_size_ -= y->subtree_size_ - bst_size(tmp1);
+            y->subtree_size_ = x_subtree_size;
+        }
+        bst_pull(x);
+        bst_pull(z);
+        bst_pull(y);
+
+        if (y->balance_ == 0) {
+            x->balance_ = 0;
+            z->balance_ = 0;
+        }
+        else if (y->balance_ < 0) {
+            x->balance_ = 1;
+            z->balance_ = 0;
+        }
+        else {
+            x->balance_ = 0;
+            z->balance_ = -1;
+        }
+        y->balance_ = 0;
+        return y;
+    }
+
+    constexpr void qct_insert_rebalance(node* z)
+    {
+        // rotations don't change the content of the subtrees above them, so
+        // the aggregates can be fixed before rebalancing
+        bst_pull_path(z);
+        std::size_t steps = 0;
+        for (node* x = z->parent_; x != &header_; z = x, x = z->parent_) {
+            ++steps;
+            node* n;
+            node* g = x->parent_;
+            if (z == x->left_) {
+                if (x->balance_ < 0) {
+                    if (z->balance_ > 0) {
+                        stats_.on_rotation(true);
+                        n = qct_rotate_left_right(x, z);
+                    }
+                    else {
+                        stats_.on_rotation(false);
+                        n = qct_rotate_right(x, z);
+                    }
+                }
+                else if (x->balance_ > 0) {
+                    x->balance_ = 0;
+                    break;
+                }
+                else {
+                    x->balance_ = -1;
+                    continue;
+                }
+            }
+            else {
+                if (x->balance_ > 0) {
+                    if (z->balance_ < 0) {
+                        stats_.on_rotation(true);
+                        n = qct_rotate_right_left(x, z);
+                    }
+                    else {
+                        stats_.on_rotation(false);
+                        n = qct_rotate_left(x, z);
+                    }
+                }
+                else if (x->balance_ < 0) {
+                    x->balance_ = 0;
+                    break;
+                }
+                else {
+                    x->balance_ = 1;
+                    continue;
+                }
+            }
+
+            n->parent_ = g;
+            if (g != &header_) {
+                if (x == g->left_) {
+                    g->left_ = n;
+                }
+                else {
+                    g->right_ = n;
+                }
+            }
+            else {
+                root() = n;
+            }
+            break;
+        }
+        stats_.on_rebalance(steps);
+    }
+
+    constexpr void qct_erase_rebalance(erase_rebalance_info info)
+    {
+        node* g = info.x;
+        node* n;
+        bool n_is_left = info.n_is_left;
+        bool height_changed = false;
+
+        if constexpr (lazy_sizes) {
+            bst_mark_stale(info.x);
+        }
+        bst_pull_path(info.x);
+
+        std::size_t steps = 0;
+        for (node* x = info.x; x != &header_;
+             x = g, n_is_left = x && n == x->left_) {
+            ++steps;
+            g = x->parent_;
+            if constexpr (!lazy_sizes) {
+                x->subtree_size_--;
+                stats_.on_size_update(1);
+            }
+
+            if (n_is_left) {
+                if (x->balance_ > 0) {
+                    node* z = x->right_;
+                    height_changed = z->balance_ != 0;
+                    if (z->balance_ < 0) {
+                        stats_.on_rotation(true);
+                        n = qct_rotate_right_left(x, z);
+                    }
+                    else {
+                        stats_.on_rotation(false);
+                        n = qct_rotate_left(x, z);
+                    }
+                }
+                else if (x->balance_ < 0) {
+                    x->balance_ = 0;
+                    n = x;
+                    continue;
+                }
+                else {
+                    x->balance_ = 1;
+                    break;
+                }
+            }
+            else {
+                if (x->balance_ < 0) {
+                    node* z = x->left_;
+                    height_changed = z->balance_ != 0;
+                    if (z->balance_ > 0) {
+                        stats_.on_rotation(true);
+                        n = qct_rotate_left_right(x, z);
+                    }
+                    else {
+                        stats_.on_rotation(false);
+                        n = qct_rotate_right(x, z);
+                    }
+                }
+                else if (x->balance_ > 0) {
+                    x->balance_ = 0;
+                    n = x;
+                    continue;
+                }
+                else {
+                    x->balance_ = -1;
+                    break;
+                }
+            }
+
+            n->parent_ = g;
+            if (g != &header_) {
+                if (x == g->left_) {
+                    g->left_ = n;
+                }
+                else {
+                    g->right_ = n;
+                }
+            }
+            else {
+                root() = n;
+            }
+            if (!height_changed) {
+                break;
+            }
+        }
+        stats_.on_rebalance(steps);
+
+        if constexpr (!lazy_sizes) {
+            for (node* x = g; x != &header_; x = x->parent_) {
+                x->subtree_size_--;
+                stats_.on_size_update(1);
+            }
+        }
+    }
+
+    // link the roots of lhs and rhs below k, all nodes of lhs must be ordered
+    // before k and all nodes of rhs after k
+    constexpr subtree qct_join(subtree lhs, node* k, subtree rhs) const
+    {
+        if (lhs.height > rhs.height + 1) {
+            // attach on the right spine of lhs, at the height of rhs
+            subtree c = lhs;
+            node* p = nullptr;
+            while (c.height > rhs.height + 1) {
+                p = c.root;
+                c = bst_right(c);
+            }
+            qct_join_link(c, k, rhs);
+            p->right_ = k;
+            k->parent_ = p;
+            for (node* x = p; x; x = x->parent_) {
+                x->subtree_size_ += 1 + bst_size(rhs.root);
+                bst_pull(x);
+            }
+            return qct_join_rebalance(k, lhs);
+        }
+        if (rhs.height > lhs.height + 1) {
+            // attach on the left spine of rhs, at the height of lhs
+            subtree c = rhs;
+            node* p = nullptr;
+            while (c.height > lhs.height + 1) {
+                p = c.root;
+                c = bst_left(c);
+            }
+            qct_join_link(lhs, k, c);
+            p->left_ = k;
+            k->parent_ = p;
+            for (node* x = p; x; x = x->parent_) {
+                x->subtree_size_ += 1 + bst_size(lhs.root);
+                bst_pull(x);
+            }
+            return qct_join_rebalance(k, rhs);
+        }
+        qct_join_link(lhs, k, rhs);
+        k->parent_ = nullptr;
+        return {k, std::max(lhs.height, rhs.height) + 1};
+    }
+
+    // all nodes of lhs must be ordered before the nodes of rhs
+    constexpr subtree qct_concat(subtree lhs, subtree rhs) const
+    {
+        if (!lhs.root) {
+            return rhs;
+        }
+        if (!rhs.root) {
+            return lhs;
+        }
+        auto [k, rest] = qct_split(rhs, bst_rank_predicate(1));
+        return qct_join(lhs, k.root, rest);
+    }
+
+    static constexpr void qct_join_link(subtree lhs, node* k, subtree rhs)
+    {
+        k->left_ = lhs.root;
+        k->right_ = rhs.root;
+        if (lhs.root) {
+            lhs.root->parent_ = k;
+        }
+        if (rhs.root) {
+            rhs.root->parent_ = k;
+        }
+        k->subtree_size_ = bst_size(lhs.root) + 1 + bst_size(rhs.root);
+        k->balance_ = rhs.height - lhs.height;
+        bst_pull(k);
+    }
+
+    // the height of the subtree rooted in z grew by one, rebalance up to the
+    // root of t, which has no parent
+    constexpr subtree qct_join_rebalance(node* z, subtree t) const
+    {
+        std::size_t steps = 0;
+        bool grew = true;
+        for (node* x = z->parent_; x; x = z->parent_) {
+            ++steps;
+            node* n;
+            node* g = x->parent_;
+            if (z == x->left_) {
+                if (x->balance_ > 0) {
+                    x->balance_ = 0;
+                    grew = false;
+                    break;
+                }
+                if (x->balance_ == 0) {
+                    x->balance_ = -1;
+                    z = x;
+                    continue;
+                }
+                grew = z->balance_ == 0;
+                if (z->balance_ > 0) {
+                    stats_.on_rotation(true);
+                    n = qct_rotate_left_right(x, z);
+                }
+                else {
+                    stats_.on_rotation(false);
+                    n = qct_rotate_right(x, z);
+                }
+            }
+            else {
+                if (x->balance_ < 0) {
+                    x->balance_ = 0;
+                    grew = false;
+                    break;
+                }
+                if (x->balance_ == 0) {
+                    x->balance_ = 1;
+                    z = x;
+                    continue;
+                }
+                grew = z->balance_ == 0;
+                if (z->balance_ < 0) {
+                    stats_.on_rotation(true);
+                    n = qct_rotate_right_left(x, z);
+                }
+                else {
+                    stats_.on_rotation(false);
+                    n = qct_rotate_left(x, z);
+                }
+            }
+
+            n->parent_ = g;
+            if (g) {
+                if (x == g->left_) {
+                    g->left_ = n;
+                }
+                else {
+                    g->right_ = n;
+                }
+            }
+            else {
+                t.root = n;
+            }
+            if (!grew) {
+                break;
+            }
+            z = n;
+        }
+        stats_.on_rebalance(steps);
+        if (grew) {
+            // z is the root of t
+            return {z, t.height + 1};
+        }
+        return t;
+    }
+
+    template <typename GoesRight>
+    constexpr std::pair<subtree, subtree>
+    qct_split(subtree t, GoesRight&& goes_right) const
+    {
+        if (!t.root) {
+            return {};
+        }
+        node* x = t.root;
+        subtree lhs = bst_left(t);
+        subtree rhs = bst_right(t);
+        if (lhs.root) {
+            lhs.root->parent_ = nullptr;
+        }
+        if (rhs.root) {
+            rhs.root->parent_ = nullptr;
+        }
+
+        if (goes_right(x)) {
+            auto [ll, lr] = qct_split(lhs, goes_right);
+            return {ll, qct_join(lr, x, rhs)};
+        }
+        auto [rl, rr] = qct_split(rhs, goes_right);
+        return {qct_join(lhs, x, rl), rr};
+    }
+
+    // nodes lower than the root of key, the node of t equivalent to it if any,
+    // and the nodes greater
+    struct split3_result {
+        subtree lhs;
+        node* equal{};
+        subtree rhs;
+    };
+
+    constexpr split3_result qct_split3(subtree t, node* key) const
+    {
+        if (!t.root) {
+            return {};
+        }
+        node* x = t.root;
+        subtree lhs = bst_left(t);
+        subtree rhs = bst_right(t);
+        if (lhs.root) {
+            lhs.root->parent_ = nullptr;
+        }
+        if (rhs.root) {
+            rhs.root->parent_ = nullptr;
+        }
+
+        if (less(*upcast(x), *upcast(key))) {
+            auto [rl, equal, rr] = qct_split3(rhs, key);
+            return {qct_join(lhs, x, rl), equal, rr};
+        }
+        if (less(*upcast(key), *upcast(x))) {
+            auto [ll, equal, lr] = qct_split3(lhs, key);
+            return {ll, equal, qct_join(lr, x, rhs)};
+        }
+        return {lhs, x, rhs};
+    }
+
+    // the stats counters aren't atomic, so trees with stats only run their tasks
+    // on the calling thread
+    template <typename Executor>
+    static constexpr bool executor_allowed = !has_stats || std::same_as<Executor, inline_executor>;
+
+    // about 4 tasks per thread, so uneven progress balances out
+    template <typename Executor>
+    static constexpr int fork_depth(Executor& ex)
+    {
+        static_assert(executor_allowed<Executor>, "trees with stats need an inline_executor");
+        auto const concurrency = static_cast<std::size_t>(ex.concurrency());
+        return concurrency > 1 ? static_cast<int>(std::bit_width(4 * concurrency - 1))
+                               : 0;
+    }
+
+    // run left and right, in parallel while depth is positive
+    template <typename Executor, typename Left, typename Right>
+    static constexpr void fork(Executor& ex, int depth, Left&& left, Right&& right)
+    {
+        if (depth > 0) {
+            ex.bulk(2, [&](std::size_t i) { i ? right() : left(); });
+        }
+        else {
+            left();
+            right();
+        }
+    }
+
+    // the recursions below split t1 around the root of t2 and recurse on
+    // both sides. t2 is only read by the intersection and the difference.
+    template <typename Dispose, typename Executor>
+    constexpr subtree
+    qct_union(subtree t1, subtree t2, Dispose& dispose, Executor& ex, int depth) const
+    {
+        if (!t1.root) {
+            return t2;
+        }
+        if (!t2.root) {
+            return t1;
+        }
+        node* k = t2.root;
+        subtree l2 = bst_left(t2);
+        subtree r2 = bst_right(t2);
+        if (l2.root) {
+            l2.root->parent_ = nullptr;
+        }
+        if (r2.root) {
+            r2.root->parent_ = nullptr;
+        }
+        auto [l1, equal, r1] = qct_split3(t1, k);
+
+        subtree lhs, rhs;
+        fork(
+            ex,
+            depth,
+            [&] { lhs = qct_union(l1, l2, dispose, ex, depth - 1); },
+            [&] { rhs = qct_union(r1, r2, dispose, ex, depth - 1); });
+        if (equal) {
+            // keep the node of this tree
+            k->parent_ = nullptr;
+            dispose(*upcast(k));
+            k = equal;
+        }
+        return qct_join(lhs, k, rhs);
+    }
+
+    template <typename Dispose, typename Executor>
+    constexpr subtree qct_intersection(
+        subtree t1,
+        subtree t2,
+        Dispose& dispose,
+        Executor& ex,
+        int depth) const
+    {
+        if (!t1.root) {
+            return {};
+        }
+        if (!t2.root) {
+            bst_dispose(t1.root, dispose);
+            return {};
+        }
+        auto [l1, equal, r1] = qct_split3(t1, t2.root);
+
+        subtree lhs, rhs;
+        fork(
+            ex,
+            depth,
+            [&] { lhs = qct_intersection(l1, bst_left(t2), dispose, ex, depth - 1); },
+            [&] { rhs = qct_intersection(r1, bst_right(t2), dispose, ex, depth - 1); });
+        if (equal) {
+            return qct_join(lhs, equal, rhs);
+        }
+        return qct_concat(lhs, rhs);
+    }
+
+    template <typename Dispose, typename Executor>
+    constexpr subtree qct_difference(
+        subtree t1,
+        subtree t2,
+        Dispose& dispose,
+        Executor& ex,
+        int depth) const
+    {
+        if (!t1.root || !t2.root) {
+            return t1;
+        }
+        auto [l1, equal, r1] = qct_split3(t1, t2.root);
+
+        subtree lhs, rhs;
+        fork(
+            ex,
+            depth,
+            [&] { lhs = qct_difference(l1, bst_left(t2), dispose, ex, depth - 1); },
+            [&] { rhs = qct_difference(r1, bst_right(t2), dispose, ex, depth - 1); });
+        if (equal) {
+            equal->parent_ = nullptr;
+            dispose(*upcast(equal));
+        }
+        return qct_concat(lhs, rhs);
+    }
+
+    // the first node equal to val met on the way down, where the bounds of
+    // equal_range split, and the upper bound of its subtree
+    template <typename T>
+    constexpr std::pair<node*, node*> equal_range_split(T const& val) const
+    {
+        node* current = root();
+        node* end = as_mutable().end().node_;
+        std::size_t depth = 0;
+        while (current) {
+            if (less(*upcast(current), val)) {
+                current = current->right_;
+            }
+            else if (less(val, *upcast(current))) {
+                end = current;
+                current = current->left_;
+            }
+            else {
+                break;
+            }
+            ++depth;
+        }
+        stats_.on_descent(depth);
+        return {current, end};
+    }
+
+    // lower_bound in a subtree without nodes greater than val, along with the
+    // number of nodes equal to val
+    template <typename T>
+    constexpr std::pair<iterator, std::size_t>
+    lower_bound_count(node* root, node* end, T const& val) const
+    {
+        std::size_t count = 0;
+        node* current = root;
+        std::size_t depth = 0;
+        while (current) {
+            bool const right = less(*upcast(current), val);
+            if (!right) {
+                end = current;
+                count += bst_size(current->right_) + 1;
+            }
+            current = bst_child(current, right);
+            ++depth;
+        }
+        stats_.on_descent(depth);
+        return {iterator{end, stats_address()}, count};
+    }
+
+    // upper_bound in a subtree without nodes lower than val, along with the
+    // number of nodes equal to val
+    template <typename T>
+    constexpr std::pair<iterator, std::size_t>
+    upper_bound_count(node* root, node* end, T const& val) const
+    {
+        std::size_t count = 0;
+        node* current = root;
+        std::size_t depth = 0;
+        while (current) {
+            bool const right = !less(val, *upcast(current));
+            if (right) {
+                count += bst_size(current->left_) + 1;
+            }
+            else {
+                end = current;
+            }
+            current = bst_child(current, right);
+            ++depth;
+        }
+        stats_.on_descent(depth);
+        return {iterator{end, stats_address()}, count};
+    }
+
+    template <typename T>
+    constexpr iterator lower_bound(node* root, node* end, T const& val) const
+    {
+        node* res = end;
+        node* current = root;
+        std::size_t depth = 0;
+        while (current) {
+            bool const right = less(*upcast(current), val);
+            if (!right) {
+                res = current;
+            }
+            current = bst_child(current, right);
+            ++depth;
+        }
+        stats_.on_descent(depth);
+        return iterator{res, stats_address()};
+    }
+
+    template <typename It, typename Out>
+    Out lower_bound_batch_sorted(
+        node* x, node* bound, It first, It last, Out out) const
+    {
+        while (first != last) {
+            if (!x) {
+                for (; first != last; ++first) {
+                    *out++ = iterator{bound, stats_address()};
+                }
+                break;
+            }
+            if (std::next(first) == last) {
+                // nothing left to share
+                *out++ = lower_bound(x, bound, *first);
+                break;
+            }
+            // the keys not greater than x go left, x bounds them
+            auto const mid = std::partition_point(first, last, [&](auto const& key) {
+                return !less(*upcast(x), key);
+            });
+            if (x->left_) {
+                detail::prefetch(x->left_);
+            }
+            if (x->right_) {
+                detail::prefetch(x->right_);
+            }
+            out = lower_bound_batch_sorted(x->left_, x, first, mid, out);
+            first = mid;
+            x = x->right_;
+        }
+        return out;
+    }
+
+    template <typename T>
+    constexpr iterator upper_bound(node* root, node* end, T const& val) const
+    {
+        node* res = end;
+        node* current = root;
+        std::size_t depth = 0;
+        while (current) {
+            bool const right = !less(val, *upcast(current));
+            if (!right) {
+                res = current;
+            }
+            current = bst_child(current, right);
+            ++depth;
+        }
+        stats_.on_descent(depth);
+        return iterator{res, stats_address()};
+    }
+
+    template <typename T>
+    constexpr std::size_t count_less(node* root, T const& val) const
+    {
+        std::size_t count = 0;
+        node* current = root;
+        std::size_t depth = 0;
+        while (current) {
+            bool const right = less(*upcast(current), val);
+            if (right) {
+                count += bst_size(current->left_) + 1;
+            }
+            current = bst_child(current, right);
+            ++depth;
+        }
+        stats_.on_descent(depth);
+        return count;
+    }
+
+    template <typename T>
+    constexpr std::size_t count_less_equal(node* root, T const& val) const
+    {
+        std::size_t count = 0;
+        node* current = root;
+        std::size_t depth = 0;
+        while (current) {
+            bool const right = !less(val, *upcast(current));
+            if (right) {
+                count += bst_size(current->left_) + 1;
+            }
+            current = bst_child(current, right);
+            ++depth;
+        }
+        stats_.on_descent(depth);
+        return count;
+    }
+
+    static constexpr node make_header()
+    {
+        node header{};
+        header.balance_ = algorithms::bst_header_balance;
+        return header;
+    }
+
+    constexpr auto& root() { return header_.parent_; }
+    constexpr node* root() const { return header_.parent_; }
+    constexpr auto& leftmost() { return header_.left_; }
+    constexpr auto& rightmost() { return header_.right_; }
+
+    constexpr tree& as_mutable() const { return *const_cast<tree*>(this); }
+
+    node header_ = make_header();
+    [[no_unique_address]] Comp comp_{};
+    [[no_unique_address]] mutable stats_type stats_{};
+};
+
+// a search advancing by steps, step returning false once it is done
+template <typename S>
+concept stepped_search = requires(S& s) {
+    { s.step() } -> std::same_as<bool>;
+};
+
+// run the searches, keeping up to Width of them in flight and stepping them in
+// turn, so that each one loads its next node while the others advance. A
+// search done is replaced by the next one, the results are left in the
+// searches.
+template <std::size_t Width = 16, std::ranges::forward_range Searches>
+    requires stepped_search<std::ranges::range_value_t<Searches>>
+constexpr void interleave(Searches&& searches)
+{
+    static_assert(Width > 0, "no search would ever be stepped");
+    std::array<std::ranges::range_value_t<Searches>*, Width> active;
+    std::size_t n = 0;
+    auto it = std::ranges::begin(searches);
+    auto const last = std::ranges::end(searches);
+    for (; n < Width && it != last; ++it) {
+        active[n++] = &*it;
+    }
+    while (n > 0) {
+        for (std::size_t i = 0; i < n;) {
+            if (active[i]->step()) {
+                ++i;
+            }
+            else if (it != last) {
+                active[i++] = &*it++;
+            }
+            else {
+                // the last one is moved here and steps in its turn
+                active[i] = active[--n];
+            }
+        }
+    }
+}
+
+namespace detail {
+
+// hands out fixed size slots from chunks of growing size, freed slots are
+// recycled before carving new ones
+template <typename T, typename Alloc>
+class slab_pool {
+public:
+    explicit slab_pool(Alloc const& alloc = Alloc{})
+        : alloc_{alloc}, chunks_{chunk_allocator{alloc}}
+    {
+    }
+
+    slab_pool(slab_pool const&) = delete;
+    slab_pool& operator=(slab_pool const&) = delete;
+
+    slab_pool(slab_pool&& other) noexcept
+        : alloc_{std::move(other.alloc_)},
+          chunks_{std::move(other.chunks_)},
+          free_{std::exchange(other.free_, nullptr)},
+          current_{std::exchange(other.current_, nullptr)},
+          end_{std::exchange(other.end_, nullptr)}
+    {
+    }
+
+    slab_pool& operator=(slab_pool&& other) noexcept
+    {
+        if (this != &other) {
+            release();
+            alloc_ = std::move(other.alloc_);
+            chunks_ = std::move(other.chunks_);
+            free_ = std::exchange(other.free_, nullptr);
+            current_ = std::exchange(other.current_, nullptr);
+            end_ = std::exchange(other.end_, nullptr);
+        }
+        return *this;
+    }
+
+    ~slab_pool() { release(); }
+
+    void* allocate()
+    {
+        if (free_) {
+            return std::exchange(free_, free_->next);
+        }
+        if (current_ == end_) {
+            grow();
+        }
+        return current_++;
+    }
+
+    void deallocate(void* p) noexcept
+    {
+        auto* s = static_cast<slot*>(p);
+        s->next = free_;
+        free_ = s;
+    }
+
+private:
+    static constexpr std::size_t min_chunk_size = 64;
+    static constexpr std::size_t max_chunk_size = 64 * 1024;
+
+    union slot {
+        slot* next;
+        alignas(T) std::byte storage[sizeof(T)];
+    };
+
+    using slot_allocator =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<slot>;
+    using chunk_allocator = typename std::allocator_traits<
+        Alloc>::template rebind_alloc<std::pair<slot*, std::size_t>>;
+
+    void release() noexcept
+    {
+        for (auto [p, n] : chunks_) {
+            std::allocator_traits<slot_allocator>::deallocate(alloc_, p, n);
+        }
+        chunks_.clear();
+    }
+
+    void grow()
+    {
+        auto const n = chunks_.empty()
+                           ? min_chunk_size
+                           : std::min(chunks_.back().second * 2, max_chunk_size);
+        chunks_.reserve(chunks_.size() + 1);
+        current_ = std::allocator_traits<slot_allocator>::allocate(alloc_, n);
+        end_ = current_ + n;
+        chunks_.emplace_back(current_, n);
+    }
+
+    [[no_unique_address]] slot_allocator alloc_;
+    std::vector<std::pair<slot*, std::size_t>, chunk_allocator> chunks_;
+    slot* free_{nullptr};
+    slot* current_{nullptr};
+    slot* end_{nullptr};
+};
+
+}
+
+// owning sorted container storing its elements in qct::tree nodes allocated
+// from a slab pool
+template <typename T, typename Comp = std::less<>, typename Alloc = std::allocator<T>>
+class ordered_multiset {
+private:
+    struct node_type : node<> {
+        template <typename... Args>
+        explicit node_type(Args&&... args) : value(std::forward<Args>(args)...)
+        {
+        }
+
+        T value;
+    };
+
+    struct node_compare {
+        constexpr bool operator()(node_type const& lhs, node_type const& rhs) const
+        {
+            return comp(lhs.value, rhs.value);
+        }
+        template <typename K>
+        constexpr bool operator()(node_type const& lhs, K const& rhs) const
+        {
+            return comp(lhs.value, rhs);
+        }
+        template <typename K>
+        constexpr bool operator()(K const& lhs, node_type const& rhs) const
+        {
+            return comp(lhs, rhs.value);
+        }
+
+        [[no_unique_address]] std::remove_const_t<Comp> comp;
+    };
+
+    using tree_type = tree<node_type, node_compare>;
+    using tree_iterator = typename tree_type::iterator;
+
+public:
+    using value_type = T;
+    using value_compare = Comp;
+    using allocator_type = Alloc;
+    using size_type = std::size_t;
+
+    class iterator {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = T;
+
+        iterator() = default;
+
+        iterator& operator++()
+        {
+            ++it_;
+            return *this;
+        }
+        iterator operator++(int)
+        {
+            iterator retval = *this;
+            ++(*this);
+            return retval;
+        }
+        iterator& operator--()
+        {
+            --it_;
+            return *this;
+        }
+        iterator operator--(int)
+        {
+            iterator retval = *this;
+            --(*this);
+            return retval;
+        }
+        iterator& operator+=(difference_type n)
+        {
+            it_ += n;
+            return *this;
+        }
+        iterator& operator-=(difference_type n)
+        {
+            it_ -= n;
+            return *this;
+        }
+        friend iterator operator+(iterator it, difference_type n)
+        {
+            return it += n;
+        }
+        friend iterator operator+(difference_type n, iterator it)
+        {
+            return it += n;
+        }
+        friend iterator operator-(iterator it, difference_type n)
+        {
+            return it -= n;
+        }
+        friend difference_type operator-(iterator lhs, iterator rhs)
+        {
+            return lhs.it_ - rhs.it_;
+        }
+        friend difference_type distance(iterator lhs, iterator rhs)
+        {
+            return rhs.it_ - lhs.it_;
+        }
+        bool operator==(iterator const& other) const = default;
+
+        T const& operator*() const { return it_->value; }
+        T const* operator->() const { return &it_->value; }
+
+    private:
+        friend class ordered_multiset;
+
+        explicit iterator(tree_iterator it) : it_{it} {}
+
+        tree_iterator it_;
+    };
+
+    using const_iterator = iterator;
+
+    static_assert(std::bidirectional_iterator<iterator>);
+
+    ordered_multiset() = default;
+    explicit ordered_multiset(Alloc const& alloc) : pool_{alloc} {}
+    explicit ordered_multiset(Comp comp, Alloc const& alloc = {})
+        : pool_{alloc}, tree_{node_compare{std::move(comp)}}
+    {
+    }
+
+    ordered_multiset(ordered_multiset&&) noexcept = default;
+    ordered_multiset& operator=(ordered_multiset&& other) noexcept
+    {
+        if (this != &other) {
+            clear();
+            pool_ = std::move(other.pool_);
+            tree_ = std::move(other.tree_);
+        }
+        return *this;
+    }
+
+    ~ordered_multiset() { clear(); }
+
+    iterator begin() const { return iterator{as_mutable().begin()}; }
+    iterator end() const { return iterator{as_mutable().end()}; }
+    size_type size() const { return tree_.size(); }
+    bool empty() const { return size() == 0; }
+
+    Comp value_comp() const { return tree_.value_comp().comp; }
+
+    template <typename... Args>
+    iterator emplace(Args&&... args)
+    {
+        void* p = pool_.allocate();
+        node_type* x;
+        try {
+            x = ::new (p) node_type(std::forward<Args>(args)...);
+        }
+        catch (...) {
+            pool_.deallocate(p);
+            throw;
+        }
+        return iterator{tree_.insert(*x)};
+    }
+
+    iterator insert(T const& value) { return emplace(value); }
+    iterator insert(T&& value) { return emplace(std::move(value)); }
+
+    iterator erase(iterator it)
+    {
+        node_type& x = *it.it_;
+        auto next = tree_.erase(it.it_);
+        destroy(x);
+        return iterator{next};
+    }
+
+    iterator erase(iterator first, iterator last)
+    {
+        return iterator{tree_.erase(
+            first.it_, last.it_, [this](node_type& x) { destroy(x); })};
+    }
+
+    template <typename K>
+    size_type erase(K const& key)
+    {
+        auto [first, last] = equal_range(key);
+        auto const n = static_cast<size_type>(last - first);
+        erase(first, last);
+        return n;
+    }
+
+    void clear()
+    {
+        tree_.clear([this](node_type& x) { destroy(x); });
+    }
+
+    iterator nth(size_type k) const { return iterator{as_mutable().nth(k)}; }
+
+    template <typename K>
+    iterator find(K const& key) const
+    {
+        return iterator{as_mutable().find(key)};
+    }
+
+    template <typename K>
+    iterator lower_bound(K const& key) const
+    {
+        return iterator{as_mutable().lower_bound(key)};
+    }
+
+    template <typename K>
+    iterator upper_bound(K const& key) const
+    {
+        return iterator{as_mutable().upper_bound(key)};
+    }
+
+    template <typename K>
+    std::pair<iterator, iterator> equal_range(K const& key) const
+    {
+        auto [first, last] = as_mutable().equal_range(key);
+        return {iterator{first}, iterator{last}};
+    }
+
+    template <typename K>
+    size_type count(K const& key) const
+    {
+        return tree_.count(key);
+    }
+
+    template <typename K>
+    size_type count_less(K const& key) const
+    {
+        return tree_.count_less(key);
+    }
+
+    template <typename K>
+    size_type count_less_equal(K const& key) const
+    {
+        return tree_.count_less_equal(key);
+    }
+
+private:
+    void destroy(node_type& x)
+    {
+        std::destroy_at(&x);
+        pool_.deallocate(&x);
+    }
+
+    tree_type& as_mutable() const { return const_cast<tree_type&>(tree_); }
+
+    detail::slab_pool<node_type, Alloc> pool_;
+    tree_type tree_;
+};
+
+// intrusive tree taking the inserted nodes in a buffer, moved to the tree in
+// groups once full: the descents of a group run in lockstep to overlap their
+// cache misses, then the nodes are linked below the positions found, already
+// in cache. This pays off once the tree outgrows the cache. The buffer is
+// sorted by the next read, lookups, ranks and distances combine it with the
+// tree, like the iterators, which are invalidated by insert and erase. The
+// order of equivalent nodes is unspecified, and like with lazy_size, reading
+// a const tree may update it.
+template <typename Node, typename Comp = std::less<>, typename... Options>
+class buffered_tree {
+public:
+    using tree_type = tree<Node, Comp, Options...>;
+    using value_type = Node;
+    using size_type = std::size_t;
+
+    template <bool Const>
+    class iterator_impl {
+        using owner_type = std::conditional_t<Const, buffered_tree const, buffered_tree>;
+        using tree_iterator = std::conditional_t<
+            Const,
+            typename tree_type::const_iterator,
+            typename tree_type::iterator>;
+
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = std::conditional_t<Const, Node const, Node>;
+
+        iterator_impl() = default;
+
+        iterator_impl(iterator_impl<!Const> const& other)
+            requires Const
+            : owner_{other.owner_}, it_{other.it_}, pos_{other.pos_}
+        {
+        }
+
+        // the tree node first on ties
+        iterator_impl& operator++()
+        {
+            if (in_tree()) {
+                ++it_;
+            }
+            else {
+                ++pos_;
+            }
+            return *this;
+        }
+        iterator_impl operator++(int)
+        {
+            iterator_impl retval = *this;
+            ++(*this);
+            return retval;
+        }
+        iterator_impl& operator--()
+        {
+            auto const& tree = owner_->tree_;
+            if (it_ != tree.begin()
+                && (pos_ == 0
+                    || tree.less(*owner_->buffer_[pos_ - 1], *std::prev(it_)))) {
+                --it_;
+            }
+            else {
+                --pos_;
+            }
+            return *this;
+        }
+        iterator_impl operator--(int)
+        {
+            iterator_impl retval = *this;
+            --(*this);
+            return retval;
+        }
+        friend difference_type operator-(iterator_impl lhs, iterator_impl rhs)
+        {
+            return (lhs.it_ - rhs.it_) + static_cast<difference_type>(lhs.pos_)
+                   - static_cast<difference_type>(rhs.pos_);
+        }
+        friend difference_type distance(iterator_impl lhs, iterator_impl rhs)
+        {
+            return rhs - lhs;
+        }
+        bool operator==(iterator_impl const& other) const
+        {
+            return it_ == other.it_ && pos_ == other.pos_;
+        }
+
+        value_type& operator*() const
+        {
+            return in_tree() ? *it_ : *owner_->buffer_[pos_];
+        }
+        value_type* operator->() const { return &**this; }
+
+    private:
+        friend class buffered_tree;
+        template <bool>
+        friend class iterator_impl;
+
+        iterator_impl(owner_type* owner, tree_iterator it, std::size_t pos)
+            : owner_{owner}, it_{it}, pos_{pos}
+        {
+        }
+
+        bool in_tree() const
+        {
+            auto const& buffer = owner_->buffer_;
+            return pos_ == buffer.size()
+                   || (it_ != owner_->tree_.end()
+                       && !owner_->tree_.less(*buffer[pos_], *it_));
+        }
+
+        owner_type* owner_{nullptr};
+        tree_iterator it_;
+        // the buffered nodes before the iterator
+        std::size_t pos_{0};
+    };
+
+    using iterator = iterator_impl<false>;
+    using const_iterator = iterator_impl<true>;
+
+    static_assert(std::bidirectional_iterator<iterator>);
+    static_assert(std::bidirectional_iterator<const_iterator>);
+
+    explicit buffered_tree(std::size_t capacity = 256, Comp comp = {})
+        : tree_{std::move(comp)}, capacity_{std::max<std::size_t>(capacity, 1)}
+    {
+        buffer_.reserve(capacity_);
+    }
+
+    buffered_tree(buffered_tree&&) noexcept = default;
+    buffered_tree& operator=(buffered_tree&&) noexcept = default;
+
+    iterator begin() { return {this, tree_.begin(), sorted_buffer(0)}; }
+    iterator end() { return {this, tree_.end(), sorted_buffer(buffer_.size())}; }
+    const_iterator begin() const { return as_mutable().begin(); }
+    const_iterator end() const { return as_mutable().end(); }
+
+    size_type size() const { return tree_.size() + buffer_.size(); }
+    bool empty() const { return size() == 0; }
+    // the nodes not merged into the tree yet
+    size_type buffered() const { return buffer_.size(); }
+    size_type capacity() const { return capacity_; }
+
+    // the tree holding the nodes merged so far
+    tree_type const& base() const { return tree_; }
+
+    void insert(value_type& x)
+    {
+        tree_type::cache_prefix(x);
+        buffer_.push_back(&x);
+        if (buffer_.size() >= capacity_) {
+            flush();
+        }
+    }
+
+    // move the buffered nodes to the tree
+    void flush()
+    {
+        sort_buffer();
+        auto nodes =
+            std::views::transform(buffer_, [](value_type* x) -> value_type& { return *x; });
+        std::array<typename tree_type::iterator, group_size> hints;
+        for (std::size_t i = 0; i < buffer_.size(); i += group_size) {
+            auto const n = std::min(group_size, buffer_.size() - i);
+            auto const first = nodes.begin() + static_cast<std::ptrdiff_t>(i);
+            tree_.lower_bound_batch(std::ranges::subrange(first, first + n), hints.begin());
+            // the nodes are sorted, so each one still fits before its hint after
+            // the previous ones of the group are linked
+            for (std::size_t j = 0; j < n; ++j) {
+                tree_.insert(hints[j], *buffer_[i + j]);
+            }
+        }
+        buffer_.clear();
+        sorted_ = 0;
+    }
+
+    iterator erase(iterator it)
+    {
+        if (it.in_tree()) {
+            return {this, tree_.erase(it.it_), it.pos_};
+        }
+        buffer_.erase(buffer_.begin() + static_cast<std::ptrdiff_t>(it.pos_));
+        --sorted_;
+        return it;
+    }
+
+    void erase(value_type& x)
+    {
+        sort_buffer();
+        auto const [first, last] = std::equal_range(
+            buffer_.begin(), buffer_.end(), &x, [&](value_type* lhs, value_type* rhs) {
+                return tree_.less(*lhs, *rhs);
+            });
+        auto const pos = std::find(first, last, &x);
+        if (pos != last) {
+            buffer_.erase(pos);
+            --sorted_;
+        }
+        else {
+            tree_.erase(typename tree_type::iterator{&x});
+        }
+    }
+
+    void clear()
+    {
+        tree_.clear();
+        buffer_.clear();
+        sorted_ = 0;
+    }
+
+    template <typename T>
+    iterator lower_bound(T const& val)
+    {
+        return {this, tree_.lower_bound(val), buffer_lower_bound(val)};
+    }
+
+    template <typename T>
+    const_iterator lower_bound(T const& val) const
+    {
+        return as_mutable().lower_bound(val);
+    }
+
+    template <typename T>
+    iterator upper_bound(T const& val)
+    {
+        return {this, tree_.upper_bound(val), buffer_upper_bound(val)};
+    }
+
+    template <typename T>
+    const_iterator upper_bound(T const& val) const
+    {
+        return as_mutable().upper_bound(val);
+    }
+
+    template <typename T>
+    iterator find(T const& val)
+    {
+        auto it = lower_bound(val);
+        return it == end() || tree_.less(val, *it) ? end() : it;
+    }
+
+    template <typename T>
+    const_iterator find(T const& val) const
+    {
+        return as_mutable().find(val);
+    }
+
+    template <typename T>
+    size_type count_less(T const& val) const
+    {
+        return tree_.count_less(val) + as_mutable().buffer_lower_bound(val);
+    }
+
+    template <typename T>
+    size_type count_less_equal(T const& val) const
+    {
+        return tree_.count_less_equal(val) + as_mutable().buffer_upper_bound(val);
+    }
+
+    iterator nth(std::size_t k)
+    {
+        sort_buffer();
+        auto const n = tree_.size();
+        auto const m = buffer_.size();
+        k = std::min(k, n + m);
+        // the largest number b of buffered nodes among the first k such that
+        // the last of them comes before the tree node following the k - b
+        // others
+        std::size_t lo = k > n ? k - n : 0;
+        std::size_t hi = std::min(k, m);
+        while (lo < hi) {
+            auto const b = lo + (hi - lo + 1) / 2;
+            if (k - b == n || tree_.less(*buffer_[b - 1], *tree_.nth(k - b))) {
+                lo = b;
+            }
+            else {
+                hi = b - 1;
+            }
+        }
+        return {this, tree_.nth(k - lo), lo};
+    }
+
+    const_iterator nth(std::size_t k) const { return as_mutable().nth(k); }
+
+private:
+    static constexpr std::size_t group_size = 16;
+
+    // sort the nodes inserted since the last read, and merge them with the
+    // others
+    void sort_buffer()
+    {
+        auto const less = [&](value_type* lhs, value_type* rhs) {
+            return tree_.less(*lhs, *rhs);
+        };
+        auto const middle = buffer_.begin() + static_cast<std::ptrdiff_t>(sorted_);
+        if (buffer_.end() - middle <= 8) {
+            for (auto it = middle; it != buffer_.end(); ++it) {
+                std::rotate(std::upper_bound(buffer_.begin(), it, *it, less), it, it + 1);
+            }
+        }
+        else {
+            std::sort(middle, buffer_.end(), less);
+            merged_.resize(buffer_.size());
+            std::merge(buffer_.begin(), middle, middle, buffer_.end(), merged_.begin(), less);
+            buffer_.swap(merged_);
+        }
+        sorted_ = buffer_.size();
+    }
+
+    // pos, once the buffer is sorted
+    std::size_t sorted_buffer(std::size_t pos)
+    {
+        sort_buffer();
+        return pos;
+    }
+
+    template <typename T>
+    std::size_t buffer_lower_bound(T const& val)
+    {
+        sort_buffer();
+        auto const it = std::lower_bound(
+            buffer_.begin(), buffer_.end(), val, [&](value_type* lhs, T const& rhs) {
+                return tree_.less(*lhs, rhs);
+            });
+        return static_cast<std::size_t>(it - buffer_.begin());
+    }
+
+    template <typename T>
+    std::size_t buffer_upper_bound(T const& val)
+    {
+        sort_buffer();
+        auto const it = std::upper_bound(
+            buffer_.begin(), buffer_.end(), val, [&](T const& lhs, value_type* rhs) {
+                return tree_.less(lhs, *rhs);
+            });
+        return static_cast<std::size_t>(it - buffer_.begin());
+    }
+
+    buffered_tree& as_mutable() const { return const_cast<buffered_tree&>(*this); }
+
+    tree_type tree_;
+    // sorted up to sorted_
+    std::vector<value_type*> buffer_;
+    std::size_t sorted_{0};
+    std::vector<value_type*> merged_;
+    std::size_t capacity_;
+};
+
+// owning sorted container of small values in a B+ tree: the values are stored
+// contiguously in leaves of up to B values linked in order, and the inner nodes
+// of up to B children keep, with each child, the number of values below it.
+// The descents count the keys lower than the searched one over a whole node,
+// a loop without early exit that vectorizes for arithmetic keys, then sum the
+// counts of the children skipped to maintain the rank. Iterators carry their
+// rank, and like vector iterators are invalidated by insert and erase.
+template <typename T, typename Comp = std::less<>, std::size_t B = 32>
+    requires std::default_initializable<T> && std::movable<T>
+class btree_multiset {
+private:
+    static_assert(B >= 4 && B <= std::numeric_limits<std::uint16_t>::max());
+
+    // non-root nodes hold at least min_size values or children
+    static constexpr std::size_t min_size = B / 2;
+
+    struct node_base {
+        std::uint16_t size{0};
+        bool leaf;
+    };
+
+    struct leaf_node : node_base {
+        leaf_node() : node_base{0, true} {}
+
+        std::array<T, B> keys;
+        leaf_node* prev{nullptr};
+        leaf_node* next{nullptr};
+    };
+
+    // all the values below children[i] are not greater than keys[i], and all
+    // the values below children[i + 1] are not lower than keys[i]
+    struct inner_node : node_base {
+        inner_node() : node_base{0, false} {}
+
+        std::array<T, B - 1> keys;
+        std::array<node_base*, B> children{};
+        std::array<std::size_t, B> counts{};
+    };
+
+public:
+    using value_type = T;
+    using value_compare = Comp;
+    using size_type = std::size_t;
+
+    class iterator {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = T;
+
+        iterator() = default;
+
+        iterator& operator++()
+        {
+            if (++pos_ == leaf_->size) {
+                leaf_ = leaf_->next;
+                pos_ = 0;
+            }
+            ++rank_;
+            return *this;
+        }
+        iterator operator++(int)
+        {
+            iterator retval = *this;
+            ++(*this);
+            return retval;
+        }
+        iterator& operator--()
+        {
+            if (!leaf_) {
+                leaf_ = tree_->last_;
+                pos_ = leaf_->size;
+            }
+            else if (pos_ == 0) {
+                leaf_ = leaf_->prev;
+                pos_ = leaf_->size;
+            }
+            --pos_;
+            --rank_;
+            return *this;
+        }
+        iterator operator--(int)
+        {
+            iterator retval = *this;
+            --(*this);
+            return retval;
+        }
+        iterator& operator+=(difference_type n)
+        {
+            return *this = tree_->nth(rank_ + n);
+        }
+        iterator& operator-=(difference_type n) { return *this += -n; }
+        friend iterator operator+(iterator it, difference_type n) { return it += n; }
+        friend iterator operator+(difference_type n, iterator it) { return it += n; }
+        friend iterator operator-(iterator it, difference_type n) { return it -= n; }
+        friend difference_type operator-(iterator lhs, iterator rhs)
+        {
+            return static_cast<difference_type>(lhs.rank_)
+                   - static_cast<difference_type>(rhs.rank_);
+        }
+        friend difference_type distance(iterator lhs, iterator rhs)
+        {
+            return rhs - lhs;
+        }
+        bool operator==(iterator const& other) const { return rank_ == other.rank_; }
+
+        T const& operator*() const { return leaf_->keys[pos_]; }
+        T const* operator->() const { return &leaf_->keys[pos_]; }
+
+        // distance from begin()
+        std::size_t rank() const { return rank_; }
+
+    private:
+        friend class btree_multiset;
+
+        iterator(
+            btree_multiset const* tree,
+            leaf_node* leaf,
+            std::size_t pos,
+            std::size_t rank)
+            : tree_{tree}, leaf_{leaf}, pos_{pos}, rank_{rank}
+        {
+            if (leaf_ && pos_ == leaf_->size) {
+                leaf_ = leaf_->next;
+                pos_ = 0;
+            }
+        }
+
+        btree_multiset const* tree_{nullptr};
+        leaf_node* leaf_{nullptr};
+        std::size_t pos_{0};
+        std::size_t rank_{0};
+    };
+
+    using const_iterator = iterator;
+
+    static_assert(std::bidirectional_iterator<iterator>);
+
+    btree_multiset() = default;
+    explicit btree_multiset(Comp comp) : comp_{std::move(comp)} {}
+
+    btree_multiset(btree_multiset const&) = delete;
+    btree_multiset& operator=(btree_multiset const&) = delete;
+
+    btree_multiset(btree_multiset&& other) noexcept { *this = std::move(other); }
+    btree_multiset& operator=(btree_multiset&& other) noexcept
+    {
+        if (this != &other) {
+            clear();
+            root_ = std::exchange(other.root_, nullptr);
+            first_ = std::exchange(other.first_, nullptr);
+            last_ = std::exchange(other.last_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+            comp_ = other.comp_;
+        }
+        return *this;
+    }
+
+    ~btree_multiset() { clear(); }
+
+    iterator begin() const { return {this, first_, 0, 0}; }
+    iterator end() const { return {this, nullptr, 0, size_}; }
+    size_type size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    iterator insert(T value)
+    {
+        if (!root_) {
+            root_ = first_ = last_ = new leaf_node;
+        }
+        else if (root_->size == B) {
+            auto* root = new inner_node;
+            root->size = 1;
+            root->children[0] = root_;
+            root->counts[0] = size_;
+            split_child(root, 0);
+            root_ = root;
+        }
+
+        // split the full nodes on the way down, so that the parent of a split
+        // node always has room for the new child
+        node_base* x = root_;
+        std::size_t rank = 0;
+        while (!x->leaf) {
+            auto* inner = static_cast<inner_node*>(x);
+            auto c = count_not_greater(inner->keys.data(), inner->size - 1, value);
+            if (inner->children[c]->size == B) {
+                split_child(inner, c);
+                c += !comp_(value, inner->keys[c]);
+            }
+            rank += sum(inner->counts.data(), c);
+            inner->counts[c]++;
+            x = inner->children[c];
+        }
+
+        auto* leaf = static_cast<leaf_node*>(x);
+        auto const pos = count_not_greater(leaf->keys.data(), leaf->size, value);
+        std::move_backward(
+            leaf->keys.begin() + pos,
+            leaf->keys.begin() + leaf->size,
+            leaf->keys.begin() + leaf->size + 1);
+        leaf->keys[pos] = std::move(value);
+        leaf->size++;
+        size_++;
+        return {this, leaf, pos, rank + pos};
+    }
+
+    template <typename... Args>
+    iterator emplace(Args&&... args)
+    {
+        return insert(T(std::forward<Args>(args)...));
+    }
+
+    // erase the value at it, returns the iterator following it
+    iterator erase(iterator it)
+    {
+        erase_nth(it.rank_);
+        return nth(it.rank_);
+    }
+
+    // erase the values equal to key, returns how many were
+    template <typename K>
+    size_type erase(K const& key)
+    {
+        auto const rank = count_less(key);
+        auto const n = count_less_equal(key) - rank;
+        for (std::size_t i = 0; i < n; ++i) {
+            erase_nth(rank);
+        }
+        return n;
+    }
+
+    void clear()
+    {
+        if (root_) {
+            destroy(root_);
+        }
+        root_ = first_ = last_ = nullptr;
+        size_ = 0;
+    }
+
+    iterator nth(std::size_t k) const
+    {
+        if (k >= size_) {
+            return end();
+        }
+        auto const rank = k;
+        node_base* x = root_;
+        while (!x->leaf) {
+            auto* inner = static_cast<inner_node*>(x);
+            std::size_t c = 0;
+            for (; k >= inner->counts[c]; ++c) {
+                k -= inner->counts[c];
+            }
+            x = inner->children[c];
+        }
+        return {this, static_cast<leaf_node*>(x), k, rank};
+    }
+
+    template <typename K>
+    iterator lower_bound(K const& key) const
+    {
+        return bound(key, [this](K const& key, T const* keys, std::size_t n) {
+            return count_less(keys, n, key);
+        });
+    }
+
+    template <typename K>
+    iterator upper_bound(K const& key) const
+    {
+        return bound(key, [this](K const& key, T const* keys, std::size_t n) {
+            return count_not_greater(keys, n, key);
+        });
+    }
+
+    template <typename K>
+    std::pair<iterator, iterator> equal_range(K const& key) const
+    {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    template <typename K>
+    iterator find(K const& key) const
+    {
+        auto lb = lower_bound(key);
+        return lb == end() || comp_(key, *lb) ? end() : lb;
+    }
+
+    template <typename K>
+    size_type count_less(K const& key) const
+    {
+        return lower_bound(key).rank_;
+    }
+
+    template <typename K>
+    size_type count_less_equal(K const& key) const
+    {
+        return upper_bound(key).rank_;
+    }
+
+    template <typename K>
+    size_type count(K const& key) const
+    {
+        return count_less_equal(key) - count_less(key);
+    }
+
+private:
+    // the number of keys lower than key, the keys being sorted. It doesn't
+    // stop at the first key not lower, so that the loop can be vectorized.
+    template <typename K>
+    std::size_t count_less(T const* keys, std::size_t n, K const& key) const
+    {
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            count += comp_(keys[i], key);
+        }
+        return count;
+    }
+
+    template <typename K>
+    std::size_t count_not_greater(T const* keys, std::size_t n, K const& key) const
+    {
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            count += !comp_(key, keys[i]);
+        }
+        return count;
+    }
+
+    static std::size_t sum(std::size_t const* counts, std::size_t n)
+    {
+        std::size_t sum = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            sum += counts[i];
+        }
+        return sum;
+    }
+
+    // child position is count(keys, n, key) in inner nodes and in the leaf. It
+    // only depends on keys lower, or not greater, than key, so the bound is in
+    // the child it selects, or is the first value after it.
+    template <typename K, typename Count>
+    iterator bound(K const& key, Count count) const
+    {
+        if (!root_) {
+            return end();
+        }
+        node_base* x = root_;
+        std::size_t rank = 0;
+        while (!x->leaf) {
+            auto* inner = static_cast<inner_node*>(x);
+            auto const c = count(key, inner->keys.data(), inner->size - 1);
+            rank += sum(inner->counts.data(), c);
+            x = inner->children[c];
+        }
+        auto* leaf = static_cast<leaf_node*>(x);
+        auto const pos = count(key, leaf->keys.data(), leaf->size);
+        return {this, leaf, pos, rank + pos};
+    }
+
+    static std::size_t subtree_size(node_base const* x)
+    {
+        if (x->leaf) {
+            return x->size;
+        }
+        auto const* inner = static_cast<inner_node const*>(x);
+        return sum(inner->counts.data(), inner->size);
+    }
+
+    // move the upper half of the full child c of parent to a new sibling
+    void split_child(inner_node* parent, std::size_t c)
+    {
+        constexpr std::size_t half = B / 2;
+        node_base* left = parent->children[c];
+        node_base* right;
+        T separator;
+        if (left->leaf) {
+            auto* l = static_cast<leaf_node*>(left);
+            auto* r = new leaf_node;
+            std::move(l->keys.begin() + half, l->keys.end(), r->keys.begin());
+            r->size = B - half;
+            l->size = half;
+            separator = r->keys[0];
+            r->prev = l;
+            r->next = l->next;
+            (r->next ? r->next->prev : last_) = r;
+            l->next = r;
+            right = r;
+        }
+        else {
+            // the separator between the halves moves up to the parent
+            auto* l = static_cast<inner_node*>(left);
+            auto* r = new inner_node;
+            std::move(l->keys.begin() + half, l->keys.end(), r->keys.begin());
+            std::copy(
+                l->children.begin() + half, l->children.end(), r->children.begin());
+            std::copy(l->counts.begin() + half, l->counts.end(), r->counts.begin());
+            r->size = B - half;
+            l->size = half;
+            separator = std::move(l->keys[half - 1]);
+            right = r;
+        }
+
+        auto const right_count = subtree_size(right);
+        insert_child(parent, c + 1, right, right_count, std::move(separator));
+        parent->counts[c] -= right_count;
+    }
+
+    // insert child at position c of parent, after the separator key
+    static void insert_child(
+        inner_node* parent,
+        std::size_t c,
+        node_base* child,
+        std::size_t count,
+        T key)
+    {
+        auto const n = parent->size;
+        std::move_backward(
+            parent->keys.begin() + c - 1,
+            parent->keys.begin() + n - 1,
+            parent->keys.begin() + n);
+        std::copy_backward(
+            parent->children.begin() + c,
+            parent->children.begin() + n,
+            parent->children.begin() + n + 1);
+        std::copy_backward(
+            parent->counts.begin() + c,
+            parent->counts.begin() + n,
+            parent->counts.begin() + n + 1);
+        parent->keys[c - 1] = std::move(key);
+        parent->children[c] = child;
+        parent->counts[c] = count;
+        parent->size++;
+    }
+
+    // remove the child at position c of parent, along with the separator key
+    // before it
+    static void erase_child(inner_node* parent, std::size_t c)
+    {
+        auto const n = parent->size;
+        std::move(
+            parent->keys.begin() + c,
+            parent->keys.begin() + n - 1,
+            parent->keys.begin() + c - 1);
+        std::copy(
+            parent->children.begin() + c + 1,
+            parent->children.begin() + n,
+            parent->children.begin() + c);
+        std::copy(
+            parent->counts.begin() + c + 1,
+            parent->counts.begin() + n,
+            parent->counts.begin() + c);
+        parent->size--;
+    }
+
+    void erase_nth(std::size_t k)
+    {
+        // grow the nodes at min_size on the way down, so that the erasure never
+        // leaves a node below min_size
+        node_base* x = root_;
+        while (!x->leaf) {
+            auto* inner = static_cast<inner_node*>(x);
+            auto c = child_of_rank(inner, k);
+            if (inner->children[c]->size == min_size) {
+                refill_child(inner, c);
+                c = child_of_rank(inner, k);
+            }
+            for (std::size_t i = 0; i < c; ++i) {
+                k -= inner->counts[i];
+            }
+            inner->counts[c]--;
+            x = inner->children[c];
+        }
+
+        auto* leaf = static_cast<leaf_node*>(x);
+        std::move(
+            leaf->keys.begin() + k + 1,
+            leaf->keys.begin() + leaf->size,
+            leaf->keys.begin() + k);
+        leaf->size--;
+        size_--;
+
+        if (!root_->leaf && root_->size == 1) {
+            auto* root = static_cast<inner_node*>(root_);
+            root_ = root->children[0];
+            delete root;
+        }
+        else if (root_->leaf && root_->size == 0) {
+            delete static_cast<leaf_node*>(root_);
+            root_ = first_ = last_ = nullptr;
+        }
+    }
+
+    static std::size_t child_of_rank(inner_node const* inner, std::size_t k)
+    {
+        std::size_t c = 0;
+        for (; k >= inner->counts[c]; ++c) {
+            k -= inner->counts[c];
+        }
+        return c;
+    }
+
+    // bring the child c of parent above min_size, by moving a value or child
+    // from a sibling, or by merging it with one
+    void refill_child(inner_node* parent, std::size_t c)
+    {
+        if (c > 0 && parent->children[c - 1]->size > min_size) {
+            rotate_right(parent, c - 1);
+        }
+        else if (c + 1 < parent->size && parent->children[c + 1]->size > min_size) {
+            rotate_left(parent, c);
+        }
+        else if (c > 0) {
+            merge_children(parent, c - 1);
+        }
+        else {
+            merge_children(parent, c);
+        }
+    }
+
+    // move the last value or child of child c to child c + 1
+    void rotate_right(inner_node* parent, std::size_t c)
+    {
+        node_base* left = parent->children[c];
+        node_base* right = parent->children[c + 1];
+        std::size_t moved = 1;
+        if (left->leaf) {
+            auto* l = static_cast<leaf_node*>(left);
+            auto* r = static_cast<leaf_node*>(right);
+            std::move_backward(
+                r->keys.begin(),
+                r->keys.begin() + r->size,
+                r->keys.begin() + r->size + 1);
+            r->keys[0] = std::move(l->keys[l->size - 1]);
+            parent->keys[c] = r->keys[0];
+        }
+        else {
+            auto* l = static_cast<inner_node*>(left);
+            auto* r = static_cast<inner_node*>(right);
+            auto const n = r->size;
+            std::move_backward(
+                r->keys.begin(), r->keys.begin() + n - 1, r->keys.begin() + n);
+            std::copy_backward(
+                r->children.begin(),
+                r->children.begin() + n,
+                r->children.begin() + n + 1);
+            std::copy_backward(
+                r->counts.begin(), r->counts.begin() + n, r->counts.begin() + n + 1);
+            r->keys[0] = std::move(parent->keys[c]);
+            parent->keys[c] = std::move(l->keys[l->size - 2]);
+            r->children[0] = l->children[l->size - 1];
+            r->counts[0] = moved = l->counts[l->size - 1];
+        }
+        left->size--;
+        right->size++;
+        parent->counts[c] -= moved;
+        parent->counts[c + 1] += moved;
+    }
+
+    // move the first value or child of child c + 1 to child c
+    void rotate_left(inner_node* parent, std::size_t c)
+    {
+        node_base* left = parent->children[c];
+        node_base* right = parent->children[c + 1];
+        std::size_t moved = 1;
+        if (left->leaf) {
+            auto* l = static_cast<leaf_node*>(left);
+            auto* r = static_cast<leaf_node*>(right);
+            l->keys[l->size] = std::move(r->keys[0]);
+            std::move(r->keys.begin() + 1, r->keys.begin() + r->size, r->keys.begin());
+            parent->keys[c] = r->keys[0];
+        }
+        else {
+            auto* l = static_cast<inner_node*>(left);
+            auto* r = static_cast<inner_node*>(right);
+            auto const n = r->size;
+            l->keys[l->size - 1] = std::move(parent->keys[c]);
+            l->children[l->size] = r->children[0];
+            l->counts[l->size] = moved = r->counts[0];
+            parent->keys[c] = std::move(r->keys[0]);
+            std::move(r->keys.begin() + 1, r->keys.begin() + n - 1, r->keys.begin());
+            std::copy(
+                r->children.begin() + 1, r->children.begin() + n, r->children.begin());
+            std::copy(r->counts.begin() + 1, r->counts.begin() + n, r->counts.begin());
+        }
+        left->size++;
+        right->size--;
+        parent->counts[c] += moved;
+        parent->counts[c + 1] -= moved;
+    }
+
+    // append child c + 1 to child c, both at min_size at most
+    void merge_children(inner_node* parent, std::size_t c)
+    {
+        node_base* left = parent->children[c];
+        node_base* right = parent->children[c + 1];
+        if (left->leaf) {
+            auto* l = static_cast<leaf_node*>(left);
+            auto* r = static_cast<leaf_node*>(right);
+            std::move(
+                r->keys.begin(), r->keys.begin() + r->size, l->keys.begin() + l->size);
+            l->next = r->next;
+            (l->next ? l->next->prev : last_) = l;
+            l->size += r->size;
+            delete r;
+        }
+        else {
+            auto* l = static_cast<inner_node*>(left);
+            auto* r = static_cast<inner_node*>(right);
+            auto const n = l->size;
+            l->keys[n - 1] = std::move(parent->keys[c]);
+            std::move(
+                r->keys.begin(), r->keys.begin() + r->size - 1, l->keys.begin() + n);
+            std::copy(
+                r->children.begin(),
+                r->children.begin() + r->size,
+                l->children.begin() + n);
+            std::copy(
+                r->counts.begin(), r->counts.begin() + r->size, l->counts.begin() + n);
+            l->size += r->size;
+            delete r;
+        }
+        parent->counts[c] += parent->counts[c + 1];
+        erase_child(parent, c + 1);
+    }
+
+    static void destroy(node_base* x)
+    {
+        if (x->leaf) {
+            delete static_cast<leaf_node*>(x);
+            return;
+        }
+        auto* inner = static_cast<inner_node*>(x);
+        for (std::size_t i = 0; i < inner->size; ++i) {
+            destroy(inner->children[i]);
+        }
+        delete inner;
+    }
+
+    node_base* root_{nullptr};
+    leaf_node* first_{nullptr};
+    leaf_node* last_{nullptr};
+    std::size_t size_{0};
+    [[no_unique_address]] Comp comp_{};
+};
+
+// tree shared between a single writer at a time and any number of readers.
+// Writers are serialized by a mutex and bump a sequence number around their
+// changes, readers never write to shared memory: they traverse optimistically
+// and retry if a writer was active meanwhile. Traversals tolerate the
+// inconsistent links they can observe during rotations, but the nodes erased
+// from the tree must stay alive as long as a reader may still reach them. The
+// nodes derive from atomic_node, whose fields read by the readers are atomic.
+template <typename Node, typename Comp = std::less<>, typename... Options>
+class concurrent_tree {
+public:
+    using tree_type = tree<Node, Comp, Options...>;
+    using value_type = Node;
+
+    static_assert(
+        !detail::has_option<lazy_size, Options...>,
+        "readers can't resolve lazy sizes");
+    static_assert(
+        std::same_as<typename detail::stats_option<Options...>::type, detail::no_stats>,
+        "readers can't update stats");
+
+    concurrent_tree() = default;
+    concurrent_tree(concurrent_tree const&) = delete;
+    concurrent_tree& operator=(concurrent_tree const&) = delete;
+
+    // run f on the underlying tree, excluding the other writers
+    template <typename F>
+    decltype(auto) write(F&& f)
+    {
+        std::lock_guard lock{writer_};
+        write_guard guard{seq_};
+        return std::forward<F>(f)(tree_);
+    }
+
+    void insert(value_type& node)
+    {
+        write([&](tree_type& tree) { tree.insert(node); });
+    }
+
+    void erase(value_type& node)
+    {
+        write([&](tree_type& tree) { tree.erase(typename tree_type::iterator{&node}); });
+    }
+
+    std::size_t size() const
+    {
+        return read([&]() -> std::optional<std::size_t> {
+            node* root = load(tree_.header_.parent_);
+            return tree_type::bst_size(root);
+        });
+    }
+
+    // the returned node may be erased by a writer at any time
+    template <typename T>
+    value_type* find(T const& val) const
+    {
+        return read([&]() -> std::optional<value_type*> {
+            auto res = lower_bound_impl(val);
+            if (res && *res && tree_.less(val, **res)) {
+                return nullptr;
+            }
+            return res;
+        });
+    }
+
+    // the returned node may be erased by a writer at any time
+    template <typename T>
+    value_type* lower_bound(T const& val) const
+    {
+        return read([&] { return lower_bound_impl(val); });
+    }
+
+    template <typename T>
+    std::size_t count_less(T const& val) const
+    {
+        return read([&] { return count_less_impl(val); });
+    }
+
+    // number of nodes in [lo, hi), both counted in the same snapshot
+    template <typename T, typename U>
+    std::size_t distance(T const& lo, U const& hi) const
+    {
+        return read([&]() -> std::optional<std::size_t> {
+            auto const first = count_less_impl(lo);
+            auto const last = count_less_impl(hi);
+            if (!first || !last) {
+                return std::nullopt;
+            }
+            return *last > *first ? *last - *first : 0;
+        });
+    }
+
+    // the returned node may be erased by a writer at any time
+    value_type* nth(std::size_t k) const
+    {
+        return read([&]() -> std::optional<value_type*> {
+            node* x = load(tree_.header_.parent_);
+            for (int steps = 0; x; ++steps) {
+                if (steps == max_steps) {
+                    return std::nullopt;
+                }
+                node* left = load(x->left_);
+                std::size_t const left_size = tree_type::bst_size(left);
+                if (k < left_size) {
+                    x = left;
+                }
+                else if (k > left_size) {
+                    k -= left_size + 1;
+                    x = load(x->right_);
+                }
+                else {
+                    return tree_type::upcast(x);
+                }
+            }
+            return nullptr;
+        });
+    }
+
+private:
+    using node = typename tree_type::node;
+
+    static_assert(
+        std::same_as<node, atomic_node>, "concurrent_tree needs atomic_node hooks");
+
+    // no valid descent is longer than the height of an AVL tree of size_t
+    // nodes, a longer one can only follow links torn by a concurrent writer
+    static constexpr int max_steps = 2 * std::numeric_limits<std::size_t>::digits;
+
+    struct write_guard {
+        explicit write_guard(std::atomic<std::uint64_t>& seq) : seq_{seq}
+        {
+            seq_.store(seq_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+        ~write_guard()
+        {
+            seq_.store(seq_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        std::atomic<std::uint64_t>& seq_;
+    };
+
+    // each link is loaded exactly once
+    static node* load(detail::shared_field<node*> const& link) { return link.get(); }
+
+    // f returns nullopt when its traversal had to be abandoned
+    template <typename F>
+    auto read(F&& f) const
+    {
+        while (true) {
+            auto const seq = seq_.load(std::memory_order_acquire);
+            if (seq & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            auto res = f();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (res && seq_.load(std::memory_order_relaxed) == seq) {
+                return *res;
+            }
+        }
+    }
+
+    template <typename T>
+    std::optional<value_type*> lower_bound_impl(T const& val) const
+    {
+        value_type* res = nullptr;
+        node* x = load(tree_.header_.parent_);
+        for (int steps = 0; x; ++steps) {
+            if (steps == max_steps) {
+                return std::nullopt;
+            }
+            if (tree_.less(*tree_type::upcast(x), val)) {
+                x = load(x->right_);
+            }
+            else {
+                res = tree_type::upcast(x);
+                x = load(x->left_);
+            }
+        }
+        return res;
+    }
+
+    template <typename T>
+    std::optional<std::size_t> count_less_impl(T const& val) const
+    {
+        std::size_t count = 0;
+        node* x = load(tree_.header_.parent_);
+        for (int steps = 0; x; ++steps) {
+            if (steps == max_steps) {
+                return std::nullopt;
+            }
+            if (tree_.less(*tree_type::upcast(x), val)) {
+                node* left = load(x->left_);
+                count += tree_type::bst_size(left) + 1;
+                x = load(x->right_);
+            }
+            else {
+                x = load(x->left_);
+            }
+        }
+        return count;
+    }
+
+    tree_type tree_;
+    std::mutex writer_;
+    // on its own cache line, so readers only share it with other readers
+    alignas(64) std::atomic<std::uint64_t> seq_{0};
+};
+
+// a tree and a copy of its nodes laid out in a single block of bytes:
+//     image_header | tree | nodes
+// The nodes must use offset links, like compact_node, so that the block can be
+// written to a file as is, then mapped read-only at any address and queried
+// in place with the const members of the tree. Mappings must be aligned to
+// alignment, and the image must span less than the reach of the links.
+template <typename Node, typename Comp = std::less<>, typename... Options>
+class tree_image {
+public:
+    using tree_type = tree<Node, Comp, Options...>;
+
+private:
+    // identifies the layout, a reader with a different node or tree layout,
+    // or byte order, rejects the image
+    struct image_header {
+        std::uint64_t magic;
+        std::uint32_t version;
+        std::uint32_t node_size;
+        std::uint32_t node_alignment;
+        std::uint32_t tree_size;
+        std::uint64_t count;
+
+        friend bool operator==(image_header const&, image_header const&) = default;
+    };
+
+    static constexpr std::uint64_t image_magic = 0x2e6567616d697471; // "qtimage."
+    static constexpr std::uint32_t image_version = 1;
+
+    static constexpr std::size_t align_up(std::size_t offset, std::size_t align)
+    {
+        return (offset + align - 1) / align * align;
+    }
+
+    static constexpr std::size_t tree_offset =
+        align_up(sizeof(image_header), alignof(tree_type));
+    static constexpr std::size_t nodes_offset =
+        align_up(tree_offset + sizeof(tree_type), alignof(Node));
+
+    static constexpr image_header make_image_header(std::uint64_t n)
+    {
+        return {
+            image_magic,
+            image_version,
+            sizeof(Node),
+            alignof(Node),
+            sizeof(tree_type),
+            n};
+    }
+
+public:
+    static_assert(
+        tree_type::relocatable,
+        "images need offset links and eager sizes");
+    static_assert(
+        std::same_as<typename detail::stats_option<Options...>::type, detail::no_stats>,
+        "queries of a read-only image can't update stats");
+    static_assert(std::is_trivially_copyable_v<Comp>);
+
+    static constexpr std::size_t alignment =
+        std::max({alignof(image_header), alignof(tree_type), alignof(Node)});
+
+    // bytes needed by an image of n nodes
+    static constexpr std::size_t image_size(std::size_t n)
+    {
+        return nodes_offset + n * sizeof(Node);
+    }
+
+    // copy the nodes of sorted, which must already be sorted, to image and
+    // link the copies. Returns the tree stored in image, or nullptr if image
+    // is too small or misaligned.
+    template <std::ranges::forward_range R>
+        requires std::constructible_from<Node, std::ranges::range_reference_t<R>>
+    static tree_type* write(std::span<std::byte> image, R&& sorted, Comp comp = {})
+    {
+        auto const n = static_cast<std::size_t>(std::ranges::distance(sorted));
+        if (!fits(image.data(), image.size(), n)) {
+            return nullptr;
+        }
+
+        auto const header = make_image_header(n);
+        std::memcpy(image.data(), &header, sizeof(header));
+        auto* tree = new (image.data() + tree_offset) tree_type{std::move(comp)};
+        auto* nodes = reinterpret_cast<Node*>(image.data() + nodes_offset);
+        std::ranges::uninitialized_copy(sorted, std::span{nodes, n});
+        tree->assign_sorted(nodes, nodes + n);
+        return tree;
+    }
+
+    // the tree stored in image, or nullptr if image does not hold an image of
+    // this tree type
+    static tree_type const* open(std::span<std::byte const> image)
+    {
+        if (!fits(image.data(), image.size(), 0)) {
+            return nullptr;
+        }
+        image_header header;
+        std::memcpy(&header, image.data(), sizeof(header));
+        if (header != make_image_header(header.count)
+            || !fits(image.data(), image.size(), header.count)) {
+            return nullptr;
+        }
+        return std::launder(
+            reinterpret_cast<tree_type const*>(image.data() + tree_offset));
+    }
+
+    // the nodes of an image opened successfully, in order
+    static std::span<Node const> nodes(std::span<std::byte const> image)
+    {
+        image_header header;
+        std::memcpy(&header, image.data(), sizeof(header));
+        return {
+            std::launder(reinterpret_cast<Node const*>(image.data() + nodes_offset)),
+            static_cast<std::size_t>(header.count)};
+    }
+
+private:
+    static bool fits(void const* image, std::size_t size, std::size_t n)
+    {
+        return reinterpret_cast<std::uintptr_t>(image) % alignment == 0
+               && size >= nodes_offset && n <= (size - nodes_offset) / sizeof(Node);
+    }
+};
+
+// read-only sorted sequence stored in Eytzinger order: the implicit complete
+// tree whose node i has children 2i and 2i + 1 is laid out breadth first, so a
+// search reads its first levels from the same cache lines, and prefetches the
+// line of the descendants four levels below the current node while comparing.
+// Each slot also stores its rank, so the rank queries cost a single lookup.
+template <typename T, typename Comp = std::less<>>
+class frozen_tree {
+public:
+    using value_type = T;
+    using value_compare = Comp;
+    using size_type = std::size_t;
+
+    class iterator {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = T;
+
+        iterator() = default;
+
+        T const& operator*() const { return tree_->values_[tree_->slots_[rank_] - 1]; }
+        T const* operator->() const { return &**this; }
+        T const& operator[](difference_type n) const { return *(*this + n); }
+
+        iterator& operator++()
+        {
+            ++rank_;
+            return *this;
+        }
+        iterator operator++(int)
+        {
+            iterator retval = *this;
+            ++(*this);
+            return retval;
+        }
+        iterator& operator--()
+        {
+            --rank_;
+            return *this;
+        }
+        iterator operator--(int)
+        {
+            iterator retval = *this;
+            --(*this);
+            return retval;
+        }
+        iterator& operator+=(difference_type n)
+        {
+            rank_ += n;
+            return *this;
+        }
+        iterator& operator-=(difference_type n) { return *this += -n; }
+        friend iterator operator+(iterator it, difference_type n) { return it += n; }
+        friend iterator operator+(difference_type n, iterator it) { return it += n; }
+        friend iterator operator-(iterator it, difference_type n) { return it -= n; }
+        friend difference_type operator-(iterator lhs, iterator rhs)
+        {
+            return static_cast<difference_type>(lhs.rank_)
+                   - static_cast<difference_type>(rhs.rank_);
+        }
+        friend difference_type distance(iterator lhs, iterator rhs) { return rhs - lhs; }
+
+        bool operator==(iterator const& other) const { return rank_ == other.rank_; }
+        auto operator<=>(iterator const& other) const { return rank_ <=> other.rank_; }
+
+    private:
+        friend class frozen_tree;
+
+        iterator(frozen_tree const* tree, std::size_t rank) : tree_{tree}, rank_{rank} {}
+
+        frozen_tree const* tree_{nullptr};
+        std::size_t rank_{0};
+    };
+
+    static_assert(std::random_access_iterator<iterator>);
+
+    frozen_tree() = default;
+
+    // copy sorted, which must already be sorted
+    template <std::ranges::input_range R>
+        requires std::constructible_from<T, std::ranges::range_reference_t<R>>
+    explicit frozen_tree(R&& sorted, Comp comp = {}) : comp_{std::move(comp)}
+    {
+        std::vector<T> values;
+        for (auto&& x : sorted) {
+            values.emplace_back(std::forward<decltype(x)>(x));
+        }
+        auto const n = values.size();
+
+        // the in order traversal of the implicit tree visits the slots by rank
+        slots_.resize(n + 1);
+        ranks_.resize(n + 1);
+        auto const leftmost = [n](std::size_t slot) {
+            while (2 * slot <= n) {
+                slot *= 2;
+            }
+            return slot;
+        };
+        std::size_t slot = leftmost(1);
+        for (std::size_t rank = 0; rank < n; ++rank) {
+            slots_[rank] = slot;
+            ranks_[slot] = rank;
+            // next in order: leftmost of the right subtree, or the first
+            // ancestor this subtree is on the left of
+            if (2 * slot + 1 <= n) {
+                slot = leftmost(2 * slot + 1);
+            }
+            else {
+                slot >>= std::countr_one(slot) + 1;
+            }
+        }
+        // slot 0 stands for end()
+        slots_[n] = 0;
+        ranks_[0] = n;
+
+        values_.reserve(n);
+        for (std::size_t i = 1; i <= n; ++i) {
+            values_.push_back(std::move(values[ranks_[i]]));
+        }
+    }
+
+    iterator begin() const { return {this, 0}; }
+    iterator end() const { return {this, size()}; }
+
+    size_type size() const { return values_.size(); }
+    bool empty() const { return values_.empty(); }
+
+    iterator nth(std::size_t k) const { return {this, std::min(k, size())}; }
+
+    template <typename K>
+    iterator lower_bound(K const& key) const
+    {
+        return at_slot(search([&](T const& x) { return comp_(x, key); }));
+    }
+
+    template <typename K>
+    iterator upper_bound(K const& key) const
+    {
+        return at_slot(search([&](T const& x) { return !comp_(key, x); }));
+    }
+
+    template <typename K>
+    std::pair<iterator, iterator> equal_range(K const& key) const
+    {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    template <typename K>
+    iterator find(K const& key) const
+    {
+        auto const slot = search([&](T const& x) { return comp_(x, key); });
+        if (slot == 0 || comp_(key, values_[slot - 1])) {
+            return end();
+        }
+        return at_slot(slot);
+    }
+
+    template <typename K>
+    size_type count_less(K const& key) const
+    {
+        return lower_bound(key).rank_;
+    }
+
+    template <typename K>
+    size_type count_less_equal(K const& key) const
+    {
+        return upper_bound(key).rank_;
+    }
+
+    template <typename K>
+    size_type count(K const& key) const
+    {
+        return count_less_equal(key) - count_less(key);
+    }
+
+private:
+    // slot 0 is end(), also when the tree is default constructed or moved from,
+    // and has no ranks
+    iterator at_slot(std::size_t slot) const
+    {
+        return slot == 0 ? end() : iterator{this, ranks_[slot]};
+    }
+
+    // the first slot whose value doesn't go right, 0 if there is none
+    template <typename GoesRight>
+    std::size_t search(GoesRight goes_right) const
+    {
+        // slots are 1 based, values_[slot - 1] holds slot
+        constexpr std::size_t prefetch_levels = 4;
+        auto const n = values_.size();
+        std::size_t slot = 1;
+        while (slot <= n) {
+            auto const ahead = slot << prefetch_levels;
+            if (ahead <= n) {
+                detail::prefetch(values_.data() + ahead - 1);
+            }
+            slot = 2 * slot + goes_right(values_[slot - 1]);
+        }
+        // drop the right turns taken after the last left one, and that one
+        return slot >> (std::countr_one(slot) + 1);
+    }
+
+    std::vector<T> values_;
+    std::vector<std::size_t> slots_;
+    std::vector<std::size_t> ranks_;
+    [[no_unique_address]] Comp comp_{};
+};
+
+// owning tree whose nodes are immutable and shared between versions. Insert
+// and erase copy the O(log N) nodes on the modified path, including the
+// rotated ones, so copying the tree is an O(1) snapshot that stays valid, and
+// nodes are reclaimed once no version references them.
+template <typename T, typename Comp = std::less<>>
+class persistent_tree {
+private:
+    struct node;
+    using node_ptr = std::shared_ptr<node const>;
+
+    struct node {
+        T value;
+        node_ptr left;
+        node_ptr right;
+        std::size_t size;
+        int height;
+    };
+
+public:
+    using value_type = T;
+    using value_compare = Comp;
+    using size_type = std::size_t;
+
+    // no parent links, the iterator keeps the path from the root
+    class iterator {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = T;
+
+        iterator() = default;
+
+        iterator& operator++()
+        {
+            node const* x = path_.back();
+            if (x->right) {
+                descend_min(x->right.get());
+            }
+            else {
+                ascend_while_right();
+            }
+            ++rank_;
+            return *this;
+        }
+        iterator operator++(int)
+        {
+            iterator retval = *this;
+            ++(*this);
+            return retval;
+        }
+        iterator& operator--()
+        {
+            if (path_.empty()) {
+                descend_max(root_);
+            }
+            else if (node const* x = path_.back(); x->left) {
+                descend_max(x->left.get());
+            }
+            else {
+                ascend_while_left();
+            }
+            --rank_;
+            return *this;
+        }
+        iterator operator--(int)
+        {
+            iterator retval = *this;
+            --(*this);
+            return retval;
+        }
+        friend difference_type operator-(iterator const& lhs, iterator const& rhs)
+        {
+            return static_cast<difference_type>(lhs.rank_)
+                   - static_cast<difference_type>(rhs.rank_);
+        }
+        friend difference_type distance(iterator const& lhs, iterator const& rhs)
+        {
+            return rhs - lhs;
+        }
+        bool operator==(iterator const& other) const { return rank_ == other.rank_; }
 
-        auto x_subtree_size = x->subtree_size_;
-        x->subtree_size_ -= z->subtree_size_ - (tmp ? tmp->subtree_size_ : 0);
-        z->subtree_size_ = x_subtree_size;
+        T const& operator*() const { return path_.back()->value; }
+        T const* operator->() const { return &path_.back()->value; }
 
-        if (z->balance_ == 0) {
-            x->balance_ = -1;
-            z->balance_ = 1;
+    private:
+        friend class persistent_tree;
+
+        iterator(node const* root, std::size_t rank) : root_{root}, rank_{rank} {}
+
+        void descend_min(node const* x)
+        {
+            for (; x; x = x->left.get()) {
+                path_.push_back(x);
+            }
         }
-        else {
-            x->balance_ = 0;
-            z->balance_ = 0;
+
+        void descend_max(node const* x)
+        {
+            for (; x; x = x->right.get()) {
+                path_.push_back(x);
+            }
         }
-        return z;
-    }
 
-    static constexpr node* qct_rotate_right_left(node* x, node* z)
-    {
-        node* y = z->left_;
-        node* tmp1 = y->right_;
-        z->left_ = tmp1;
-        if (tmp1) {
-            tmp1->parent_ = z;
+        // pop the right children, then the left child
+        void ascend_while_right()
+        {
+            while (path_.size() > 1 && path_[path_.size() - 2]->right.get() == path_.back()) {
+                path_.pop_back();
+            }
+            path_.pop_back();
         }
-        y->right_ = z;
-        z->parent_ = y;
 
-        node* tmp2 = y->left_;
-        x->right_ = tmp2;
-        if (tmp2) {
-            tmp2->parent_ = x;
+        void ascend_while_left()
+        {
+            while (path_.size() > 1 && path_[path_.size() - 2]->left.get() == path_.back()) {
+                path_.pop_back();
+            }
+            path_.pop_back();
         }
-        y->left_ = x;
-        x->parent_ = y;
 
-        auto x_subtree_size = x->subtree_size_;
-        x->subtree_size_ -= z->subtree_size_ - (tmp2 ? tmp2->subtree_size_ : 0);
-        z->subtree_size_ -= y->subtree_size_ - (tmp1 ? tmp1->subtree_size_ : 0);
-        y->subtree_size_ = x_subtree_size;
+        // the height of an AVL tree is below 1.45 log2(N + 2)
+        static constexpr std::size_t max_height = 96;
 
-        if (y->balance_ == 0) {
-            x->balance_ = 0;
-            z->balance_ = 0;
-        }
-        else if (y->balance_ > 0) {
-            x->balance_ = -1;
-            z->balance_ = 0;
-        }
-        else {
-            x->balance_ = 0;
-            z->balance_ = 1;
-        }
-        y->balance_ = 0;
-        return y;
-    }
+        // fixed capacity stack, so iterators never allocate
+        struct path {
+            bool empty() const { return size_ == 0; }
+            std::size_t size() const { return size_; }
+            node const* back() const { return nodes_[size_ - 1]; }
+            node const* operator[](std::size_t i) const { return nodes_[i]; }
+            void push_back(node const* x) { nodes_[size_++] = x; }
+            void pop_back() { --size_; }
+            void resize(std::size_t size) { size_ = static_cast<std::uint8_t>(size); }
 
-    static constexpr node* qct_rotate_left_right(node* x, node* z)
+            std::array<node const*, max_height> nodes_{};
+            std::uint8_t size_{0};
+        };
+
+        node const* root_{nullptr};
+        path path_;
+        std::size_t rank_{0};
+    };
+
+    using const_iterator = iterator;
+
+    static_assert(std::bidirectional_iterator<iterator>);
+
+    persistent_tree() = default;
+    explicit persistent_tree(Comp comp) : comp_{std::move(comp)} {}
+
+    // a copy is a snapshot, later changes to either tree don't affect the
+    // other one
+    persistent_tree snapshot() const { return *this; }
+
+    iterator begin() const
     {
-        node* y = z->right_;
-        node* tmp1 = y->left_;
-        z->right_ = tmp1;
-        if (tmp1) {
-            tmp1->parent_ = z;
-        }
-        y->left_ = z;
-        z->parent_ = y;
+        iterator it{root_.get(), 0};
+        it.descend_min(root_.get());
+        return it;
+    }
+    iterator end() const { return iterator{root_.get(), size()}; }
+    size_type size() const { return size(root_); }
+    bool empty() const { return !root_; }
 
-        node* tmp2 = y->right_;
-        x->left_ = tmp2;
-        if (tmp2) {
-            tmp2->parent_ = x;
-        }
-        y->right_ = x;
-        x->parent_ = y;
+    void clear() { root_.reset(); }
 
-        auto x_subtree_size = x->subtree_size_;
-        x->subtree_size_ -= z->subtree_size_ - (tmp2 ? tmp2->subtree_size_ : 0);
-        z->subtree_size_ -= y->subtree_size_ - (tmp1 ? tmp1->subtree_size_ : 0);
-        y->subtree_size_ = x_subtree_size;
+    Comp value_comp() const { return comp_; }
 
-        if (y->balance_ == 0) {
-            x->balance_ = 0;
-            z->balance_ = 0;
-        }
-        else if (y->balance_ < 0) {
-            x->balance_ = 1;
-            z->balance_ = 0;
-        }
-        else {
-            x->balance_ = 0;
-            z->balance_ = -1;
-        }
-        y->balance_ = 0;
-        return y;
+    void insert(T const& value) { root_ = insert(root_, value); }
+
+    // erase one element equal to key, if any
+    template <typename K>
+    bool erase(K const& key)
+    {
+        bool erased = false;
+        root_ = erase(root_, key, erased);
+        return erased;
     }
 
-    constexpr void qct_insert_rebalance(node* z)
+    iterator nth(size_type k) const
     {
-        for (node* x = z->parent_; x != &header_; z = x, x = z->parent_) {
-            node* n;
-            node* g = x->parent_;
-            if (z == x->left_) {
-                if (x->balance_ < 0) {
-                    if (z->balance_ > 0) {
-                        n = qct_rotate_left_right(x, z);
-                    }
-                    else {
-                        n = qct_rotate_right(x, z);
-                    }
-                }
-                else if (x->balance_ > 0) {
-                    x->balance_ = 0;
-                    break;
-                }
-                else {
-                    x->balance_ = -1;
-                    continue;
-                }
-            }
-            else {
-                if (x->balance_ > 0) {
-                    if (z->balance_ < 0) {
-                        n = qct_rotate_right_left(x, z);
-                    }
-                    else {
-                        n = qct_rotate_left(x, z);
-                    }
-                }
-                else if (x->balance_ < 0) {
-                    x->balance_ = 0;
-                    break;
-                }
-                else {
-                    x->balance_ = 1;
-                    continue;
-                }
+        if (k >= size()) {
+            return end();
+        }
+        iterator it{root_.get(), k};
+        node const* x = root_.get();
+        while (true) {
+            it.path_.push_back(x);
+            auto const left_size = size(x->left);
+            if (k < left_size) {
+                x = x->left.get();
             }
-
-            n->parent_ = g;
-            if (g != &header_) {
-                if (x == g->left_) {
-                    g->left_ = n;
-                }
-                else {
-                    g->right_ = n;
-                }
+            else if (k > left_size) {
+                k -= left_size + 1;
+                x = x->right.get();
             }
             else {
-                root() = n;
+                return it;
             }
-            break;
         }
     }
 
-    constexpr void qct_erase_rebalance(erase_rebalance_info info)
+    template <typename K>
+    iterator lower_bound(K const& key) const
     {
-        node* g;
-        node* n;
-        bool n_is_left = info.n_is_left;
-        bool height_changed = false;
+        return bound(
+            [&](node const* x) { return !comp_(x->value, key); });
+    }
 
-        for (node* x = info.x; x != &header_;
-             x = g, n_is_left = x && n == x->left_) {
-            g = x->parent_;
-            x->subtree_size_--;
+    template <typename K>
+    iterator upper_bound(K const& key) const
+    {
+        return bound([&](node const* x) { return comp_(key, x->value); });
+    }
 
-            if (n_is_left) {
-                if (x->balance_ > 0) {
-                    node* z = x->right_;
-                    height_changed = z->balance_ != 0;
-                    if (z->balance_ < 0) {
-                        n = qct_rotate_right_left(x, z);
-                    }
-                    else {
-                        n = qct_rotate_left(x, z);
-                    }
-                }
-                else if (x->balance_ < 0) {
-                    x->balance_ = 0;
-                    n = x;
-                    continue;
-                }
-                else {
-                    x->balance_ = 1;
-                    break;
-                }
+    template <typename K>
+    iterator find(K const& key) const
+    {
+        auto lb = lower_bound(key);
+        return lb == end() || comp_(key, *lb) ? end() : lb;
+    }
+
+    template <typename K>
+    size_type count_less(K const& key) const
+    {
+        size_type count = 0;
+        for (node const* x = root_.get(); x;) {
+            if (comp_(x->value, key)) {
+                count += size(x->left) + 1;
+                x = x->right.get();
             }
             else {
-                if (x->balance_ < 0) {
-                    node* z = x->left_;
-                    height_changed = z->balance_ != 0;
-                    if (z->balance_ > 0) {
-                        n = qct_rotate_left_right(x, z);
-                    }
-                    else {
-                        n = qct_rotate_right(x, z);
-                    }
-                }
-                else if (x->balance_ > 0) {
-                    x->balance_ = 0;
-                    n = x;
-                    continue;
-                }
-                else {
-                    x->balance_ = -1;
-                    break;
-                }
+                x = x->left.get();
             }
+        }
+        return count;
+    }
 
-            n->parent_ = g;
-            if (g != &header_) {
-                if (x == g->left_) {
-                    g->left_ = n;
-                }
-                else {
-                    g->right_ = n;
-                }
-            }
-            else {
-                root() = n;
+private:
+    static size_type size(node_ptr const& x) { return x ? x->size : 0; }
+    static int height(node_ptr const& x) { return x ? x->height : 0; }
+
+    static node_ptr make(T const& value, node_ptr left, node_ptr right)
+    {
+        auto const size = persistent_tree::size(left) + 1 + persistent_tree::size(right);
+        auto const height = std::max(persistent_tree::height(left), persistent_tree::height(right)) + 1;
+        return std::make_shared<node const>(
+            node{value, std::move(left), std::move(right), size, height});
+    }
+
+    // the heights of left and right differ by at most 2, the rotations build
+    // new nodes instead of relinking the shared ones
+    static node_ptr balance(T const& value, node_ptr left, node_ptr right)
+    {
+        if (height(left) > height(right) + 1) {
+            if (height(left->left) >= height(left->right)) {
+                return make(
+                    left->value, left->left, make(value, left->right, std::move(right)));
             }
-            if (!height_changed) {
-                break;
+            auto const& lr = left->right;
+            return make(
+                lr->value,
+                make(left->value, left->left, lr->left),
+                make(value, lr->right, std::move(right)));
+        }
+        if (height(right) > height(left) + 1) {
+            if (height(right->right) >= height(right->left)) {
+                return make(
+                    right->value, make(value, std::move(left), right->left), right->right);
             }
+            auto const& rl = right->left;
+            return make(
+                rl->value,
+                make(value, std::move(left), rl->left),
+                make(right->value, rl->right, right->right));
         }
+        return make(value, std::move(left), std::move(right));
+    }
 
-        for (node* x = g; x != &header_; x = x->parent_) {
-            x->subtree_size_--;
+    node_ptr insert(node_ptr const& x, T const& value) const
+    {
+        if (!x) {
+            return make(value, nullptr, nullptr);
         }
+        if (!comp_(x->value, value)) {
+            return balance(x->value, insert(x->left, value), x->right);
+        }
+        return balance(x->value, x->left, insert(x->right, value));
     }
 
-    template <typename T>
-    static constexpr iterator lower_bound(node* root, node* end, T const& val)
+    template <typename K>
+    node_ptr erase(node_ptr const& x, K const& key, bool& erased) const
     {
-        node* res = end;
-        value_type* current = upcast(root);
-        while (current) {
-            if (Comp{}(*current, val)) {
-                current = upcast(current->right_);
-            }
-            else {
-                res = current;
-                current = upcast(current->left_);
-            }
+        if (!x) {
+            return nullptr;
+        }
+        if (comp_(key, x->value)) {
+            auto left = erase(x->left, key, erased);
+            return erased ? balance(x->value, std::move(left), x->right) : x;
+        }
+        if (comp_(x->value, key)) {
+            auto right = erase(x->right, key, erased);
+            return erased ? balance(x->value, x->left, std::move(right)) : x;
         }
-        return iterator{res};
+        erased = true;
+        if (!x->right) {
+            return x->left;
+        }
+        node const* min = x->right.get();
+        while (min->left) {
+            min = min->left.get();
+        }
+        return balance(min->value, x->left, erase_min(x->right));
     }
 
-    template <typename T>
-    static constexpr iterator upper_bound(node* root, node* end, T const& val)
+    static node_ptr erase_min(node_ptr const& x)
     {
-        node* res = end;
-        value_type* current = upcast(root);
-        while (current) {
-            if (Comp{}(val, *current)) {
-                res = current;
-                current = upcast(current->left_);
+        if (!x->left) {
+            return x->right;
+        }
+        return balance(x->value, erase_min(x->left), x->right);
+    }
+
+    // first node satisfying goes_left, which must partition the tree
+    template <typename GoesLeft>
+    iterator bound(GoesLeft goes_left) const
+    {
+        iterator it{root_.get(), 0};
+        std::size_t depth = 0;
+        std::size_t rank = 0;
+        std::size_t found_depth = 0;
+        std::size_t found_rank = size();
+        for (node const* x = root_.get(); x; ++depth) {
+            it.path_.push_back(x);
+            if (goes_left(x)) {
+                found_depth = depth + 1;
+                found_rank = rank + size(x->left);
+                x = x->left.get();
             }
             else {
-                current = upcast(current->right_);
+                rank += size(x->left) + 1;
+                x = x->right.get();
             }
         }
-        return iterator{res};
+        it.path_.resize(found_depth);
+        it.rank_ = found_rank;
+        return it;
     }
 
-    constexpr node*& root() { return header_.parent_; }
-    constexpr node* root() const { return header_.parent_; }
-    constexpr node*& leftmost() { return header_.left_; }
-    constexpr node*& rightmost() { return header_.right_; }
-
-    constexpr tree& as_mutable() const { return *const_cast<tree*>(this); }
-
-    node header_;
+    node_ptr root_;
+    [[no_unique_address]] Comp comp_{};
 };
 
 }
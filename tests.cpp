@@ -1,7 +1,18 @@
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
 #include <forward_list>
+#include <limits>
+#include <memory>
+#include <numeric>
 #include <random>
 #include <ranges>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
 
 #include <catch2/catch_template_test_macros.hpp>
 
@@ -48,8 +59,108 @@ private:
     int x_;
 };
 
+class compact_int_node : public qct::compact_node<> {
+public:
+    compact_int_node() = default;
+    explicit compact_int_node(int x) : x_(x) {}
+
+    constexpr auto operator<=>(compact_int_node const&) const = default;
+    friend auto operator<=>(compact_int_node const& lhs, int rhs)
+    {
+        return lhs.x_ <=> rhs;
+    }
+
+    int const& data() const { return x_; }
+
+private:
+    int x_{};
+};
+
+// order sensitive summary of the weights of a range of nodes
+struct weight_summary {
+    struct value_type {
+        std::uint64_t count{};
+        std::int64_t sum{};
+        int max{std::numeric_limits<int>::min()};
+        std::uint64_t hash{};
+        std::uint64_t scale{1};
+
+        bool operator==(value_type const&) const = default;
+    };
+
+    static constexpr std::uint64_t base = 1000003;
+
+    static value_type identity() { return {}; }
+    static value_type combine(value_type const& lhs, value_type const& rhs)
+    {
+        return {
+            lhs.count + rhs.count,
+            lhs.sum + rhs.sum,
+            std::max(lhs.max, rhs.max),
+            lhs.hash * rhs.scale + rhs.hash,
+            lhs.scale * rhs.scale};
+    }
+    static value_type lift(auto const& x)
+    {
+        return {1, x.weight(), x.weight(), static_cast<std::uint64_t>(x.weight()), base};
+    }
+};
+
+class augmented_int_node : public qct::augmented_node<weight_summary> {
+public:
+    explicit augmented_int_node(int x, int weight) : x_(x), weight_(weight) {}
+
+    constexpr auto operator<=>(augmented_int_node const& other) const
+    {
+        return x_ <=> other.x_;
+    }
+    friend auto operator<=>(augmented_int_node const& lhs, int rhs)
+    {
+        return lhs.x_ <=> rhs;
+    }
+
+    int const& data() const { return x_; }
+    int weight() const { return weight_; }
+    void set_weight(int weight) { weight_ = weight; }
+
+private:
+    int x_;
+    int weight_;
+};
+
+class weighted_int_node : public qct::weighted_node<std::uint32_t> {
+public:
+    explicit weighted_int_node(int x) : x_(x) {}
+
+    constexpr auto operator<=>(weighted_int_node const& other) const
+    {
+        return x_ <=> other.x_;
+    }
+    friend auto operator<=>(weighted_int_node const& lhs, int rhs)
+    {
+        return lhs.x_ <=> rhs;
+    }
+
+    int const& data() const { return x_; }
+
+private:
+    int x_;
+};
+
 constexpr auto seed = 43;
 
+template <typename Node>
+int check_heights(Node const* n)
+{
+    if (!n) {
+        return 0;
+    }
+    auto const left = check_heights(n->left());
+    auto const right = check_heights(n->right());
+    CHECK(n->balance() == right - left);
+    return 1 + std::max(left, right);
+}
+
 template <typename Tree>
 void check_invariants(Tree const& tree)
 {
@@ -58,6 +169,7 @@ void check_invariants(Tree const& tree)
 
     CHECK(tree.begin()->distance_from_begin() == 0);
     CHECK(tree.end()->distance_from_begin() == tree.size());
+    check_heights(tree.end()->parent());
 
     CHECK(tree.size() == std::ranges::distance(tree));
     CHECK(distance(tree.begin(), tree.end()) == std::ranges::distance(tree));
@@ -100,6 +212,26 @@ void check_invariants(Tree const& tree)
     }
 }
 
+template <typename Node>
+void check_aggregates(Node const* n)
+{
+    if (!n) {
+        return;
+    }
+    auto aggregate = weight_summary::lift(*n);
+    if (n->left()) {
+        check_aggregates(static_cast<Node const*>(n->left()));
+        aggregate = weight_summary::combine(
+            static_cast<Node const*>(n->left())->aggregate(), aggregate);
+    }
+    if (n->right()) {
+        check_aggregates(static_cast<Node const*>(n->right()));
+        aggregate = weight_summary::combine(
+            aggregate, static_cast<Node const*>(n->right())->aggregate());
+    }
+    CHECK(n->aggregate() == aggregate);
+}
+
 TEMPLATE_TEST_CASE(
     "Insert/Erase",
     "[insert][erase]",
@@ -188,6 +320,9 @@ TEMPLATE_TEST_CASE(
         auto eq = tree.equal_range(x);
         CHECK(eq.first == lb);
         CHECK(eq.second == ub);
+        CHECK(tree.count_less(x) == distance(tree.begin(), lb));
+        CHECK(tree.count_less_equal(x) == distance(tree.begin(), ub));
+        CHECK(tree.count(x) == distance(lb, ub));
 
         if (lb == tree.end()) {
             CHECK(f == tree.end());
@@ -218,3 +353,2100 @@ TEMPLATE_TEST_CASE(
         }
     }
 }
+
+TEMPLATE_TEST_CASE(
+    "Nth/Iterator arithmetic",
+    "[nth][iterator]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(
+        std::numeric_limits<int>::min(), std::numeric_limits<int>::max());
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator>;
+
+    auto const n = 10000;
+    std::vector<Node> nodes;
+    nodes.reserve(n);
+    Tree tree;
+
+    CHECK(tree.nth(0) == tree.end());
+
+    for (int i = 0; i < n; ++i) {
+        nodes.push_back(Node{distrib(gen)});
+        tree.insert(nodes.back());
+    }
+
+    std::vector<typename Tree::iterator> sorted;
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+        sorted.push_back(it);
+    }
+    sorted.push_back(tree.end());
+
+    Tree const& ctree = tree;
+    for (std::size_t k = 0; k < sorted.size(); ++k) {
+        CHECK(tree.nth(k) == sorted[k]);
+        CHECK(ctree.nth(k) == sorted[k]);
+    }
+
+    std::uniform_int_distribution<std::size_t> rank(0, n);
+    for (int i = 0; i < n; ++i) {
+        auto const from = rank(gen);
+        auto const to = rank(gen);
+        auto const diff = static_cast<std::ptrdiff_t>(to)
+                          - static_cast<std::ptrdiff_t>(from);
+
+        auto it = sorted[from];
+        CHECK(it + diff == sorted[to]);
+        CHECK(diff + it == sorted[to]);
+        CHECK(sorted[to] - diff == it);
+        CHECK(sorted[to] - it == diff);
+        it += diff;
+        CHECK(it == sorted[to]);
+        it -= diff;
+        CHECK(it == sorted[from]);
+    }
+
+    auto it = tree.begin();
+    CHECK(it++ == tree.begin());
+    CHECK(it-- == std::next(tree.begin()));
+    CHECK(it == tree.begin());
+}
+
+TEMPLATE_TEST_CASE(
+    "Ranked iterator",
+    "[ranked_iterator]",
+    (qct::tree<comparable_node, std::less<>>),
+    (qct::tree<comparable_node, std::greater<>>),
+    (qct::tree<node, node_comparator>),
+    (qct::tree<comparable_node, std::less<>, qct::lazy_size>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Tree = TestType;
+    using Node = typename Tree::value_type;
+
+    auto const n = 10000;
+    std::vector<Node> nodes;
+    nodes.reserve(n);
+    Tree tree;
+
+    CHECK(tree.ranked_begin() == tree.ranked_end());
+    CHECK(tree.ranked_nth(0).rank() == 0);
+    CHECK(tree.lower_bound_with_rank(0).base() == tree.end());
+
+    for (int i = 0; i < n; ++i) {
+        nodes.push_back(Node{distrib(gen)});
+        tree.insert(nodes.back());
+    }
+
+    Tree const& ctree = tree;
+    CHECK(tree.ranked_end() - tree.ranked_begin() == n);
+    CHECK(ctree.ranked_end().rank() == n);
+    CHECK(tree.ranked(tree.end()).rank() == n);
+    CHECK(tree.ranked_nth(n + 1) == tree.ranked_end());
+
+    auto ranked = tree.ranked_begin();
+    for (auto it = tree.begin(); it != tree.end(); ++it, ++ranked) {
+        CHECK(ranked.base() == it);
+        CHECK(&*ranked == &*it);
+    }
+    CHECK(ranked == tree.ranked_end());
+    CHECK(ranked.rank() == n);
+    --ranked;
+    CHECK(ranked.rank() == n - 1);
+    CHECK(ranked.base() == std::prev(tree.end()));
+
+    std::uniform_int_distribution<std::size_t> rank(0, n);
+    for (int i = 0; i < 1000; ++i) {
+        auto const k = rank(gen);
+        auto const it = tree.ranked_nth(k);
+        CHECK(it.rank() == k);
+        CHECK(it.base() == tree.nth(k));
+        CHECK(tree.ranked(it.base()).rank() == k);
+        CHECK(ctree.ranked(it.base()).rank() == k);
+        CHECK(tree.ranked_end() - it == n - k);
+
+        auto const to = rank(gen);
+        auto const diff = static_cast<std::ptrdiff_t>(to) - static_cast<std::ptrdiff_t>(k);
+        CHECK((it + diff).base() == tree.nth(to));
+        CHECK((it + diff).rank() == to);
+        CHECK(distance(it, it + diff) == diff);
+
+        auto const x = distrib(gen);
+        auto const lb = tree.lower_bound_with_rank(x);
+        CHECK(lb.base() == tree.lower_bound(x));
+        CHECK(lb.rank() == tree.count_less(x));
+        typename Tree::const_ranked_iterator const clb = ctree.lower_bound_with_rank(x);
+        CHECK(clb == lb);
+    }
+}
+
+TEMPLATE_TEST_CASE(
+    "Count",
+    "[count]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(0, 100);
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator>;
+
+    auto const n = 10000;
+    std::vector<Node> nodes;
+    nodes.reserve(n);
+    Tree tree;
+
+    CHECK(tree.count_less(0) == 0);
+    CHECK(tree.count_less_equal(0) == 0);
+    CHECK(tree.count(0) == 0);
+
+    for (int i = 0; i < n; ++i) {
+        nodes.push_back(Node{distrib(gen)});
+        tree.insert(nodes.back());
+    }
+
+    for (int x = -1; x <= 101; ++x) {
+        auto const less = std::ranges::count_if(
+            nodes, [&](auto const& n) { return Comparator{}(n, x); });
+        auto const greater = std::ranges::count_if(
+            nodes, [&](auto const& n) { return Comparator{}(x, n); });
+
+        CHECK(tree.count_less(x) == less);
+        CHECK(tree.count_less_equal(x) == n - greater);
+        CHECK(tree.count(x) == n - less - greater);
+
+        auto const [first, last, count] = tree.equal_range_count(x);
+        CHECK(count == n - less - greater);
+        CHECK(std::pair{first, last} == tree.equal_range(x));
+        CHECK(first == tree.lower_bound(x));
+        CHECK(last == tree.upper_bound(x));
+        CHECK(distance(first, last) == count);
+    }
+}
+
+TEMPLATE_TEST_CASE(
+    "Assign sorted",
+    "[assign_sorted]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(
+        std::numeric_limits<int>::min(), std::numeric_limits<int>::max());
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator>;
+
+    for (int n : {0, 1, 2, 3, 4, 7, 8, 100, 12345}) {
+        std::vector<Node> nodes;
+        nodes.reserve(n);
+        for (int i = 0; i < n; ++i) {
+            nodes.push_back(Node{distrib(gen)});
+        }
+        std::ranges::sort(nodes, Comparator{});
+
+        Tree tree;
+        tree.assign_sorted(nodes.begin(), nodes.end());
+        CHECK(tree.size() == n);
+        check_invariants(tree);
+        CHECK(std::ranges::equal(
+            tree, nodes, [](auto const& lhs, auto const& rhs) {
+                return &lhs == &rhs;
+            }));
+
+        std::vector<Node> extra;
+        extra.reserve(n);
+        for (int i = 0; i < n; ++i) {
+            extra.push_back(Node{distrib(gen)});
+            tree.insert(extra.back());
+        }
+        for (int i = 0; i < n; ++i) {
+            tree.erase(tree.begin());
+        }
+        CHECK(tree.size() == n);
+        check_invariants(tree);
+    }
+}
+
+TEMPLATE_TEST_CASE(
+    "Parallel",
+    "[parallel]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator>;
+
+    for (auto const n : {0, 1, 2, 3, 17, 100, 1000, 10000}) {
+        std::vector<Node> nodes;
+        nodes.reserve(n);
+        for (int i = 0; i < n; ++i) {
+            nodes.push_back(Node{distrib(gen)});
+        }
+        std::sort(nodes.begin(), nodes.end(), Comparator{});
+
+        for (auto const concurrency : {1, 2, 3, 8}) {
+            qct::thread_executor ex{static_cast<std::size_t>(concurrency)};
+            Tree tree;
+            tree.assign_sorted(nodes.begin(), nodes.end(), ex);
+            check_invariants(tree);
+            CHECK(tree.size() == n);
+            CHECK(std::ranges::equal(
+                tree, nodes, [](auto const& lhs, auto const& rhs) { return &lhs == &rhs; }));
+
+            for (int i = 0; i < 10; ++i) {
+                auto lo = static_cast<std::size_t>(distrib(gen) + 1000) % (n + 1);
+                auto hi = static_cast<std::size_t>(distrib(gen) + 1000) % (n + 1);
+                if (lo > hi) {
+                    std::swap(lo, hi);
+                }
+                std::vector<std::atomic<int>> visits(n);
+                tree.parallel_for_each(
+                    tree.nth(lo), tree.nth(hi), [&](Node& x) { visits[&x - nodes.data()]++; }, ex);
+                for (std::size_t k = 0; k < static_cast<std::size_t>(n); ++k) {
+                    CHECK(visits[k] == (k >= lo && k < hi ? 1 : 0));
+                }
+            }
+        }
+
+        // same shape as the sequential build
+        auto copies = nodes;
+        Tree sequential;
+        sequential.assign_sorted(copies.begin(), copies.end());
+        qct::thread_executor ex{3};
+        Tree parallel;
+        parallel.assign_sorted(nodes.begin(), nodes.end(), ex);
+        CHECK(std::ranges::equal(sequential, parallel, [](auto const& lhs, auto const& rhs) {
+            return lhs.balance() == rhs.balance()
+                   && lhs.subtree_size() == rhs.subtree_size();
+        }));
+    }
+
+    std::vector<augmented_int_node> nodes;
+    for (int i = 0; i < 10000; ++i) {
+        nodes.emplace_back(i, distrib(gen));
+    }
+    qct::tree<augmented_int_node> tree;
+    qct::thread_executor ex{4};
+    tree.assign_sorted(nodes.begin(), nodes.end(), ex);
+    check_invariants(tree);
+    check_aggregates(static_cast<augmented_int_node const*>(tree.end()->parent()));
+}
+
+TEMPLATE_TEST_CASE(
+    "Lower bound batch",
+    "[lower_bound_batch]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator>;
+
+    for (auto const n : {0, 1, 10, 1000}) {
+        std::vector<Node> nodes;
+        nodes.reserve(n);
+        Tree tree;
+        for (int i = 0; i < n; ++i) {
+            nodes.push_back(Node{distrib(gen)});
+            tree.insert(nodes.back());
+        }
+
+        for (auto const m : {0, 1, 15, 16, 17, 500}) {
+            std::vector<int> keys;
+            for (int i = 0; i < m; ++i) {
+                keys.push_back(distrib(gen));
+            }
+            std::vector<typename Tree::iterator> expected;
+            for (auto const key : keys) {
+                expected.push_back(tree.lower_bound(key));
+            }
+            std::vector<typename Tree::iterator> actual;
+            tree.lower_bound_batch(keys, std::back_inserter(actual));
+            CHECK(actual == expected);
+
+            std::ranges::sort(keys, [](int lhs, int rhs) {
+                return Comparator{}(Node{lhs}, Node{rhs});
+            });
+            expected.clear();
+            for (auto const key : keys) {
+                expected.push_back(tree.lower_bound(key));
+            }
+            actual.clear();
+            tree.lower_bound_batch_sorted(keys, std::back_inserter(actual));
+            CHECK(actual == expected);
+        }
+    }
+}
+
+TEMPLATE_TEST_CASE(
+    "Interleave",
+    "[interleave]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator>;
+
+    std::uniform_int_distribution<int> sizes(0, 100);
+    std::uniform_int_distribution<std::size_t> rank(0, 110);
+    std::vector<std::vector<Node>> nodes(50);
+    std::vector<Tree> trees(nodes.size());
+    for (std::size_t i = 0; i < trees.size(); ++i) {
+        auto const n = i % 10 == 0 ? 0 : sizes(gen);
+        nodes[i].reserve(n);
+        for (int j = 0; j < n; ++j) {
+            nodes[i].push_back(Node{distrib(gen)});
+            trees[i].insert(nodes[i].back());
+        }
+    }
+    auto const& const_trees = trees;
+
+    std::vector<int> keys;
+    std::vector<std::size_t> ranks;
+    std::vector<std::size_t> owners;
+    std::uniform_int_distribution<std::size_t> owner(0, trees.size() - 1);
+    for (int i = 0; i < 500; ++i) {
+        owners.push_back(owner(gen));
+        keys.push_back(distrib(gen));
+        ranks.push_back(rank(gen));
+    }
+
+    std::vector<typename Tree::template key_search<int>> lower_bounds;
+    std::vector<typename Tree::template const_key_search<int>> finds;
+    std::vector<typename Tree::rank_search> nths;
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        lower_bounds.push_back(trees[owners[i]].lower_bound_search(keys[i]));
+        finds.push_back(const_trees[owners[i]].find_search(keys[i]));
+        nths.push_back(trees[owners[i]].nth_search(ranks[i]));
+    }
+    qct::interleave(lower_bounds);
+    qct::interleave<1>(finds);
+    qct::interleave<7>(nths);
+
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        auto& tree = trees[owners[i]];
+        CHECK(lower_bounds[i].result() == tree.lower_bound(keys[i]));
+        CHECK(finds[i].result() == tree.find(keys[i]));
+        CHECK(nths[i].result() == tree.nth(ranks[i]));
+        CHECK(!lower_bounds[i].step());
+    }
+
+    qct::interleave(std::span<typename Tree::rank_search>{});
+}
+
+TEMPLATE_TEST_CASE(
+    "Scan",
+    "[scan]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator>;
+
+    auto const same = [](auto const& lhs, auto const& rhs) { return &lhs == &rhs; };
+
+    for (auto const n : {0, 1, 2, 3, 10, 1000}) {
+        std::vector<Node> nodes;
+        nodes.reserve(n);
+        Tree tree;
+        for (int i = 0; i < n; ++i) {
+            nodes.push_back(Node{distrib(gen)});
+            tree.insert(nodes.back());
+        }
+        auto const& const_tree = tree;
+
+        CHECK(std::ranges::equal(tree.scan(), tree, same));
+        CHECK(std::ranges::equal(const_tree.scan(), tree, same));
+        CHECK(std::ranges::equal(
+            tree.reverse_scan(),
+            std::ranges::subrange(
+                std::make_reverse_iterator(tree.end()),
+                std::make_reverse_iterator(tree.begin())),
+            same));
+        CHECK(std::ranges::empty(tree.scan(tree.end())));
+        CHECK(std::ranges::empty(tree.reverse_scan(tree.begin())));
+
+        for (int k = 0; k < n; k += 7) {
+            auto const it = tree.nth(k);
+            CHECK(std::ranges::equal(
+                tree.scan(it), std::ranges::subrange(it, tree.end()), same));
+            CHECK(std::ranges::equal(
+                const_tree.reverse_scan(it),
+                std::ranges::subrange(
+                    std::make_reverse_iterator(it),
+                    std::make_reverse_iterator(tree.begin())),
+                same));
+        }
+    }
+}
+
+TEMPLATE_TEST_CASE(
+    "Insert sorted",
+    "[insert_sorted]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator>;
+
+    auto const n = 10000;
+    std::vector<Node> nodes;
+    nodes.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        nodes.push_back(Node{distrib(gen)});
+    }
+
+    Tree tree;
+    auto first = nodes.begin();
+    for (std::size_t batch = 1; first != nodes.end(); batch *= 3) {
+        auto const last = first + std::min<std::size_t>(batch, nodes.end() - first);
+        std::sort(first, last, Comparator{});
+        tree.insert_sorted(first, last);
+        first = last;
+
+        check_invariants(tree);
+        CHECK(tree.size() == first - nodes.begin());
+    }
+
+    std::vector<int> expected;
+    for (auto const& n : nodes) {
+        expected.push_back(n.data());
+    }
+    std::vector<int> actual;
+    for (auto const& n : tree) {
+        actual.push_back(n.data());
+    }
+    std::ranges::sort(expected);
+    std::ranges::sort(actual);
+    CHECK(actual == expected);
+}
+
+TEMPLATE_TEST_CASE(
+    "Hinted insert",
+    "[insert_hint]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+
+    auto const test = [&]<typename Tree>(Tree& tree) {
+        auto const n = 10000;
+        std::vector<Node> nodes;
+        nodes.reserve(n);
+        for (int i = 0; i < n; ++i) {
+            nodes.push_back(Node{distrib(gen)});
+        }
+
+        for (int i = 0; i < n; ++i) {
+            auto& x = nodes[i];
+            switch (i % 4) {
+            case 0: {
+                // exact hint, x must land right before it
+                auto const hint = tree.upper_bound(x);
+                CHECK(std::next(tree.insert(hint, x)) == hint);
+                break;
+            }
+            case 1:
+                tree.insert(tree.end(), x);
+                break;
+            case 2:
+                tree.insert(tree.begin(), x);
+                break;
+            default:
+                // arbitrary hint, possibly wrong
+                tree.insert(tree.nth(distrib(gen) % (tree.size() + 1)), x);
+                break;
+            }
+            CHECK(tree.size() == i + 1);
+            if (i % 1000 == 0) {
+                CHECK(distance(tree.begin(), tree.end()) == i + 1);
+                check_invariants(tree);
+            }
+        }
+        CHECK(std::is_sorted(tree.begin(), tree.end(), Comparator{}));
+        CHECK(distance(tree.begin(), tree.end()) == n);
+        check_invariants(tree);
+
+        // ascending appends only ever take the rightmost fast path
+        std::vector<Node> tail;
+        tail.reserve(n);
+        for (int i = 0; i < n; ++i) {
+            tail.push_back(Node{i});
+        }
+        std::sort(tail.begin(), tail.end(), Comparator{});
+        Tree ordered;
+        for (auto& x : tail) {
+            auto const it = ordered.insert(ordered.end(), x);
+            CHECK(std::next(it) == ordered.end());
+        }
+        CHECK(distance(ordered.begin(), ordered.end()) == n);
+        check_invariants(ordered);
+        ordered.clear();
+        tree.clear();
+    };
+
+    qct::tree<Node, Comparator> tree;
+    test(tree);
+    qct::tree<Node, Comparator, qct::lazy_size> lazy_tree;
+    test(lazy_tree);
+}
+
+TEMPLATE_TEST_CASE(
+    "Split/Join",
+    "[split][join]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator>;
+
+    auto const n = 10000;
+    std::vector<Node> nodes;
+    nodes.reserve(n);
+    Tree tree;
+    for (int i = 0; i < n; ++i) {
+        nodes.push_back(Node{distrib(gen)});
+        tree.insert(nodes.back());
+    }
+
+    std::vector<Node const*> expected;
+    for (auto const& n : tree) {
+        expected.push_back(&n);
+    }
+    auto const same_nodes = [](auto const& tree, auto first, auto last) {
+        return std::ranges::equal(
+            tree, std::ranges::subrange(first, last), [](auto const& n, auto p) {
+                return &n == p;
+            });
+    };
+
+    for (int i = 0; i < 100; ++i) {
+        auto const x = distrib(gen);
+        auto const k = static_cast<std::size_t>(tree.count_less(x));
+
+        Tree right = tree.split(x);
+        check_invariants(tree);
+        check_invariants(right);
+        CHECK(tree.size() == k);
+        CHECK(right.size() == n - k);
+        CHECK(same_nodes(tree, expected.begin(), expected.begin() + k));
+        CHECK(same_nodes(right, expected.begin() + k, expected.end()));
+
+        tree.join(std::move(right));
+        CHECK(right.size() == 0);
+        check_invariants(tree);
+        CHECK(same_nodes(tree, expected.begin(), expected.end()));
+
+        auto const rank = std::uniform_int_distribution<std::size_t>(0, n)(gen);
+        right = tree.split_at(rank);
+        check_invariants(tree);
+        check_invariants(right);
+        CHECK(same_nodes(tree, expected.begin(), expected.begin() + rank));
+        CHECK(same_nodes(right, expected.begin() + rank, expected.end()));
+
+        // join trees of very different heights
+        Tree small = right.split_at(std::min<std::size_t>(right.size(), i));
+        tree.join(std::move(right));
+        tree.join(std::move(small));
+        check_invariants(tree);
+        CHECK(same_nodes(tree, expected.begin(), expected.end()));
+    }
+
+    Tree empty;
+    empty.join(std::move(tree));
+    CHECK(tree.size() == 0);
+    CHECK(empty.size() == n);
+    check_invariants(tree);
+    check_invariants(empty);
+}
+
+TEMPLATE_TEST_CASE(
+    "Set operations",
+    "[set_operations]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator>;
+
+    auto const compare = [](int lhs, int rhs) { return Comparator{}(Node{lhs}, Node{rhs}); };
+
+    // distinct values, each in a and/or b
+    auto const make_values = [&](int n, int range) {
+        std::vector<int> values(range);
+        std::iota(values.begin(), values.end(), 0);
+        std::shuffle(values.begin(), values.end(), gen);
+        values.resize(n);
+        std::ranges::sort(values, compare);
+        return values;
+    };
+    auto const data = [](Node const& x) { return x.data(); };
+
+    for (auto const [m, n] : {std::pair{0, 0}, {0, 10}, {10, 0}, {1, 1000}, {1000, 1000},
+                              {10000, 100}, {3000, 5000}}) {
+        auto const a = make_values(m, 2 * (m + n));
+        auto const b = make_values(n, 2 * (m + n));
+        std::vector<int> expected_union, expected_intersection, expected_difference;
+        std::ranges::set_union(a, b, std::back_inserter(expected_union), compare);
+        std::ranges::set_intersection(
+            a, b, std::back_inserter(expected_intersection), compare);
+        std::ranges::set_difference(
+            a, b, std::back_inserter(expected_difference), compare);
+
+        for (auto const concurrency : {1, 4}) {
+            qct::thread_executor ex{static_cast<std::size_t>(concurrency)};
+            std::vector<Node> a_nodes(a.begin(), a.end());
+            std::vector<Node> b_nodes(b.begin(), b.end());
+            std::vector<std::atomic<int>> a_disposed(m), b_disposed(n);
+            auto const dispose = [&](Node& x) {
+                if (&x >= a_nodes.data() && &x < a_nodes.data() + m) {
+                    a_disposed[&x - a_nodes.data()]++;
+                }
+                else {
+                    b_disposed[&x - b_nodes.data()]++;
+                }
+            };
+            auto const reset = [&](Tree& tree, std::vector<Node>& nodes) {
+                tree.assign_sorted(nodes.begin(), nodes.end());
+                for (auto& x : a_disposed) {
+                    x = 0;
+                }
+                for (auto& x : b_disposed) {
+                    x = 0;
+                }
+            };
+            auto const contains = [&](std::vector<int> const& values, int x) {
+                return std::ranges::binary_search(values, x, compare);
+            };
+
+            Tree lhs, rhs;
+            reset(lhs, a_nodes);
+            reset(rhs, b_nodes);
+            lhs.set_union(std::move(rhs), dispose, ex);
+            CHECK(rhs.size() == 0);
+            CHECK(lhs.size() == expected_union.size());
+            CHECK(std::ranges::equal(lhs, expected_union, {}, data));
+            check_invariants(lhs);
+            for (auto const& x : lhs) {
+                // equivalent nodes are taken from lhs
+                CHECK((&x >= a_nodes.data() && &x < a_nodes.data() + m) == contains(a, x.data()));
+            }
+            for (int i = 0; i < n; ++i) {
+                CHECK(b_disposed[i] == contains(a, b[i]));
+            }
+
+            reset(lhs, a_nodes);
+            reset(rhs, b_nodes);
+            lhs.set_intersection(rhs, dispose, ex);
+            CHECK(std::ranges::equal(lhs, expected_intersection, {}, data));
+            CHECK(std::ranges::equal(rhs, b, {}, data));
+            check_invariants(lhs);
+            check_invariants(rhs);
+            for (int i = 0; i < m; ++i) {
+                CHECK(a_disposed[i] == !contains(b, a[i]));
+            }
+
+            reset(lhs, a_nodes);
+            lhs.set_difference(rhs, dispose, ex);
+            CHECK(std::ranges::equal(lhs, expected_difference, {}, data));
+            CHECK(std::ranges::equal(rhs, b, {}, data));
+            check_invariants(lhs);
+            check_invariants(rhs);
+            for (int i = 0; i < m; ++i) {
+                CHECK(a_disposed[i] == contains(b, a[i]));
+            }
+        }
+    }
+
+    // sequential overloads, and aggregates kept up to date
+    std::vector<augmented_int_node> a_nodes, b_nodes;
+    for (int i = 0; i < 1000; ++i) {
+        a_nodes.emplace_back(2 * i, i);
+        b_nodes.emplace_back(3 * i, i);
+    }
+    qct::tree<augmented_int_node> a, b;
+    a.assign_sorted(a_nodes.begin(), a_nodes.end());
+    b.assign_sorted(b_nodes.begin(), b_nodes.end());
+    int disposed = 0;
+    a.set_difference(b, [&](augmented_int_node&) { ++disposed; });
+    CHECK(disposed == 334);
+    check_aggregates(static_cast<augmented_int_node const*>(a.end()->parent()));
+    a.set_union(std::move(b), [&](augmented_int_node&) { ++disposed; });
+    CHECK(disposed == 334);
+    CHECK(a.size() == 1000 - 334 + 1000);
+    check_invariants(a);
+    check_aggregates(static_cast<augmented_int_node const*>(a.end()->parent()));
+}
+
+TEMPLATE_TEST_CASE(
+    "Clear/Erase range",
+    "[clear][erase]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator>;
+
+    auto const n = 10000;
+    std::vector<Node> nodes;
+    nodes.reserve(n);
+    Tree tree;
+    for (int i = 0; i < n; ++i) {
+        nodes.push_back(Node{distrib(gen)});
+        tree.insert(nodes.back());
+    }
+
+    std::vector<Node const*> expected;
+    for (auto const& n : tree) {
+        expected.push_back(&n);
+    }
+
+    for (int i = 0; i < 100 && tree.size(); ++i) {
+        std::uniform_int_distribution<std::size_t> rank(0, tree.size());
+        auto first = rank(gen);
+        auto last = rank(gen);
+        if (last < first) {
+            std::swap(first, last);
+        }
+
+        // without a disposer, the erased nodes aren't visited
+        if (i % 2) {
+            auto it = tree.erase(tree.nth(first), tree.nth(last));
+            CHECK(it == tree.nth(first));
+        }
+        else {
+            std::vector<Node const*> disposed;
+            auto it = tree.erase(tree.nth(first), tree.nth(last), [&](Node& n) {
+                CHECK(!n.left());
+                CHECK(!n.right());
+                disposed.push_back(&n);
+            });
+            CHECK(it == tree.nth(first));
+            std::ranges::sort(disposed);
+            std::vector<Node const*> erased(
+                expected.begin() + first, expected.begin() + last);
+            std::ranges::sort(erased);
+            CHECK(disposed == erased);
+        }
+        expected.erase(expected.begin() + first, expected.begin() + last);
+
+        check_invariants(tree);
+        CHECK(std::ranges::equal(tree, expected, [](auto const& n, auto p) {
+            return &n == p;
+        }));
+    }
+
+    std::size_t disposed = 0;
+    tree.erase(tree.begin(), tree.begin());
+    tree.clear([&](Node&) { disposed++; });
+    CHECK(disposed == expected.size());
+    CHECK(tree.size() == 0);
+    check_invariants(tree);
+
+    tree.insert(nodes.front());
+    tree.clear();
+    CHECK(tree.size() == 0);
+    check_invariants(tree);
+}
+
+TEMPLATE_TEST_CASE(
+    "Lazy size",
+    "[lazy_size]",
+    (std::pair<comparable_node, std::less<>>),
+    (std::pair<comparable_node, std::greater<>>),
+    (std::pair<node, node_comparator>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Node = typename TestType::first_type;
+    using Comparator = typename TestType::second_type;
+    using Tree = qct::tree<Node, Comparator, qct::lazy_size>;
+
+    auto const n = 10000;
+    std::vector<Node> nodes;
+    nodes.reserve(n);
+    Tree tree;
+
+    auto const check_ranks = [&](int x) {
+        auto const lb = tree.lower_bound(x);
+        auto const ub = tree.upper_bound(x);
+        auto const less = std::ranges::distance(tree.begin(), lb);
+        auto const less_equal = std::ranges::distance(tree.begin(), ub);
+        CHECK(tree.count_less(x) == less);
+        CHECK(tree.count_less_equal(x) == less_equal);
+        CHECK(tree.count(x) == less_equal - less);
+        CHECK(distance(tree.begin(), lb) == less);
+        CHECK(distance(lb, tree.end()) == tree.size() - less);
+        CHECK(tree.nth(less) == lb);
+        CHECK(tree.begin() + less == lb);
+        CHECK(tree.rank(lb) == less);
+    };
+
+    for (int i = 0; i < n; ++i) {
+        nodes.push_back(Node{distrib(gen)});
+        tree.insert(nodes.back());
+        CHECK(tree.size() == i + 1);
+        if (i % 100 == 0) {
+            check_ranks(distrib(gen));
+        }
+        // rank resolves the sizes left stale by the inserts since the last query
+        if (i % 100 == 50) {
+            auto& x = nodes[static_cast<std::size_t>(i) / 2];
+            auto const it = typename Tree::iterator{&x};
+            CHECK(tree.rank(it) == std::ranges::distance(tree.begin(), it));
+        }
+    }
+    CHECK(distance(tree.begin(), tree.end()) == n);
+    check_invariants(tree);
+
+    for (int i = 0; i < n / 2; ++i) {
+        auto it = tree.lower_bound(distrib(gen));
+        if (it != tree.end()) {
+            tree.erase(it);
+        }
+        if (i % 100 == 0) {
+            check_ranks(distrib(gen));
+        }
+    }
+    CHECK(distance(tree.begin(), tree.end()) == tree.size());
+    check_invariants(tree);
+
+    auto const size = tree.size();
+    auto right = tree.split(0);
+    Node extra{0};
+    right.insert(extra);
+    tree.join(std::move(right));
+    tree.erase(tree.nth(size / 4), tree.nth(size / 2));
+    CHECK(tree.size() == size + 1 - (size / 2 - size / 4));
+    CHECK(distance(tree.begin(), tree.end()) == tree.size());
+    check_invariants(tree);
+}
+
+struct node_key {
+    constexpr int operator()(node const& x) const { return x.data(); }
+};
+
+// stateful: the order is only known at run time
+struct directed_less {
+    bool descending = false;
+
+    constexpr bool operator()(int lhs, int rhs) const
+    {
+        return descending ? rhs < lhs : lhs < rhs;
+    }
+};
+
+TEST_CASE("Key of", "[key_of]")
+{
+    using Tree = qct::tree<node, directed_less, qct::key_of<node_key>>;
+    static_assert(sizeof(qct::tree<node, node_comparator>) == sizeof(qct::node<>));
+
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    for (bool descending : {false, true}) {
+        directed_less const comp{descending};
+        auto const n = 5000;
+        std::vector<node> nodes;
+        nodes.reserve(n);
+        Tree tree{comp};
+        std::multiset<int, directed_less> expected{comp};
+        CHECK(tree.value_comp().descending == descending);
+
+        auto const check_content = [&] {
+            std::vector<int> content;
+            for (auto const& x : tree) {
+                content.push_back(x.data());
+            }
+            CHECK(std::ranges::equal(content, expected));
+            CHECK(tree.size() == expected.size());
+        };
+
+        auto const check_bounds = [&](int x) {
+            auto const less = std::distance(expected.begin(), expected.lower_bound(x));
+            auto const less_equal = std::distance(expected.begin(), expected.upper_bound(x));
+            CHECK(distance(tree.begin(), tree.lower_bound(x)) == less);
+            CHECK(distance(tree.begin(), tree.upper_bound(x)) == less_equal);
+            CHECK(tree.count_less(x) == less);
+            CHECK(tree.count_less_equal(x) == less_equal);
+            CHECK(tree.count(x) == expected.count(x));
+            CHECK((tree.find(x) == tree.end()) == !expected.contains(x));
+        };
+
+        for (int i = 0; i < n; ++i) {
+            nodes.push_back(node{distrib(gen)});
+            if (i % 2) {
+                tree.insert(tree.lower_bound(nodes.back().data()), nodes.back());
+            }
+            else {
+                tree.insert(nodes.back());
+            }
+            expected.insert(nodes.back().data());
+            if (i % 100 == 0) {
+                check_bounds(distrib(gen));
+            }
+        }
+        check_content();
+
+        for (int i = 0; i < n / 2; ++i) {
+            auto const x = distrib(gen);
+            auto it = tree.find(x);
+            if (it != tree.end()) {
+                tree.erase(it);
+                expected.erase(expected.find(x));
+            }
+            if (i % 100 == 0) {
+                check_bounds(distrib(gen));
+            }
+        }
+        check_content();
+
+        auto right = tree.split(0);
+        CHECK(right.value_comp().descending == descending);
+        CHECK(tree.size() == std::distance(expected.begin(), expected.lower_bound(0)));
+        tree.join(std::move(right));
+        check_content();
+
+        Tree moved{std::move(tree)};
+        CHECK(moved.value_comp().descending == descending);
+        tree = std::move(moved);
+        check_content();
+    }
+}
+
+// counts the descents by depth on top of the default counters
+struct depth_histogram : qct::tree_stats {
+    std::vector<std::size_t> depths;
+
+    void on_descent(std::size_t depth)
+    {
+        qct::tree_stats::on_descent(depth);
+        depths.resize(std::max(depths.size(), depth + 1));
+        ++depths[depth];
+    }
+};
+
+TEST_CASE("Stats", "[stats]")
+{
+    static_assert(
+        sizeof(qct::tree<node, node_comparator>::iterator) == sizeof(void*));
+    static_assert(
+        sizeof(qct::tree<node, node_comparator>) == sizeof(qct::node<>));
+
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    auto const n = 5000;
+    std::vector<node> nodes;
+    nodes.reserve(n);
+    qct::tree<node, node_comparator, qct::stats<depth_histogram>> tree;
+    for (int i = 0; i < n; ++i) {
+        nodes.push_back(node{distrib(gen)});
+        tree.insert(nodes.back());
+    }
+
+    auto const& stats = tree.stats();
+    CHECK(stats.descents == n);
+    CHECK(stats.comparisons == stats.descent_steps);
+    // an AVL tree is less than 1.45 log2(n) high
+    CHECK(stats.max_depth <= 1.45 * std::log2(n + 2));
+    CHECK(stats.size_updates == stats.descent_steps);
+    CHECK(stats.single_rotations + stats.double_rotations > 0);
+    CHECK(stats.single_rotations + stats.double_rotations <= n);
+    CHECK(stats.rebalance_steps >= stats.single_rotations + stats.double_rotations);
+    CHECK(stats.depths.size() == stats.max_depth + 1);
+    CHECK(
+        std::accumulate(stats.depths.begin(), stats.depths.end(), std::size_t{0})
+        == n);
+
+    tree.stats() = {};
+    std::size_t steps = 0;
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+        ++steps;
+    }
+    CHECK(steps == n);
+    CHECK(stats.iterator_steps == n);
+    CHECK(stats.comparisons == 0);
+
+    tree.stats() = {};
+    auto const& const_tree = tree;
+    auto const x = distrib(gen);
+    CHECK(const_tree.count_less(x) == std::ranges::count_if(nodes, [&](node const& y) {
+        return y.data() < x;
+    }));
+    CHECK(stats.descents == 1);
+    CHECK(stats.comparisons == stats.descent_steps);
+    CHECK(stats.comparisons > 0);
+
+    // split and join rebalance the spines they link nodes on
+    tree.stats() = {};
+    auto right = tree.split_at(n / 3);
+    CHECK(stats.single_rotations + stats.double_rotations > 0);
+    CHECK(stats.rebalance_steps >= stats.single_rotations + stats.double_rotations);
+    tree.join(std::move(right));
+    CHECK(tree.size() == n);
+    check_invariants(tree);
+    // a short tree is linked deep on the right spine of a tall one
+    auto tail = tree.split_at(n - 10);
+    tree.stats() = {};
+    tree.join(std::move(tail));
+    CHECK(tree.size() == n);
+    CHECK(stats.rebalance_steps > 0);
+    check_invariants(tree);
+
+    tree.stats() = {};
+    for (int i = 0; i < n / 2; ++i) {
+        tree.erase(tree.begin());
+    }
+    CHECK(tree.size() == n - n / 2);
+    CHECK(stats.rebalance_steps > 0);
+    CHECK(stats.size_updates >= n / 2);
+    CHECK(stats.comparisons == 0);
+
+    // the counters follow the nodes
+    auto const rebalance_steps = stats.rebalance_steps;
+    auto moved = std::move(tree);
+    CHECK(moved.stats().rebalance_steps == rebalance_steps);
+    CHECK(stats.rebalance_steps == 0);
+    moved.clear();
+}
+
+class string_node : public qct::prefix_node<> {
+public:
+    explicit string_node(std::string key) : key_{std::move(key)} {}
+
+    std::string const& key() const { return key_; }
+
+private:
+    std::string key_;
+};
+
+struct string_key {
+    std::string const& operator()(string_node const& x) const { return x.key(); }
+};
+
+static_assert(qct::detail::string_prefix("") == 0);
+static_assert(qct::detail::string_prefix("a") < qct::detail::string_prefix("ab"));
+static_assert(qct::detail::string_prefix("abc") < qct::detail::string_prefix("abd"));
+static_assert(
+    qct::detail::string_prefix("abcdefgh") == qct::detail::string_prefix("abcdefghij"));
+static_assert(
+    qct::detail::string_prefix("\xff") > qct::detail::string_prefix("\x7f\xff\xff"));
+
+TEMPLATE_TEST_CASE("Prefix node", "[prefix_node]", std::less<>, std::greater<>)
+{
+    using Comparator = TestType;
+    using Tree = qct::tree<string_node, Comparator, qct::key_of<string_key>>;
+
+    std::mt19937 gen(seed);
+    // short alphabets and lengths around the prefix width, so that many keys
+    // share their prefix, are prefixes of each other or embed zeros
+    std::uniform_int_distribution<std::size_t> length(0, 12);
+    std::uniform_int_distribution<int> byte(0, 3);
+    auto const make_key = [&] {
+        std::string key(length(gen), '\0');
+        for (auto& c : key) {
+            c = "\0a\x80\xff"[byte(gen)];
+        }
+        return key;
+    };
+
+    auto const n = 3000;
+    std::vector<string_node> nodes;
+    nodes.reserve(2 * n);
+    Tree tree;
+    std::multiset<std::string, Comparator> expected;
+
+    auto const check_bounds = [&](std::string const& x) {
+        auto const less = std::distance(expected.begin(), expected.lower_bound(x));
+        auto const less_equal = std::distance(expected.begin(), expected.upper_bound(x));
+        CHECK(distance(tree.begin(), tree.lower_bound(x)) == less);
+        CHECK(distance(tree.begin(), tree.upper_bound(x)) == less_equal);
+        CHECK(tree.count_less(std::string_view{x}) == less);
+        CHECK(tree.count(x) == expected.count(x));
+        CHECK((tree.find(x) == tree.end()) == !expected.contains(x));
+    };
+
+    for (int i = 0; i < n; ++i) {
+        nodes.emplace_back(make_key());
+        if (i % 2) {
+            tree.insert(tree.lower_bound(nodes.back().key()), nodes.back());
+        }
+        else {
+            tree.insert(nodes.back());
+        }
+        expected.insert(nodes.back().key());
+        if (i % 50 == 0) {
+            check_bounds(make_key());
+        }
+    }
+    for (auto const& x : tree) {
+        CHECK(x.key_prefix() == qct::detail::string_prefix(x.key()));
+    }
+    CHECK(std::ranges::equal(
+        tree, expected, std::equal_to<>{}, [](auto const& x) { return x.key(); }));
+
+    // the bulk paths cache the prefixes too
+    std::vector<std::string> keys(n);
+    std::ranges::generate(keys, make_key);
+    std::ranges::sort(keys, Comparator{});
+    auto const first = nodes.size();
+    for (auto const& key : keys) {
+        nodes.emplace_back(key);
+    }
+    Tree sorted;
+    sorted.assign_sorted(nodes.begin() + first, nodes.end());
+    for (auto const& x : sorted) {
+        CHECK(x.key_prefix() == qct::detail::string_prefix(x.key()));
+    }
+    for (int i = 0; i < 10; ++i) {
+        auto const x = make_key();
+        CHECK(
+            distance(sorted.begin(), sorted.lower_bound(x))
+            == std::ranges::lower_bound(keys, x, Comparator{}) - keys.begin());
+    }
+    sorted.clear();
+    tree.clear();
+}
+
+TEMPLATE_TEST_CASE("Buffered tree", "[buffered_tree]", std::less<>, std::greater<>)
+{
+    using Comparator = TestType;
+    using Tree = qct::buffered_tree<comparable_node, Comparator>;
+
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-300, 300);
+
+    auto const n = 4000;
+    std::forward_list<comparable_node> nodes;
+    Tree tree{37};
+    std::multiset<int, Comparator> expected;
+    CHECK(tree.capacity() == 37);
+
+    auto const check_content = [&] {
+        check_invariants(tree.base());
+        CHECK(tree.size() == expected.size());
+        CHECK(std::ranges::equal(tree, expected, {}, &comparable_node::data));
+        CHECK(std::ranges::equal(
+            std::ranges::subrange(tree.begin(), tree.end()) | std::views::reverse,
+            expected | std::views::reverse,
+            {},
+            &comparable_node::data));
+        CHECK(distance(tree.begin(), tree.end()) == expected.size());
+    };
+
+    auto const check_bounds = [&](int x) {
+        auto const less = std::distance(expected.begin(), expected.lower_bound(x));
+        auto const less_equal = std::distance(expected.begin(), expected.upper_bound(x));
+        CHECK(distance(tree.begin(), tree.lower_bound(x)) == less);
+        CHECK(distance(tree.begin(), tree.upper_bound(x)) == less_equal);
+        CHECK(tree.count_less(x) == less);
+        CHECK(tree.count_less_equal(x) == less_equal);
+        CHECK((tree.find(x) == tree.end()) == !expected.contains(x));
+        if (tree.find(x) != tree.end()) {
+            CHECK(tree.find(x)->data() == x);
+        }
+
+        std::uniform_int_distribution<std::size_t> rank(0, tree.size());
+        for (int i = 0; i < 5; ++i) {
+            auto const k = rank(gen);
+            auto const it = tree.nth(k);
+            CHECK(distance(tree.begin(), it) == k);
+            if (k < tree.size()) {
+                CHECK(it->data() == *std::next(expected.begin(), k));
+            }
+            else {
+                CHECK(it == tree.end());
+            }
+        }
+    };
+
+    for (int i = 0; i < n; ++i) {
+        auto& x = nodes.emplace_front(distrib(gen));
+        tree.insert(x);
+        expected.insert(x.data());
+        CHECK(tree.buffered() < tree.capacity());
+        if (i % 100 == 0) {
+            check_bounds(distrib(gen));
+        }
+    }
+    check_content();
+
+    for (int i = 0; i < n / 2; ++i) {
+        auto const x = distrib(gen);
+        if (i % 2) {
+            auto it = tree.find(x);
+            if (it != tree.end()) {
+                auto const next = tree.erase(it);
+                expected.erase(expected.find(x));
+                CHECK(
+                    distance(tree.begin(), next)
+                    == std::distance(expected.begin(), expected.upper_bound(x))
+                           - static_cast<std::ptrdiff_t>(expected.count(x)));
+            }
+        }
+        else {
+            auto it = tree.lower_bound(x);
+            if (it != tree.end()) {
+                expected.erase(expected.find(it->data()));
+                tree.erase(*it);
+            }
+        }
+        if (i % 100 == 0) {
+            check_bounds(distrib(gen));
+        }
+    }
+    check_content();
+
+    auto const size = tree.size();
+    tree.flush();
+    CHECK(tree.buffered() == 0);
+    CHECK(tree.base().size() == size);
+    check_content();
+    check_bounds(distrib(gen));
+
+    Tree const moved{std::move(tree)};
+    CHECK(std::ranges::equal(moved, expected, {}, &comparable_node::data));
+}
+
+TEMPLATE_TEST_CASE("Compact node", "[compact_node]", std::less<>, std::greater<>)
+{
+    static_assert(sizeof(qct::compact_node<>) == 16);
+
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Comparator = TestType;
+    using Tree = qct::tree<compact_int_node, Comparator>;
+
+    // the tree and its nodes must live in the same arena
+    constexpr auto n = 10000;
+    struct arena {
+        Tree tree;
+        Tree right;
+        std::array<compact_int_node, n> nodes;
+    };
+    auto storage = std::make_unique<arena>();
+    auto& tree = storage->tree;
+    auto& nodes = storage->nodes;
+
+    for (auto& node : nodes) {
+        node = compact_int_node{distrib(gen)};
+        tree.insert(node);
+    }
+    check_invariants(tree);
+
+    for (int i = 0; i < n / 2; ++i) {
+        auto it = tree.lower_bound(distrib(gen));
+        if (it != tree.end()) {
+            tree.erase(it);
+        }
+    }
+    check_invariants(tree);
+
+    for (int i = 0; i < 100; ++i) {
+        auto const x = distrib(gen);
+        auto const lb = tree.lower_bound(x);
+        CHECK(tree.count_less(x) == distance(tree.begin(), lb));
+        CHECK(tree.nth(tree.count_less(x)) == lb);
+        auto const f = tree.find(x);
+        CHECK((f == tree.end() || f == lb));
+    }
+
+    auto const size = tree.size();
+    tree.split_at(size / 2, storage->right);
+    CHECK(tree.size() == size / 2);
+    CHECK(storage->right.size() == size - size / 2);
+    check_invariants(tree);
+    check_invariants(storage->right);
+    tree.join(std::move(storage->right));
+    tree.erase(tree.nth(size / 4), tree.nth(size / 2));
+    CHECK(tree.size() == size - (size / 2 - size / 4));
+    check_invariants(tree);
+
+
+    // a tree on the stack works with nodes on the stack too
+    Tree local;
+    std::array<compact_int_node, 100> local_nodes;
+    for (auto& node : local_nodes) {
+        node = compact_int_node{distrib(gen)};
+        local.insert(node);
+    }
+    check_invariants(local);
+
+    // but heap nodes are out of reach of its header
+    Tree far;
+    auto const heap_node = std::make_unique<compact_int_node>(0);
+    CHECK_THROWS_AS(far.insert(*heap_node), std::out_of_range);
+}
+
+TEMPLATE_TEST_CASE("Tree image", "[tree_image]", std::less<>, std::greater<>)
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Comparator = TestType;
+    using Image = qct::tree_image<compact_int_node, Comparator>;
+
+    constexpr auto n = 10000;
+    std::vector<compact_int_node> sorted;
+    for (int i = 0; i < n; ++i) {
+        sorted.emplace_back(distrib(gen));
+    }
+    std::ranges::sort(sorted, Comparator{});
+
+    auto const size = Image::image_size(n);
+    auto buffer = std::make_unique<std::byte[]>(size + Image::alignment);
+    CHECK(!Image::write({buffer.get(), Image::image_size(n - 1)}, sorted));
+    auto const written = std::span{buffer.get(), size};
+    auto* tree = Image::write(written, sorted);
+    REQUIRE(tree);
+    check_invariants(*tree);
+
+    // the image is usable as is from another address
+    auto const relocated = std::span{buffer.get() + Image::alignment, size};
+    std::memmove(relocated.data(), written.data(), size);
+    std::ranges::fill(written.first(Image::alignment), std::byte{0});
+    std::span<std::byte const> const image = relocated;
+
+    CHECK(!Image::open(image.first(size - 1)));
+    CHECK(!Image::open(image.subspan(1)));
+    CHECK(!Image::open(written));
+    auto const* view = Image::open(image);
+    REQUIRE(view);
+    CHECK(view->size() == n);
+    check_invariants(*view);
+    auto const data = &compact_int_node::data;
+    CHECK(std::ranges::equal(Image::nodes(image), sorted, {}, data, data));
+    CHECK(std::ranges::equal(*view, sorted, {}, data, data));
+
+    for (int i = 0; i < 1000; ++i) {
+        auto const x = distrib(gen);
+        auto const less =
+            std::ranges::lower_bound(sorted, x, Comparator{}, data) - sorted.begin();
+        auto const lb = view->lower_bound(x);
+        CHECK(distance(view->begin(), lb) == less);
+        CHECK(view->count_less(x) == less);
+        CHECK(view->nth(less) == lb);
+        CHECK((view->find(x) == view->end()) == (lb == view->end() || lb->data() != x));
+        auto const [first, last] = view->equal_range(x);
+        CHECK(distance(first, last) == view->count(x));
+    }
+
+    auto const* empty = Image::write(written, std::span<compact_int_node const>{});
+    REQUIRE(empty);
+    CHECK(empty->size() == 0);
+    CHECK(Image::open(written.first(Image::image_size(0))) == empty);
+}
+
+TEMPLATE_TEST_CASE("Frozen tree", "[frozen_tree]", std::less<>, std::greater<>)
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Comparator = TestType;
+
+    for (int n : {0, 1, 2, 3, 7, 8, 100, 1000, 10000}) {
+        std::vector<comparable_node> nodes;
+        nodes.reserve(n);
+        qct::tree<comparable_node, Comparator> tree;
+        for (int i = 0; i < n; ++i) {
+            nodes.emplace_back(distrib(gen));
+            tree.insert(nodes.back());
+        }
+
+        auto const frozen = tree.freeze(&comparable_node::data);
+        std::vector<int> sorted;
+        for (auto const& x : tree) {
+            sorted.push_back(x.data());
+        }
+        CHECK(frozen.size() == n);
+        CHECK(frozen.empty() == (n == 0));
+        CHECK(std::ranges::equal(frozen, sorted));
+        CHECK(std::ranges::equal(
+            std::views::reverse(frozen), std::views::reverse(sorted)));
+        for (int k = 0; k < n; ++k) {
+            CHECK(*frozen.nth(k) == sorted[k]);
+            CHECK(frozen.begin()[k] == sorted[k]);
+        }
+        CHECK(frozen.nth(n) == frozen.end());
+
+        for (int x = -1001; x <= 1001; x += 7) {
+            auto const less = std::ranges::distance(
+                sorted.begin(), std::ranges::lower_bound(sorted, x, Comparator{}));
+            auto const less_equal = std::ranges::distance(
+                sorted.begin(), std::ranges::upper_bound(sorted, x, Comparator{}));
+            CHECK(frozen.lower_bound(x) - frozen.begin() == less);
+            CHECK(frozen.upper_bound(x) - frozen.begin() == less_equal);
+            CHECK(frozen.count_less(x) == less);
+            CHECK(frozen.count_less_equal(x) == less_equal);
+            CHECK(frozen.count(x) == less_equal - less);
+            auto const [first, last] = frozen.equal_range(x);
+            CHECK(distance(first, last) == frozen.count(x));
+            auto const f = frozen.find(x);
+            CHECK((f == frozen.end() ? less == less_equal : *f == x && f == first));
+        }
+    }
+
+    std::vector<node> nodes;
+    qct::tree<node, std::less<>, qct::key_of<node_key>> keyed;
+    for (int i = 0; i < 1000; ++i) {
+        nodes.emplace_back(distrib(gen));
+    }
+    for (auto& x : nodes) {
+        keyed.insert(x);
+    }
+    auto const frozen = keyed.freeze();
+    static_assert(std::same_as<decltype(frozen)::value_type, int>);
+    CHECK(std::ranges::equal(frozen, keyed, {}, {}, &node::data));
+
+    // default constructed and moved from trees have no slots at all
+    qct::frozen_tree<int, Comparator> empty;
+    auto moved = std::move(empty);
+    for (auto const* tree : {&empty, &moved}) {
+        CHECK(tree->empty());
+        CHECK(tree->begin() == tree->end());
+        CHECK(tree->lower_bound(0) == tree->end());
+        CHECK(tree->upper_bound(0) == tree->end());
+        CHECK(tree->find(0) == tree->end());
+        CHECK(tree->count(0) == 0);
+    }
+}
+
+TEST_CASE("Ordered multiset", "[ordered_multiset]")
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    qct::ordered_multiset<int> set;
+    std::multiset<int> expected;
+
+    auto const n = 10000;
+    for (int i = 0; i < n; ++i) {
+        auto const x = distrib(gen);
+        CHECK(*set.emplace(x) == x);
+        expected.insert(x);
+    }
+    CHECK(set.size() == n);
+    CHECK(std::ranges::equal(set, expected));
+
+    for (int i = 0; i < n / 2; ++i) {
+        auto const x = distrib(gen);
+        auto it = set.lower_bound(x);
+        CHECK(set.count_less(x) == std::distance(expected.begin(), expected.lower_bound(x)));
+        CHECK(set.count(x) == expected.count(x));
+        if (it != set.end()) {
+            auto const rank = set.count_less(x);
+            CHECK(set.nth(rank) == it);
+            expected.erase(expected.lower_bound(x));
+            set.erase(it);
+        }
+        if (i % 100 == 0) {
+            CHECK(set.erase(x) == expected.erase(x));
+        }
+    }
+    CHECK(set.size() == expected.size());
+    CHECK(std::ranges::equal(set, expected));
+
+    // recycled slots are reused before allocating new chunks
+    for (int i = 0; i < n; ++i) {
+        auto const x = distrib(gen);
+        set.insert(x);
+        expected.insert(x);
+    }
+    set.erase(set.nth(set.size() / 4), set.nth(set.size() / 2));
+    expected.erase(
+        std::next(expected.begin(), expected.size() / 4),
+        std::next(expected.begin(), expected.size() / 2));
+    CHECK(std::ranges::equal(set, expected));
+
+    auto moved = std::move(set);
+    CHECK(set.empty());
+    CHECK(std::ranges::equal(moved, expected));
+    set = std::move(moved);
+    CHECK(std::ranges::equal(set, expected));
+    set.clear();
+    CHECK(set.empty());
+}
+
+TEST_CASE("Ordered multiset comparator", "[ordered_multiset]")
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    // the order is only known at run time
+    directed_less const comp{true};
+    qct::ordered_multiset<int, directed_less> set{comp};
+    std::multiset<int, directed_less> expected{comp};
+    CHECK(set.value_comp().descending);
+    for (int i = 0; i < 1000; ++i) {
+        auto const x = distrib(gen);
+        set.insert(x);
+        expected.insert(x);
+    }
+    CHECK(std::ranges::equal(set, expected));
+    for (int i = 0; i < 100; ++i) {
+        auto const x = distrib(gen);
+        CHECK(set.count_less(x) == std::distance(expected.begin(), expected.lower_bound(x)));
+        CHECK(set.count(x) == expected.count(x));
+    }
+
+    auto const moved = std::move(set);
+    CHECK(moved.value_comp().descending);
+    CHECK(std::ranges::equal(moved, expected));
+}
+
+TEMPLATE_TEST_CASE(
+    "B+ tree multiset",
+    "[btree_multiset]",
+    (qct::btree_multiset<int>),
+    (qct::btree_multiset<int, std::greater<>>),
+    (qct::btree_multiset<int, std::less<>, 4>),
+    (qct::btree_multiset<int, std::greater<>, 5>),
+    (qct::btree_multiset<std::int64_t, std::less<>, 64>))
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Set = TestType;
+    using Comparator = typename Set::value_compare;
+
+    Set set;
+    std::multiset<int, Comparator> expected;
+    CHECK(set.empty());
+    CHECK(set.begin() == set.end());
+    CHECK(set.lower_bound(0) == set.end());
+    CHECK(set.nth(0) == set.end());
+
+    auto const check_content = [&] {
+        CHECK(set.size() == expected.size());
+        CHECK(std::ranges::equal(set, expected));
+        CHECK(std::ranges::equal(std::views::reverse(set), std::views::reverse(expected)));
+    };
+
+    auto const check_bounds = [&](int x) {
+        auto const less = std::distance(expected.begin(), expected.lower_bound(x));
+        auto const less_equal = std::distance(expected.begin(), expected.upper_bound(x));
+        auto const lb = set.lower_bound(x);
+        CHECK(lb - set.begin() == less);
+        CHECK(lb.rank() == less);
+        CHECK(set.upper_bound(x) - set.begin() == less_equal);
+        CHECK(set.count_less(x) == less);
+        CHECK(set.count_less_equal(x) == less_equal);
+        CHECK(set.count(x) == expected.count(x));
+        CHECK(set.nth(less) == lb);
+        if (lb != set.end()) {
+            CHECK(*lb == *expected.lower_bound(x));
+        }
+        auto const f = set.find(x);
+        CHECK((f == set.end()) == !expected.contains(x));
+        auto const [first, last] = set.equal_range(x);
+        CHECK(distance(first, last) == set.count(x));
+    };
+
+    auto const n = 20000;
+    for (int i = 0; i < n; ++i) {
+        auto const x = distrib(gen);
+        auto const it = set.insert(x);
+        expected.insert(x);
+        CHECK(*it == x);
+        CHECK(it.rank() == std::distance(expected.begin(), expected.upper_bound(x)) - 1);
+        if (i % 100 == 0) {
+            check_bounds(distrib(gen));
+        }
+    }
+    check_content();
+
+    for (std::size_t k = 0; k < set.size(); k += 97) {
+        CHECK(*set.nth(k) == *std::next(expected.begin(), k));
+        CHECK(set.begin() + k == set.nth(k));
+        CHECK(*(set.end() - (set.size() - k)) == *set.nth(k));
+    }
+
+    for (int i = 0; i < n / 2; ++i) {
+        auto const x = distrib(gen);
+        if (i % 2) {
+            CHECK(set.erase(x) == expected.erase(x));
+        }
+        else if (auto it = set.lower_bound(x); it != set.end()) {
+            auto const rank = it.rank();
+            auto const next = set.erase(it);
+            expected.erase(std::next(expected.begin(), rank));
+            CHECK(next.rank() == rank);
+            CHECK(next == set.nth(rank));
+        }
+        if (i % 100 == 0) {
+            check_bounds(distrib(gen));
+        }
+    }
+    check_content();
+
+    while (!set.empty()) {
+        set.erase(set.nth(set.size() / 2));
+        expected.erase(std::next(expected.begin(), expected.size() / 2));
+    }
+    check_content();
+
+    for (int i = 0; i < 1000; ++i) {
+        set.insert(i % 10);
+        expected.insert(i % 10);
+    }
+    Set moved{std::move(set)};
+    CHECK(set.empty());
+    CHECK(moved.erase(3) == 100);
+    expected.erase(3);
+    set = std::move(moved);
+    check_content();
+    set.clear();
+    CHECK(set.empty());
+    CHECK(set.begin() == set.end());
+}
+
+TEST_CASE("Ordered multiset ownership", "[ordered_multiset]")
+{
+    auto const comp = [](auto const& lhs, auto const& rhs) { return *lhs < *rhs; };
+    qct::ordered_multiset<std::shared_ptr<int>, decltype(comp)> set;
+
+    auto const value = std::make_shared<int>(42);
+    for (int i = 0; i < 100; ++i) {
+        set.emplace(value);
+    }
+    CHECK(value.use_count() == 101);
+    set.erase(set.begin());
+    CHECK(value.use_count() == 100);
+    set.erase(set.nth(10), set.nth(20));
+    CHECK(value.use_count() == 90);
+    {
+        auto moved = std::move(set);
+        CHECK(value.use_count() == 90);
+    }
+    CHECK(value.use_count() == 1);
+}
+
+TEMPLATE_TEST_CASE("Augmented node", "[augmented_node]", std::less<>, std::greater<>)
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    using Node = augmented_int_node;
+    using Tree = qct::tree<Node, TestType>;
+
+    auto const n = 5000;
+    std::vector<Node> nodes;
+    nodes.reserve(2 * n);
+    Tree tree;
+
+    auto const check = [&](Tree const& tree) {
+        check_invariants(tree);
+        check_aggregates(static_cast<Node const*>(tree.end()->parent()));
+
+        std::vector<weight_summary::value_type> prefix{weight_summary::identity()};
+        for (auto const& x : tree) {
+            prefix.push_back(weight_summary::lift(x));
+        }
+        for (int i = 0; i < 20; ++i) {
+            auto lo = static_cast<std::size_t>(distrib(gen) + 1000) % (tree.size() + 1);
+            auto hi = static_cast<std::size_t>(distrib(gen) + 1000) % (tree.size() + 1);
+            if (lo > hi) {
+                std::swap(lo, hi);
+            }
+            auto expected = weight_summary::identity();
+            for (auto k = lo; k < hi; ++k) {
+                expected = weight_summary::combine(expected, prefix[k + 1]);
+            }
+            CHECK(tree.fold(tree.nth(lo), tree.nth(hi)) == expected);
+        }
+        CHECK(tree.fold(tree.begin(), tree.end()).count == tree.size());
+    };
+
+    for (int i = 0; i < n; ++i) {
+        nodes.emplace_back(distrib(gen), distrib(gen));
+        if (i % 2 == 0) {
+            tree.insert(nodes.back());
+        }
+        else {
+            tree.insert(tree.lower_bound(nodes.back().data()), nodes.back());
+        }
+    }
+    check(tree);
+
+    for (int i = 0; i < n / 2; ++i) {
+        auto it = tree.lower_bound(distrib(gen));
+        if (it != tree.end()) {
+            tree.erase(it);
+        }
+    }
+    check(tree);
+
+    for (int i = 0; i < 100; ++i) {
+        auto it = tree.nth(static_cast<std::size_t>(distrib(gen) + 1000) % tree.size());
+        it->set_weight(distrib(gen));
+        tree.update(it);
+    }
+    check(tree);
+
+    auto const first = nodes.end();
+    for (int i = 0; i < n; ++i) {
+        nodes.emplace_back(distrib(gen), distrib(gen));
+    }
+    std::sort(first, nodes.end(), TestType{});
+    tree.insert_sorted(first, nodes.end());
+    check(tree);
+
+    auto right = tree.split(0);
+    check(tree);
+    check(right);
+    auto middle = right.split_at(right.size() / 2);
+    right.erase(right.nth(right.size() / 4), right.nth(right.size() / 2));
+    check(right);
+    check(middle);
+    tree.join(std::move(middle));
+    check(tree);
+
+    tree.clear();
+    right.clear();
+    Tree sorted;
+    sorted.assign_sorted(first, nodes.end());
+    check(sorted);
+}
+
+TEMPLATE_TEST_CASE("Weighted node", "[weighted_node]", std::less<>, std::greater<>)
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+    std::uniform_int_distribution<std::uint32_t> weights(0, 10);
+
+    using Node = weighted_int_node;
+    using Tree = qct::tree<Node, TestType>;
+
+    auto const n = 5000;
+    std::vector<Node> nodes;
+    nodes.reserve(n);
+    Tree tree;
+
+    auto const check = [&] {
+        check_invariants(tree);
+
+        std::vector<typename Tree::const_iterator> positions;
+        std::vector<std::uint32_t> before{0};
+        for (auto it = tree.begin(); it != tree.end(); ++it) {
+            positions.push_back(it);
+            before.push_back(before.back() + it->weight());
+        }
+        positions.push_back(tree.end());
+        auto const total = before.back();
+        CHECK(tree.weighted_distance(tree.begin(), tree.end()) == total);
+
+        for (int i = 0; i < 100; ++i) {
+            auto lo = static_cast<std::size_t>(distrib(gen) + 1000) % positions.size();
+            auto hi = static_cast<std::size_t>(distrib(gen) + 1000) % positions.size();
+            if (lo > hi) {
+                std::swap(lo, hi);
+            }
+            CHECK(
+                tree.weighted_distance(positions[lo], positions[hi])
+                == before[hi] - before[lo]);
+
+            auto const key = distrib(gen);
+            auto const rank = std::distance(tree.begin(), tree.lower_bound(key));
+            CHECK(tree.weighted_rank_of(key) == before[rank]);
+
+            auto const w = static_cast<std::uint32_t>(distrib(gen) + 1000) % (total + 2);
+            auto const expected = std::upper_bound(before.begin() + 1, before.end(), w);
+            auto const selected = tree.select_by_weight(w);
+            if (expected == before.end()) {
+                CHECK(selected == tree.end());
+            }
+            else {
+                CHECK(selected == positions[expected - before.begin() - 1]);
+            }
+        }
+    };
+
+    for (int i = 0; i < n; ++i) {
+        nodes.emplace_back(distrib(gen));
+        nodes.back().set_weight(weights(gen));
+        tree.insert(nodes.back());
+    }
+    check();
+
+    for (int i = 0; i < n / 2; ++i) {
+        auto it = tree.lower_bound(distrib(gen));
+        if (it != tree.end()) {
+            tree.erase(it);
+        }
+    }
+    check();
+
+    for (int i = 0; i < 500; ++i) {
+        auto it = tree.nth(static_cast<std::size_t>(distrib(gen) + 1000) % tree.size());
+        it->set_weight(weights(gen));
+        tree.update(it);
+    }
+    check();
+
+    auto right = tree.split(0);
+    tree.join(std::move(right));
+    check();
+}
+
+class shared_node : public qct::atomic_node {
+public:
+    explicit shared_node(int x) : x_(x) {}
+
+    friend auto operator<=>(shared_node const& lhs, shared_node const& rhs)
+    {
+        return lhs.x_ <=> rhs.x_;
+    }
+    friend auto operator<=>(shared_node const& lhs, int rhs) { return lhs.x_ <=> rhs; }
+
+    int const& data() const { return x_; }
+
+private:
+    int x_;
+};
+
+TEST_CASE("Concurrent tree", "[concurrent_tree]")
+{
+    // even keys are always present, odd keys come and go
+    auto const n = 2000;
+    std::vector<shared_node> nodes;
+    nodes.reserve(2 * n);
+    for (int i = 0; i < 2 * n; ++i) {
+        nodes.emplace_back(i);
+    }
+
+    qct::concurrent_tree<shared_node> tree;
+    for (int i = 0; i < 2 * n; i += 2) {
+        tree.insert(nodes[i]);
+    }
+    CHECK(tree.size() == n);
+
+    std::atomic<bool> done{false};
+    std::atomic<int> failures{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&, t] {
+            std::mt19937 gen(seed + t);
+            std::uniform_int_distribution<int> distrib(0, 2 * n - 1);
+            while (!done.load(std::memory_order_relaxed)) {
+                auto const x = distrib(gen) & ~1;
+                auto const* found = tree.find(x);
+                if (found != &nodes[x]) {
+                    failures++;
+                }
+                auto const permanent = static_cast<std::size_t>(x / 2);
+                auto const less = tree.count_less(x);
+                if (less < permanent || less > static_cast<std::size_t>(x)) {
+                    failures++;
+                }
+                auto const* lb = tree.lower_bound(x - 1);
+                if (!lb || lb->data() < x - 1 || lb->data() > x) {
+                    failures++;
+                }
+                // there are always more nodes than permanent ones
+                if (!tree.nth(permanent)) {
+                    failures++;
+                }
+                if (tree.distance(x, x + 1) != 1) {
+                    failures++;
+                }
+            }
+        });
+    }
+
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(0, n - 1);
+    std::vector<bool> linked(2 * n, false);
+    for (int i = 0; i < 100000; ++i) {
+        auto const x = 2 * distrib(gen) + 1;
+        if (linked[x]) {
+            tree.erase(nodes[x]);
+        }
+        else {
+            tree.insert(nodes[x]);
+        }
+        linked[x] = !linked[x];
+    }
+    done = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    CHECK(failures == 0);
+    CHECK(tree.size() == n + static_cast<std::size_t>(std::ranges::count(linked, true)));
+    tree.write([](auto const& tree) { check_invariants(tree); });
+}
+
+namespace {
+
+struct counted {
+    static inline int live = 0;
+
+    explicit counted(int x) : x(x) { ++live; }
+    counted(counted const& other) : x(other.x) { ++live; }
+    ~counted() { --live; }
+
+    auto operator<=>(counted const&) const = default;
+    friend auto operator<=>(counted const& lhs, int rhs) { return lhs.x <=> rhs; }
+
+    int x;
+};
+
+}
+
+TEST_CASE("Persistent tree", "[persistent_tree]")
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    {
+        qct::persistent_tree<counted> tree;
+        std::multiset<int> expected;
+        std::vector<std::pair<qct::persistent_tree<counted>, std::vector<int>>> snapshots;
+
+        auto const check = [](auto const& tree, std::vector<int> const& expected) {
+            CHECK(tree.size() == expected.size());
+            CHECK(std::ranges::equal(
+                tree, expected, [](counted const& lhs, int rhs) { return lhs.x == rhs; }));
+            CHECK(std::ranges::equal(
+                std::make_reverse_iterator(tree.end()),
+                std::make_reverse_iterator(tree.begin()),
+                expected.rbegin(),
+                expected.rend(),
+                [](counted const& lhs, int rhs) { return lhs.x == rhs; }));
+            CHECK(distance(tree.begin(), tree.end()) == expected.size());
+            for (std::size_t k = 0; k < expected.size(); k += 97) {
+                auto const it = tree.nth(k);
+                CHECK(it->x == expected[k]);
+                CHECK(distance(tree.begin(), it) == k);
+                auto const lb = tree.lower_bound(expected[k]);
+                auto const rank = std::ranges::lower_bound(expected, expected[k]) - expected.begin();
+                CHECK(lb == tree.nth(rank));
+                CHECK(lb->x == expected[k]);
+                CHECK(tree.count_less(expected[k]) == rank);
+                CHECK(tree.find(expected[k]) == lb);
+                auto const ub = std::ranges::upper_bound(expected, expected[k]) - expected.begin();
+                CHECK(distance(lb, tree.upper_bound(expected[k])) == ub - rank);
+            }
+            CHECK(tree.nth(expected.size()) == tree.end());
+        };
+
+        for (int i = 0; i < 5000; ++i) {
+            auto const x = distrib(gen);
+            if (i % 3 == 2) {
+                auto const it = expected.find(x);
+                CHECK(tree.erase(x) == (it != expected.end()));
+                if (it != expected.end()) {
+                    expected.erase(it);
+                }
+            }
+            else {
+                tree.insert(counted{x});
+                expected.insert(x);
+            }
+            if (i % 1000 == 0) {
+                snapshots.emplace_back(tree.snapshot(), std::vector<int>(expected.begin(), expected.end()));
+            }
+        }
+        check(tree, std::vector<int>(expected.begin(), expected.end()));
+        for (auto const& [snapshot, content] : snapshots) {
+            check(snapshot, content);
+        }
+
+        snapshots.clear();
+        tree.clear();
+        CHECK(tree.empty());
+        CHECK(tree.begin() == tree.end());
+    }
+    CHECK(counted::live == 0);
+}
+
+TEST_CASE("Persistent tree comparator", "[persistent_tree]")
+{
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> distrib(-1000, 1000);
+
+    directed_less const comp{true};
+    qct::persistent_tree<int, directed_less> tree{comp};
+    std::multiset<int, directed_less> expected{comp};
+    for (int i = 0; i < 1000; ++i) {
+        auto const x = distrib(gen);
+        tree.insert(x);
+        expected.insert(x);
+    }
+    auto const snapshot = tree.snapshot();
+    for (int i = 0; i < 500; ++i) {
+        auto const x = distrib(gen);
+        auto const it = expected.find(x);
+        CHECK(tree.erase(x) == (it != expected.end()));
+        if (it != expected.end()) {
+            expected.erase(it);
+        }
+    }
+    CHECK(std::ranges::equal(tree, expected));
+    CHECK(snapshot.value_comp().descending);
+    CHECK(std::ranges::is_sorted(snapshot, comp));
+    for (int i = 0; i < 100; ++i) {
+        auto const x = distrib(gen);
+        CHECK(tree.count_less(x) == std::distance(expected.begin(), expected.lower_bound(x)));
+        CHECK((tree.find(x) == tree.end()) == !expected.contains(x));
+    }
+}